@@ -26,9 +26,177 @@
 #define RTOD(x) ((x) * 180 / M_PI)
 #define CMP_ZERO(x) ((x) < 0 ? -1 : (x) > 0 ? 1 : 0)
 
+// Offset of a collision mask from the lander's position, so that both are centered on the sprite
+#define MASK_OFFSET_X ((LANDER_WIDTH - LANDER_MASK_SIZE) / 2)
+#define MASK_OFFSET_Y ((LANDER_HEIGHT - LANDER_MASK_SIZE) / 2)
+// Tiles checked around the lander's mask on each side, so it can drift a while before they need checking again
+#define NEAR_MARGIN 1
+
+/* The rotation Lander_render draws the sprite with, in radians clockwise.
+ * See the comment there for why it is offset. */
+static float render_rotation(float angle) {
+	return M_PI / 2.0f - angle;
+}
+
+/* Bake the opaque pixels of the sprite into a mask for each angle, rotated around its
+ * center the same way SDL_RenderCopyEx rotates it, so collision matches what is on screen. */
+static void create_masks(Lander *l) {
+	for (int a = 0; a < LANDER_ANGLES; ++a) {
+		float rotation = a * 2.0f * M_PI / LANDER_ANGLES;
+		float c = SDL_cosf(rotation), s = SDL_sinf(rotation);
+		for (int y = 0; y < LANDER_MASK_SIZE; ++y) {
+			Uint32 row = 0;
+			for (int x = 0; x < LANDER_MASK_SIZE; ++x) {
+				// Center of the pixel relative to the center of the sprite, with y going up
+				float px = MASK_OFFSET_X + x + 0.5f - LANDER_WIDTH / 2.0f;
+				float py = MASK_OFFSET_Y + y + 0.5f - LANDER_HEIGHT / 2.0f;
+				
+				// Rotate it back counterclockwise to find where it came from on the sprite.
+				int sx = SDL_floorf(LANDER_WIDTH / 2.0f + px * c - py * s);
+				int sy = SDL_floorf(LANDER_HEIGHT / 2.0f - (px * s + py * c));
+				if (
+					sx >= 0 && sx < LANDER_WIDTH && sy >= 0 && sy < LANDER_HEIGHT &&
+					!TileSheet_isTransparent(l->sprite_sheet, 0, sx, sy)
+				) row |= 1u << x;
+			}
+			l->masks[a][y] = row;
+		}
+	}
+}
+
+// The mask for the angle closest to the one the lander is drawn at
+static const Uint32 *mask_for(Lander *l, float angle) {
+	int a = (int) SDL_floorf(render_rotation(angle) * LANDER_ANGLES / (2.0f * M_PI) + 0.5f) % LANDER_ANGLES;
+	if (a < 0) a += LANDER_ANGLES;
+	return l->masks[a];
+}
+
+// Whether the lander would hit the map at a given position and angle.
+static SDL_bool collides(Lander *l, float x, float y, float angle) {
+	return ML2_Map_doMaskCollision(
+		l->map,
+		(int) SDL_floorf(x) + MASK_OFFSET_X, (int) SDL_floorf(y) + MASK_OFFSET_Y,
+		mask_for(l, angle), LANDER_MASK_SIZE
+	);
+}
+
+/* Lift the lander straight up to the first spot where it doesn't overlap the map.
+ * There is always one, since nothing is solid above the top of the map. */
+static void push_out(Lander *l) {
+	float top = (float) l->map->height * l->map->tiles->tile_height - MASK_OFFSET_Y;
+	float y = SDL_floorf(l->pos_y) + 1.0f;
+	while (y < top && collides(l, l->pos_x, y, l->angle)) y += 1.0f;
+	l->pos_y = y;
+}
+
+/* Move the lander, stopping it where it touches the map and sliding it along whatever it hit
+ * for the rest of the move. Returns which axes it hit on (ML2_Map_CollisionAxis flags). */
+static int move(Lander *l, float dx, float dy) {
+	const Uint32 *mask = mask_for(l, l->angle);
+	int collision = 0;
+	SDL_bool pushed = SDL_FALSE;
+	
+	// A second sweep is enough to slide along the surface, after that both axes are blocked.
+	for (int i = 0; i < 2 && (dx || dy); ++i) {
+		ML2_Map_Sweep sweep;
+		SDL_bool hit = ML2_Map_sweepMask(
+			l->map, l->pos_x + MASK_OFFSET_X, l->pos_y + MASK_OFFSET_Y,
+			dx, dy, mask, LANDER_MASK_SIZE, &sweep
+		);
+		l->pos_x = sweep.x - MASK_OFFSET_X;
+		l->pos_y = sweep.y - MASK_OFFSET_Y;
+		if (!hit) break;
+		
+		/* Already inside the ground (it started there, or was wrapped into it), which would stop every move.
+		 * Push it out on top and make the move from there instead. */
+		if (!sweep.normal_x && !sweep.normal_y) {
+			if (pushed) return ML2_MAP_COLLIDED_X | ML2_MAP_COLLIDED_Y;
+			push_out(l);
+			pushed = SDL_TRUE;
+			--i; // this sweep didn't move it, so it doesn't count
+			continue;
+		}
+		
+		float rest = 1.0f - sweep.time;
+		if (sweep.normal_x) {
+			collision |= ML2_MAP_COLLIDED_X;
+			dx = 0.0f;
+		} else {
+			dx *= rest;
+		}
+		if (sweep.normal_y) {
+			collision |= ML2_MAP_COLLIDED_Y;
+			dy = 0.0f;
+		} else {
+			dy *= rest;
+		}
+	}
+	return collision;
+}
+
+// Tiles covered by the pixels from (x0, y0) to (x1, y1) inclusive, plus a margin of tiles on each side
+static SDL_Rect tiles_under(const ML2_Map *map, int x0, int y0, int x1, int y1, int margin) {
+	float tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	int tx0 = (int) SDL_floorf(x0 / tile_width) - margin, ty0 = (int) SDL_floorf(y0 / tile_height) - margin;
+	int tx1 = (int) SDL_floorf(x1 / tile_width) + margin, ty1 = (int) SDL_floorf(y1 / tile_height) + margin;
+	return (SDL_Rect) {tx0, ty0, tx1 - tx0 + 1, ty1 - ty0 + 1};
+}
+
+/* Whether every pixel the mask passes through moving by (dx, dy) is in tiles known to be empty.
+ * Positions are rounded the same way ML2_Map_sweepMask rounds them. */
+static SDL_bool moves_freely(Lander *l, float dx, float dy) {
+	if (!l->near_empty || l->near_generation != l->map->generation) return SDL_FALSE;
+	float x = l->pos_x + MASK_OFFSET_X, y = l->pos_y + MASK_OFFSET_Y;
+	int x0 = (int) SDL_floorf(x), y0 = (int) SDL_floorf(y);
+	int x1 = (int) SDL_floorf(x + dx), y1 = (int) SDL_floorf(y + dy);
+	SDL_Rect tiles = tiles_under(
+		l->map, SDL_min(x0, x1), SDL_min(y0, y1),
+		SDL_max(x0, x1) + LANDER_MASK_SIZE - 1, SDL_max(y0, y1) + LANDER_MASK_SIZE - 1, 0
+	);
+	return
+		tiles.x >= l->near_tiles.x && tiles.x + tiles.w <= l->near_tiles.x + l->near_tiles.w &&
+		tiles.y >= l->near_tiles.y && tiles.y + tiles.h <= l->near_tiles.y + l->near_tiles.h;
+}
+
+/* Check the tiles around the lander for anything solid, unless they were already checked.
+ * Tiles outside of the map are empty, the same as for collision, unless the map wraps around. */
+static void check_near_tiles(Lander *l) {
+	int x = (int) SDL_floorf(l->pos_x + MASK_OFFSET_X), y = (int) SDL_floorf(l->pos_y + MASK_OFFSET_Y);
+	SDL_Rect tiles = tiles_under(l->map, x, y, x + LANDER_MASK_SIZE - 1, y + LANDER_MASK_SIZE - 1, NEAR_MARGIN);
+	if (l->near_generation == l->map->generation && SDL_RectEquals(&tiles, &l->near_tiles)) return;
+	
+	l->near_tiles = tiles;
+	l->near_generation = l->map->generation;
+	l->near_empty = SDL_TRUE;
+	int width = l->map->width;
+	SDL_bool wrap = l->map->flags & ML2_MAP_WRAP_X && width;
+	for (int ty = SDL_max(tiles.y, 0); ty < SDL_min(tiles.y + tiles.h, (int) l->map->height); ++ty) {
+		for (int tx = tiles.x; tx < tiles.x + tiles.w; ++tx) {
+			int column = wrap ? (tx % width + width) % width : tx;
+			if (column < 0 || column >= width) continue;
+			int tile = ML2_Map_getTile(l->map, column, ty, NULL);
+			if (tile != -1 && TileSheet_getSolidity(l->map->tiles, tile) != TILESHEET_TILE_EMPTY) {
+				l->near_empty = SDL_FALSE;
+				return;
+			}
+		}
+	}
+}
+
 void Lander_physics(Lander *l, Uint64 delta_ms) {
 	float delta = delta_ms / 1000.0f; // delta in seconds (as float)
-	l->angle -= l->turning * delta * 2.5f;
+	
+	/* Every change of angle goes through here, so the lander can't be turned into the ground.
+	 * Tiles known to be empty around it are clear at any angle. If it is already stuck in the ground,
+	 * it can turn as long as that doesn't make things worse. */
+	l->target_angle -= l->turning * delta * 2.5f;
+	if (l->target_angle != l->angle) {
+		if (
+			moves_freely(l, 0.0f, 0.0f) || !collides(l, l->pos_x, l->pos_y, l->target_angle) ||
+			collides(l, l->pos_x, l->pos_y, l->angle)
+		) l->angle = l->target_angle;
+		else l->target_angle = l->angle;
+	}
 
 	if (l->state && l->fuel_level > 0.0f) {
 		// if the fast flag is active (left shift being held) multiply accel by 3
@@ -55,25 +223,37 @@ void Lander_physics(Lander *l, Uint64 delta_ms) {
 	l->vel_y = l->vel_fuel_y + l->vel_grav;
 	l->speed = SDL_fabsf(SDL_roundf(SDL_sqrtf(l->vel_x * l->vel_x + l->vel_y * l->vel_y)));
 
-	SDL_Rect collision_rect_old = {l->pos_x, l->pos_y, LANDER_WIDTH, LANDER_HEIGHT};
-	l->pos_x += l->vel_x * delta;
-	l->pos_y += l->vel_y * delta;
+	float dx = l->vel_x * delta, dy = l->vel_y * delta;
+	int collision = 0;
+	SDL_bool unobstructed = moves_freely(l, dx, dy);
+	if (unobstructed) {
+		// Nothing near enough to hit, so this lands exactly where an unobstructed sweep would.
+		l->pos_x = (l->pos_x + MASK_OFFSET_X + dx) - MASK_OFFSET_X;
+		l->pos_y = (l->pos_y + MASK_OFFSET_Y + dy) - MASK_OFFSET_Y;
+	} else {
+		/* Collision is pixel-perfect and swept along the whole move,
+		 * so long frames and high speeds can't carry the lander through the ground. */
+		collision = move(l, dx, dy);
+	}
 
 	// Make the lander wrap around the map horizontally
-	if (l->pos_x > l->map->width * l->map->tiles->tile_width)
-		l->pos_x -= l->map->width * l->map->tiles->tile_width;
-	else if (l->pos_x < -l->map->tiles->tile_width)
-		l->pos_x += l->map->width * l->map->tiles->tile_width;
+	float map_width = (float) l->map->width * l->map->tiles->tile_width;
+	if (l->map->flags & ML2_MAP_WRAP_X && map_width > 0.0f) {
+		// The map joins up seamlessly, so the lander can be kept on it.
+		if (l->pos_x < 0.0f || l->pos_x >= map_width) l->pos_x -= SDL_floorf(l->pos_x / map_width) * map_width;
+	} else if (l->pos_x > map_width) {
+		l->pos_x -= map_width;
+	} else if (l->pos_x < -l->map->tiles->tile_width) {
+		l->pos_x += map_width;
+	}
+
+	if (!unobstructed) check_near_tiles(l);
 
-	SDL_Rect collision_rect = {l->pos_x, l->pos_y, LANDER_WIDTH, LANDER_HEIGHT};
-	int collision = ML2_Map_doCollision(l->map, &collision_rect, &collision_rect_old);
 	if (collision & ML2_MAP_COLLIDED_X) {
-		l->pos_x -= l->vel_x * delta;
 		l->vel_fuel_x /= 2.0f;
 	}
 
 	if (collision & ML2_MAP_COLLIDED_Y) {
-		l->pos_y -= l->vel_y * delta;
 		l->vel_fuel_y /= 2.0f;
 		l->vel_grav = 0.0f;
 	}
@@ -83,9 +263,10 @@ Lander *Lander_create(SDL_Renderer *renderer, ML2_Map *map) {
 	Lander *l = SDL_malloc(sizeof(Lander));
 	*l = (Lander) {
 		.renderer = renderer,
-		.sprite_sheet = TileSheet_create("Sprites/LunarModule.bmp", renderer, LANDER_WIDTH, LANDER_HEIGHT, 0),
+		.sprite_sheet = TileSheet_create("Sprites/LunarModule.bmp", renderer, LANDER_WIDTH, LANDER_HEIGHT, TILESHEET_CREATESURFACE),
 		.map = map
 	};
+	create_masks(l);
 
 	Lander_reset(l);
 	return l;
@@ -107,8 +288,11 @@ void Lander_reset(Lander *l) {
 	l->vel_grav = 0.0f;
 	l->speed = 0.0f;
 	l->angle = M_PI / 2.0f;
+	l->target_angle = l->angle;
 	l->anim_frame = 0;
 	l->anim_timer = 0;
+	l->near_tiles = (SDL_Rect) {0};
+	l->near_empty = SDL_FALSE;
 }
 
 void Lander_render(Lander *l, SDL_Point *camera_pos) {
@@ -132,6 +316,6 @@ void Lander_render(Lander *l, SDL_Point *camera_pos) {
 	SDL_RenderCopyEx(
 		l->renderer, l->sprite_sheet->texture,
 		&sprite, &lander_rect,
-		RTOD(-l->angle) + 90, NULL, SDL_FLIP_NONE
+		RTOD(render_rotation(l->angle)), NULL, SDL_FLIP_NONE
 	);
 }
@@ -15,6 +15,8 @@
 
 #define LANDER_WIDTH 16
 #define LANDER_HEIGHT 13
+#define LANDER_ANGLES 64 ///< Number of angles the lander has a collision mask for
+#define LANDER_MASK_SIZE 24 ///< Width and height of a collision mask, large enough for the sprite at any angle
 
 /**
  * @brief The data structure holding the state for the lander representing a player.
@@ -29,6 +31,7 @@ typedef struct {
 	float vel_y; ///< y velocity of the lander;
 	float speed; ///< non-directional speed of the lander as a round number
 	float angle; ///< direction of the lander as an angle in radians
+	float target_angle; ///< direction the player is turning the lander to, which Lander_physics only allows if it doesn't hit the map
 	float vel_grav; ///< gravity component of the lander's velocity;
 	float vel_fuel_x; ///< fuel component of the lander's velocity, x direction
 	float vel_fuel_y; ///< fuel component of the lander's velocity, y direction
@@ -38,6 +41,10 @@ typedef struct {
 	char turning; ///< The direction the player is turning
 	SDL_bool state; ///< Whether the player is accelerating
 	SDL_bool fast; ///< Whether the player is going fast
+	Uint32 masks[LANDER_ANGLES][LANDER_MASK_SIZE]; ///< Collision masks of the sprite at each angle (see ML2_Map_doMaskCollision)
+	SDL_Rect near_tiles; ///< Tiles around the lander that were last checked for terrain (see Lander_physics)
+	Uint32 near_generation; ///< Generation of the map when near_tiles was checked
+	SDL_bool near_empty; ///< Whether every tile in near_tiles was empty, so the lander can move freely within them
 } Lander;
 
 /**
@@ -65,6 +72,8 @@ void Lander_reset(Lander *l);
 
 /**
  * @brief Run physics calculations for the current frame
+ * @details While the lander stays within tiles that are known to be empty, collision isn't checked at all.
+ * The tiles are checked again whenever it leaves them or the map is edited.
  *
  * @param l The lander object to do physics calculations on
  * @param delta_ms The amount of time since the last frame in milliseconds
@@ -25,11 +25,13 @@ static SDL_Renderer *renderer;
 static SDL_Texture *render_texture;
 static Font *font;
 static ML2_Map *map;
+static ML2_MapLoader *map_loader;
 
 /* This function frees all game memory in preparation to exit the program.
  * It should be registered using atexit(), so you should never need to call it.
  * If you want to exit the program early, use exit() like you normally would. */
 static void exit_game(void) {
+	if (map_loader) map = ML2_Map_finish(map_loader, renderer);
 	ML2_Map_free(map);
 	SDL_DestroyTexture(render_texture);
 	SDL_DestroyRenderer(renderer);
@@ -78,7 +80,12 @@ static void init_game(const char *map_path) {
 		exit(1);
 	}
 
-	map = ML2_Map_loadFromFile(map_path, renderer);
+	// The map loads in the background while the title screen is up.
+	map_loader = ML2_Map_loadAsync(map_path, ML2_MAP_READONLY);
+	if (!map_loader) {
+		fprintf(stderr, "ML2_Map_loadAsync: %s\n", SDL_GetError());
+		exit(1);
+	}
 
 	atexit(exit_game);
 }
@@ -107,6 +114,27 @@ static void render_title(SDL_Texture *title) {
 	SDL_SetRenderDrawColor(renderer, 0x9C, 0x9C, 0x9C, 0xFF);
 	SDL_RenderDrawRects(renderer, outline, 4);
 	SDL_RenderCopy(renderer, title, NULL, &title_rect);
+
+	if (map_loader) {
+		// Glyphs are 8 pixels wide
+		SDL_Point loading_point = {screen_w / 2 - 8 * 7 / 2, screen_h * 2 / 3};
+		Font_renderText(font, renderer, &loading_point, "LOADING");
+	}
+}
+
+// Pick up the map once the worker thread is done with it.
+static void finish_loading_map(void) {
+	map = ML2_Map_finish(map_loader, renderer);
+	map_loader = NULL;
+	if (!map) {
+		fprintf(stderr, "ML2_Map_finish: %s\n", SDL_GetError());
+		exit(1);
+	}
+
+	// The altitude readout can do without it, so this isn't fatal.
+	if (!ML2_Map_createHeightmap(map)) {
+		fprintf(stderr, "ML2_Map_createHeightmap: %s\n", SDL_GetError());
+	}
 }
 
 static SDL_Point get_camera_pos(const SDL_Point *player_pos) {
@@ -115,10 +143,13 @@ static SDL_Point get_camera_pos(const SDL_Point *player_pos) {
 		player_pos->y - screen_h / 2
 	};
 
-	if (camera_pos.x < 0) {
-		camera_pos.x = 0;
-	} else if ((unsigned) camera_pos.x > map->width * 16 - screen_w) {
-		camera_pos.x = map->width * 16 - screen_w;
+	// Maps that wrap around have no edges to stop at horizontally.
+	if (!(map->flags & ML2_MAP_WRAP_X)) {
+		if (camera_pos.x < 0) {
+			camera_pos.x = 0;
+		} else if ((unsigned) camera_pos.x > map->width * 16 - screen_w) {
+			camera_pos.x = map->width * 16 - screen_w;
+		}
 	}
 
 	if (camera_pos.y < 0) {
@@ -161,6 +192,8 @@ static void title_screen(void) {
 			}
 		}
 
+		if (map_loader && ML2_Map_poll(map_loader)) finish_loading_map();
+
 		SDL_SetRenderTarget(renderer, render_texture);
 		render_title(title_texture);
 		render_screen();
@@ -168,10 +201,18 @@ static void title_screen(void) {
 
 	SDL_DestroyTexture(title_texture);
 	if (quit) exit(0);
+	// The player may have started before the map was done loading.
+	if (map_loader) finish_loading_map();
 }
 
-static void render_hud(float speed, float fuel) {
-	Font_renderFormatted(font, renderer, NULL, "SPEED %.0f\nFUEL %.0f", speed, fuel);
+static void render_hud(const Lander *l) {
+	if (map->heights) {
+		// Height of the bottom of the lander above the ground straight below its center
+		float altitude = l->pos_y - ML2_Map_getSurfaceHeight(map, (int) SDL_floorf(l->pos_x) + LANDER_WIDTH / 2);
+		Font_renderFormatted(font, renderer, NULL, "SPEED %.0f\nFUEL %.0f\nALTITUDE %.0f", l->speed, l->fuel_level, altitude);
+	} else {
+		Font_renderFormatted(font, renderer, NULL, "SPEED %.0f\nFUEL %.0f", l->speed, l->fuel_level);
+	}
 }
 
 static void game_loop(void) {
@@ -242,7 +283,7 @@ static void game_loop(void) {
 			mouse_y = screen_h - mouse_y * screen_h / win_h;
 			int lander_screen_x = lander_point.x - camera_pos.x + LANDER_WIDTH / 2;
 			int lander_screen_y = lander_point.y - camera_pos.y + LANDER_HEIGHT / 2;
-			l->angle = SDL_atan2f(mouse_y - lander_screen_y, mouse_x - lander_screen_x);
+			l->target_angle = SDL_atan2f(mouse_y - lander_screen_y, mouse_x - lander_screen_x);
 		}
 
 #define UNPACK_COLOR(color) (color).r, (color).g, (color).b, (color).a
@@ -253,7 +294,7 @@ static void game_loop(void) {
 
 		ML2_Map_render(map, renderer, &camera_pos);
 		Lander_render(l, &camera_pos);
-		render_hud(l->speed, l->fuel_level);
+		render_hud(l);
 
 		render_screen();
 	}
@@ -29,8 +29,8 @@ void new_window(bool *open, ML2_Map **map, SDL_Renderer *renderer, SDL_Point *ca
 	}
 
 	static int w, h, start_fuel;
-	ImGui::InputInt("Width", &w);
-	ImGui::InputInt("Height", &h);
+	if (ImGui::InputInt("Width", &w) && w < 0) w = 0;
+	if (ImGui::InputInt("Height", &h) && h < 0) h = 0;
 	ImGui::InputInt("Starting Fuel", &start_fuel);
 
 	static float col[3];
@@ -47,6 +47,19 @@ void new_window(bool *open, ML2_Map **map, SDL_Renderer *renderer, SDL_Point *ca
 	ImGui::InputText("Path", ts_path, PATH_MAX);
 	if (ts != TILESHEET_CUSTOM) ImGui::EndDisabled();
 
+	static bool chunked = false;
+	ImGui::Checkbox("Chunked (for large maps)", &chunked);
+	static bool compressed = true;
+	ImGui::Checkbox("Compress tile data", &compressed);
+	static bool raw_sheet = false;
+	if (ts != TILESHEET_CUSTOM) ImGui::BeginDisabled();
+	ImGui::Checkbox("Store tilesheet as raw pixels (faster loading)", &raw_sheet);
+	if (ts != TILESHEET_CUSTOM) ImGui::EndDisabled();
+	static bool wide_tiles = false;
+	ImGui::Checkbox("16-bit tiles (more than 64 tile types)", &wide_tiles);
+	static bool wrap_x = false;
+	ImGui::Checkbox("Wrap around horizontally", &wrap_x);
+
 	if (ImGui::Button("Create")) {
 		ML2_Map params = {
 			.width = w,
@@ -56,7 +69,10 @@ void new_window(bool *open, ML2_Map **map, SDL_Renderer *renderer, SDL_Point *ca
 			.start_fuel = start_fuel,
 			.bgcolor = {col[0] * 255, col[1] * 255, col[2] * 255, 255},
 			.tiles = ts ? nullptr : TileSheet_create(ts_path, renderer, 16, 16, TILESHEET_CREATESURFACE),
-			.tilesheet_enum = ts
+			.tilesheet_enum = ts,
+			.flags = (chunked ? ML2_MAP_CHUNKED : 0u) | (compressed ? ML2_MAP_COMPRESSED : 0u) |
+				(raw_sheet && ts == TILESHEET_CUSTOM ? ML2_MAP_RAW_SHEET : 0u) |
+				(wide_tiles ? ML2_MAP_WIDE_TILES : 0u) | (wrap_x ? ML2_MAP_WRAP_X : 0u)
 		};
 
 		ML2_Map_free(*map);
@@ -82,7 +98,7 @@ void open_dialog(ML2_Map **map, SDL_Renderer *renderer) {
 	char *result = tinyfd_openFileDialog("Open", NULL, 1, map_filter_patterns, "map files", 0);
 	if (result) {
 		strcpy(file_path, result);
-		*map = ML2_Map_loadFromFile(file_path, renderer);
+		*map = ML2_Map_mapFile(file_path, renderer, ML2_MAP_COPYONWRITE);
 	}
 }
 
@@ -104,7 +120,10 @@ void tiles_window(bool *open, ML2_Map *map, int *selected_tile) {
 	if (map) {
 		int ts_w = map->tiles->tile_width * map->tiles->sheet_width;
 		int ts_h = map->tiles->tile_height * map->tiles->sheet_height;
-		for (size_t i = 0; i < TILE_COUNT; ++i) {
+		int tile_count = map->tilesheet_enum ? TILE_COUNT : map->tiles->sheet_width * map->tiles->sheet_height;
+		int max_tiles = map->flags & ML2_MAP_WIDE_TILES ? ML2_MAP_MAX_WIDE_TILES : ML2_MAP_MAX_TILES;
+		if (tile_count > max_tiles) tile_count = max_tiles;
+		for (int i = 0; i < tile_count; ++i) {
 			SDL_Rect clip = TileSheet_getTileRect(map->tiles, i);
 			ImVec2 uv0 = ImVec2((float) clip.x / ts_w, (float) clip.y / ts_h);
 			ImVec2 uv1 = ImVec2((float) (clip.x + clip.w) / ts_w, (float) (clip.y + clip.h) / ts_h);
@@ -0,0 +1,73 @@
+/**
+ * @file
+ * @brief Tool for packing maps into a map pack.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+#include "pack.h"
+
+// Maps are named after their file, without the directory or extension.
+static char *map_name(const char *path) {
+	const char *start = SDL_strrchr(path, '/');
+	const char *backslash = SDL_strrchr(path, '\\');
+	if (backslash > start) start = backslash;
+	start = start ? start + 1 : path;
+
+	char *name = SDL_strdup(start);
+	if (!name) return NULL;
+	char *dot = SDL_strrchr(name, '.');
+	if (dot && dot != name) *dot = '\0';
+	return name;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s output.ml2pack map.ml2...\n", argv[0]);
+		return 1;
+	}
+
+	int count = argc - 2;
+	char **names = calloc(count, sizeof(char *));
+	ML2_Map **maps = calloc(count, sizeof(ML2_Map *));
+	if (!names || !maps) {
+		fprintf(stderr, "Not enough memory.\n");
+		return 1;
+	}
+
+	int status = 0;
+	for (int i = 0; i < count; ++i) {
+		// Nothing is rendered, so the tilesheets only need to be decoded, not uploaded.
+		maps[i] = ML2_Map_loadFromFile(argv[i + 2], NULL);
+		names[i] = map_name(argv[i + 2]);
+		if (!maps[i] || !names[i]) {
+			fprintf(stderr, "%s\n", SDL_GetError());
+			status = 1;
+			goto done;
+		}
+	}
+
+	if (!ML2_Pack_save(argv[1], count, (const char *const *) names, maps)) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		status = 1;
+		goto done;
+	}
+	printf("Packed %d maps into %s\n", count, argv[1]);
+
+	done:
+	for (int i = 0; i < count; ++i) {
+		ML2_Map_free(maps[i]);
+		SDL_free(names[i]);
+	}
+	free(maps);
+	free(names);
+	return status;
+}
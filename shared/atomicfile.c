@@ -0,0 +1,180 @@
+/**
+ * @file
+ * @brief Replacing files all at once, so a crash never leaves one half written.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+// Required for fsync, fchmod and friends, since the project is built with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+#include <SDL.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ML2_HAVE_POSIX_IO
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "atomicfile.h"
+
+#ifdef ML2_HAVE_POSIX_IO
+// Flush the directory entry of a file that was just renamed, so the rename survives a crash.
+static void sync_parent_dir(const char *path) {
+	char *dir = SDL_strdup(path);
+	if (!dir) return;
+	char *slash = SDL_strrchr(dir, '/');
+	if (slash == dir) slash[1] = '\0';
+	else if (slash) *slash = '\0';
+	
+	int fd = open(slash ? dir : ".", O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	SDL_free(dir);
+}
+#endif
+
+// Number of names tried for a temporary file before giving up
+#define TEMP_ATTEMPTS 100
+
+static SDL_atomic_t temp_counter;
+
+/* Name a temporary file next to path, so it is on the same file system and can be renamed over it.
+ * The name is different every time, so saves of the same file at the same time each get their own. */
+static void temp_name(char *buf, size_t len, const char *path) {
+	Uint64 now = SDL_GetPerformanceCounter();
+	Uint32 unique = ((Uint32) now ^ (Uint32) (now >> 32)) * 2654435761u ^ (Uint32) SDL_AtomicAdd(&temp_counter, 1);
+#ifdef ML2_HAVE_POSIX_IO
+	unique ^= (Uint32) getpid() << 16;
+#endif
+	SDL_snprintf(buf, len, "%s.%08x.tmp", path, (unsigned) unique);
+}
+
+// The data goes to a temporary file next to the target, which then replaces it.
+SDL_bool ML2_AtomicFile_write(const char *path, const void *data, size_t size) {
+	size_t tmp_len = SDL_strlen(path) + sizeof(".00000000.tmp");
+	char *tmp_path = SDL_malloc(tmp_len);
+	if (!tmp_path) {
+		SDL_SetError("Not enough memory.");
+		return SDL_FALSE;
+	}
+	
+	SDL_bool success = SDL_FALSE, created = SDL_FALSE;
+#ifdef ML2_HAVE_POSIX_IO
+	// Created exclusively, so a file that happens to have the same name is never written over.
+	int fd = -1;
+	for (int attempt = 0; fd < 0 && attempt < TEMP_ATTEMPTS; ++attempt) {
+		temp_name(tmp_path, tmp_len, path);
+		fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0 && errno != EEXIST) break;
+	}
+	if (fd < 0) {
+		SDL_SetError("Couldn't create %s: %s", tmp_path, strerror(errno));
+		goto done;
+	}
+	created = SDL_TRUE;
+	
+	/* The new file takes the place of the old one, so it gets its permissions, and its owner if we are allowed to.
+	 * New files are left with the permissions from the umask. */
+	struct stat old_st;
+	if (stat(path, &old_st) == 0) {
+		if (fchown(fd, old_st.st_uid, old_st.st_gid) < 0) {
+			// Only the superuser can give a file away, everyone else ends up owning the saved file.
+		}
+		if (fchmod(fd, old_st.st_mode & 07777) < 0) {
+			SDL_SetError("Couldn't set the permissions of %s: %s", tmp_path, strerror(errno));
+			close(fd);
+			goto done;
+		}
+	}
+	
+	// This is a single write unless the kernel decides to split it.
+	const Uint8 *p = data;
+	size_t left = size;
+	while (left) {
+		ssize_t written = write(fd, p, left);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) break;
+		p += written;
+		left -= written;
+	}
+	success = !left && fsync(fd) == 0;
+	if (!success) SDL_SetError("Couldn't write %s: %s", tmp_path, strerror(errno));
+	if (close(fd) < 0 && success) {
+		SDL_SetError("Couldn't write %s: %s", tmp_path, strerror(errno));
+		success = SDL_FALSE;
+	}
+	
+	if (success && rename(tmp_path, path) < 0) {
+		SDL_SetError("Couldn't replace %s: %s", path, strerror(errno));
+		success = SDL_FALSE;
+	}
+	if (success) sync_parent_dir(path);
+#elif defined(_WIN32)
+	HANDLE file = INVALID_HANDLE_VALUE;
+	for (int attempt = 0; file == INVALID_HANDLE_VALUE && attempt < TEMP_ATTEMPTS; ++attempt) {
+		temp_name(tmp_path, tmp_len, path);
+		file = CreateFileA(tmp_path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_EXISTS) break;
+	}
+	if (file == INVALID_HANDLE_VALUE) {
+		SDL_SetError("Couldn't create %s", tmp_path);
+		goto done;
+	}
+	created = SDL_TRUE;
+	
+	// WriteFile takes the size as a DWORD, so large files are written in pieces.
+	const Uint8 *p = data;
+	size_t left = size;
+	while (left) {
+		DWORD written;
+		if (!WriteFile(file, p, left > 0x40000000 ? 0x40000000 : (DWORD) left, &written, NULL) || !written) break;
+		p += written;
+		left -= written;
+	}
+	// MOVEFILE_WRITE_THROUGH only waits for the rename, the data has to be flushed before it.
+	success = !left && FlushFileBuffers(file);
+	if (!CloseHandle(file)) success = SDL_FALSE;
+	if (!success) SDL_SetError("Couldn't write %s", tmp_path);
+	
+	// MoveFileEx is the only way to replace an existing file in one step on Windows.
+	if (success && !MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		SDL_SetError("Couldn't replace %s", path);
+		success = SDL_FALSE;
+	}
+#else
+	/* Other platforms have no way to flush a file to disk, so a crash can still lose the save there.
+	 * A program crashing partway through still leaves the old file alone. */
+	SDL_RWops *rw = NULL;
+	for (int attempt = 0; !rw && attempt < TEMP_ATTEMPTS; ++attempt) {
+		temp_name(tmp_path, tmp_len, path);
+		SDL_RWops *existing = SDL_RWFromFile(tmp_path, "rb");
+		if (existing) SDL_RWclose(existing);
+		else rw = SDL_RWFromFile(tmp_path, "wb");
+	}
+	if (!rw) goto done;
+	created = SDL_TRUE;
+	success = SDL_RWwrite(rw, data, 1, size) == size;
+	if (SDL_RWclose(rw) < 0) success = SDL_FALSE;
+	
+	if (success && rename(tmp_path, path) < 0) {
+		SDL_SetError("Couldn't replace %s", path);
+		success = SDL_FALSE;
+	}
+#endif
+	
+	done:
+	if (!success && created) remove(tmp_path);
+	SDL_free(tmp_path);
+	return success;
+}
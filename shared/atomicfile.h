@@ -0,0 +1,37 @@
+/**
+ * @file
+ * @brief Replacing files all at once, so a crash never leaves one half written.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_ATOMICFILE_H
+#define MOONLANDER_ATOMICFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Write a file so that it either has all of the new contents or all of the old ones,
+ * even if the program or system crashes partway through.
+ * @details The data is written to a uniquely named temporary file in the same directory, flushed to disk,
+ * and renamed over the target. Programs that have the old file open or mapped keep seeing the old contents.
+ * An existing file keeps its permissions (and its owner, where that is allowed).
+ * On platforms other than POSIX systems and Windows, the data can't be flushed, so only a crash of the
+ * program itself is safe.
+ * If there is an error, the SDL error state will be set and the target is left alone.
+ *
+ * @param path Path of the file to write
+ * @param data Contents of the file
+ * @param size Size of the contents in bytes
+ * @return Whether the file was written successfully
+ */
+SDL_bool ML2_AtomicFile_write(const char *path, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
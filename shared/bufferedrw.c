@@ -0,0 +1,161 @@
+/**
+ * @file
+ * @brief Buffered reading from RWops, including streams that can't seek.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#include <SDL.h>
+
+#include "bufferedrw.h"
+
+// Bytes before the read position that are kept when the buffer is refilled, for short backward seeks
+#define LOOKBEHIND 256
+
+typedef struct {
+	SDL_RWops *src;
+	SDL_bool freesrc;
+	Sint64 end; // position in the stream of the end of the buffered data
+	size_t pos, len; // read position and amount of data in the buffer
+	Uint8 buf[ML2_BUFFEREDRW_SIZE];
+} BufferedRW;
+
+static Sint64 position(const BufferedRW *b) {
+	return b->end - (Sint64) (b->len - b->pos);
+}
+
+/* Read the next block from the source. This must only be called once the buffer
+ * has been used up, and keeps the tail of it around for seeking backwards. */
+static size_t refill(BufferedRW *b) {
+	size_t keep = b->pos < LOOKBEHIND ? b->pos : LOOKBEHIND;
+	SDL_memmove(b->buf, b->buf + b->pos - keep, keep);
+	b->pos = b->len = keep;
+
+	size_t n = SDL_RWread(b->src, b->buf + b->len, 1, sizeof(b->buf) - b->len);
+	b->len += n;
+	b->end += n;
+	return n;
+}
+
+static Sint64 SDLCALL buffered_size(SDL_RWops *rw) {
+	return SDL_RWsize(((BufferedRW *) rw->hidden.unknown.data1)->src);
+}
+
+static Sint64 SDLCALL buffered_seek(SDL_RWops *rw, Sint64 offset, int whence) {
+	BufferedRW *b = rw->hidden.unknown.data1;
+	Sint64 target;
+	if (whence == RW_SEEK_SET) {
+		target = offset;
+	} else if (whence == RW_SEEK_CUR) {
+		target = position(b) + offset;
+	} else {
+		Sint64 size = SDL_RWsize(b->src);
+		if (size < 0) return SDL_SetError("Can't seek from the end of a stream of unknown size");
+		target = size + offset;
+	}
+	if (target < 0) return SDL_SetError("Seek before start of stream");
+
+	// Anything still in the buffer doesn't need to touch the source.
+	Sint64 start = b->end - (Sint64) b->len;
+	if (target >= start && target <= b->end) {
+		b->pos = target - start;
+		return target;
+	}
+
+	if (SDL_RWseek(b->src, target, RW_SEEK_SET) >= 0) {
+		b->end = target;
+		b->pos = b->len = 0;
+		return target;
+	}
+	if (target < start) return SDL_SetError("Can't seek that far back in a stream");
+
+	// The source can't seek, so skip ahead by reading.
+	while (b->end < target) {
+		b->pos = b->len;
+		if (!refill(b)) return SDL_SetError("Seek past end of stream");
+	}
+	b->pos = target - (b->end - (Sint64) b->len);
+	return target;
+}
+
+static size_t SDLCALL buffered_read(SDL_RWops *rw, void *ptr, size_t size, size_t maxnum) {
+	BufferedRW *b = rw->hidden.unknown.data1;
+	if (!size || !maxnum) return 0;
+	if (maxnum > SIZE_MAX / size) maxnum = SIZE_MAX / size;
+
+	Uint8 *dst = ptr;
+	size_t want = size * maxnum, done = 0;
+	while (done < want) {
+		if (b->pos < b->len) {
+			size_t n = b->len - b->pos < want - done ? b->len - b->pos : want - done;
+			SDL_memcpy(dst + done, b->buf + b->pos, n);
+			b->pos += n;
+			done += n;
+		} else if (want - done >= sizeof(b->buf)) {
+			// Large reads skip the buffer, apart from keeping the end of them for seeking backwards.
+			size_t n = SDL_RWread(b->src, dst + done, 1, want - done);
+			if (!n) break;
+			done += n;
+			b->end += n;
+			size_t keep = n < LOOKBEHIND ? n : LOOKBEHIND;
+			SDL_memcpy(b->buf, dst + done - keep, keep);
+			b->pos = b->len = keep;
+		} else if (!refill(b)) {
+			break;
+		}
+	}
+
+	// A partial object can't be returned, so it is put back.
+	size_t extra = done % size;
+	if (extra) buffered_seek(rw, -(Sint64) extra, RW_SEEK_CUR);
+	return done / size;
+}
+
+static size_t SDLCALL buffered_write(SDL_RWops *rw, const void *ptr, size_t size, size_t num) {
+	(void) rw; (void) ptr; (void) size; (void) num;
+	SDL_SetError("Buffered reader is read-only");
+	return 0;
+}
+
+static int SDLCALL buffered_close(SDL_RWops *rw) {
+	BufferedRW *b = rw->hidden.unknown.data1;
+	int result = 0;
+	if (b->freesrc) {
+		result = SDL_RWclose(b->src);
+	} else if (b->pos < b->len) {
+		// Give back what was read ahead, if the source lets us.
+		SDL_RWseek(b->src, -(Sint64) (b->len - b->pos), RW_SEEK_CUR);
+	}
+	SDL_free(b);
+	SDL_FreeRW(rw);
+	return result;
+}
+
+SDL_RWops *ML2_BufferedRW_create(SDL_RWops *src, SDL_bool freesrc) {
+	if (!src) return NULL;
+
+	BufferedRW *b = SDL_malloc(sizeof(BufferedRW));
+	SDL_RWops *rw = b ? SDL_AllocRW() : NULL;
+	if (!rw) {
+		SDL_free(b);
+		if (freesrc) SDL_RWclose(src);
+		SDL_SetError("Failed to create buffered reader: not enough memory.");
+		return NULL;
+	}
+
+	Sint64 start = SDL_RWtell(src);
+	b->src = src;
+	b->freesrc = freesrc;
+	b->end = start < 0 ? 0 : start;
+	b->pos = b->len = 0;
+
+	rw->size = buffered_size;
+	rw->seek = buffered_seek;
+	rw->read = buffered_read;
+	rw->write = buffered_write;
+	rw->close = buffered_close;
+	rw->type = SDL_RWOPS_UNKNOWN;
+	rw->hidden.unknown.data1 = b;
+	return rw;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file
+ * @brief Buffered reading from RWops, including streams that can't seek.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_BUFFEREDRW_H
+#define MOONLANDER_BUFFEREDRW_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of bytes read from the wrapped RWops at once.
+ */
+#define ML2_BUFFEREDRW_SIZE 65536
+
+/**
+ * @brief Wrap RWops in a read-only buffered reader.
+ * @details Reads from the source are made in blocks of ML2_BUFFEREDRW_SIZE bytes,
+ * so many small reads cost about as much as a single large one. Large reads go straight
+ * to the destination instead of passing through the buffer.
+ *
+ * The wrapper can seek even if the source can't (like a pipe or stdin).
+ * Forward seeks skip over data, and short backward seeks are served from what is
+ * left in the buffer. Positions are relative to where the source was when it was wrapped
+ * if the source can't tell where it is.
+ *
+ * The wrapper reads ahead of what has been asked for. When it is closed, a seekable source
+ * is put back right after the last byte that was read through the wrapper, but the extra
+ * data is lost for sources that can't seek.
+ * If there is an error, the SDL error state will be set and a null pointer will be returned
+ * (src is still closed if freesrc is set).
+ *
+ * @param src RWops to read from
+ * @param freesrc Whether to close src when the wrapper is closed
+ * @return The buffered RWops, which must be closed with SDL_RWclose
+ */
+SDL_RWops *ML2_BufferedRW_create(SDL_RWops *src, SDL_bool freesrc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,381 @@
+/**
+ * @file
+ * @brief Storage for chunked maps, keeping only the chunks that are in use decompressed.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#include <SDL.h>
+
+#include "codec.h"
+#include "chunkcache.h"
+
+// Minimum number of chunks kept decompressed at once
+#define MIN_RESIDENT 64
+// Chunks within this many chunks of the focus are decompressed ahead of time
+#define LOAD_MARGIN 1
+// Chunks further than this many chunks from the focus are evicted
+#define EVICT_MARGIN 2
+// Size of an entry in the chunk table (64-bit offset, 32-bit size)
+#define TABLE_ENTRY_SIZE 12
+
+typedef struct {
+	Uint8 *tiles; // Decompressed tiles, or NULL if the chunk is not resident
+	const Uint8 *blob; // Compressed tiles, or NULL if the chunk is empty
+	Uint8 *stored; // Recompressed copy of a modified chunk (blob points into it), owned by the cache
+	Uint32 blob_size;
+	Uint32 last_used;
+	SDL_bool dirty;
+} Chunk;
+
+struct ML2_ChunkCache {
+	Uint32 width, height;
+	Uint32 chunk_size, chunk_shift;
+	Uint32 tile_size; // in bytes
+	Uint32 chunks_x, chunks_y;
+	Chunk *chunks;
+	size_t *resident; // indices of resident chunks
+	size_t resident_count, max_resident;
+	Uint32 clock;
+	SDL_Rect focus; // in chunks
+	void *owned; // compressed chunks read into memory
+};
+
+static Uint32 read_le32(const Uint8 *p) {
+	return (Uint32) p[0] | (Uint32) p[1] << 8 | (Uint32) p[2] << 16 | (Uint32) p[3] << 24;
+}
+
+static Uint64 read_le64(const Uint8 *p) {
+	return (Uint64) read_le32(p) | (Uint64) read_le32(p + 4) << 32;
+}
+
+static void write_le32(Uint8 *p, Uint32 value) {
+	for (int i = 0; i < 4; ++i) p[i] = value >> (8 * i);
+}
+
+static void write_le64(Uint8 *p, Uint64 value) {
+	for (int i = 0; i < 8; ++i) p[i] = value >> (8 * i);
+}
+
+static size_t chunk_bytes(const ML2_ChunkCache *cache) {
+	return (size_t) cache->chunk_size * cache->chunk_size * cache->tile_size;
+}
+
+ML2_ChunkCache *ML2_ChunkCache_create(Uint32 width, Uint32 height, Uint32 chunk_size, Uint32 tile_size) {
+	if (!chunk_size || chunk_size & (chunk_size - 1) || chunk_size > 1 << 15) {
+		SDL_SetError("Invalid chunk size %u.", chunk_size);
+		return NULL;
+	}
+
+	ML2_ChunkCache *cache = SDL_malloc(sizeof(ML2_ChunkCache));
+	if (!cache) {
+		SDL_SetError("Failed to create chunk cache: not enough memory.");
+		return NULL;
+	}
+
+	*cache = (ML2_ChunkCache) {
+		.width = width,
+		.height = height,
+		.chunk_size = chunk_size,
+		.tile_size = tile_size,
+		.chunks_x = width / chunk_size + !!(width % chunk_size),
+		.chunks_y = height / chunk_size + !!(height % chunk_size),
+		.max_resident = MIN_RESIDENT
+	};
+	while (1u << cache->chunk_shift < chunk_size) ++cache->chunk_shift;
+
+	size_t count = (size_t) cache->chunks_x * cache->chunks_y;
+	if (cache->chunks_y && count / cache->chunks_y != cache->chunks_x) count = SIZE_MAX;
+	cache->chunks = count < SIZE_MAX / sizeof(Chunk) ? SDL_calloc(count ? count : 1, sizeof(Chunk)) : NULL;
+	cache->resident = SDL_malloc(cache->max_resident * sizeof(size_t));
+	if (!cache->chunks || !cache->resident) {
+		ML2_ChunkCache_destroy(cache);
+		SDL_SetError("Failed to create chunk cache: not enough memory.");
+		return NULL;
+	}
+
+	return cache;
+}
+
+/* Fill in the chunk blobs from a chunk table. Offsets in the table are relative to blobs.
+ * If blobs is NULL, this only finds the total size of the blobs. */
+static SDL_bool parse_table(ML2_ChunkCache *cache, const Uint8 *table, const Uint8 *blobs, size_t max_size, size_t *total_size) {
+	size_t count = (size_t) cache->chunks_x * cache->chunks_y;
+	size_t end = 0;
+	for (size_t i = 0; i < count; ++i) {
+		Uint64 offset = read_le64(table + i * TABLE_ENTRY_SIZE);
+		Uint32 size = read_le32(table + i * TABLE_ENTRY_SIZE + 8);
+		if (offset > max_size || size > max_size - offset) {
+			SDL_SetError("Map contains an invalid chunk table.");
+			return SDL_FALSE;
+		}
+		if (size && blobs) {
+			cache->chunks[i].blob = blobs + offset;
+			cache->chunks[i].blob_size = size;
+		}
+		if (size && offset + size > end) end = offset + size;
+	}
+	if (total_size) *total_size = end;
+	return SDL_TRUE;
+}
+
+ML2_ChunkCache *ML2_ChunkCache_loadFromRWops(SDL_RWops *src, Uint32 width, Uint32 height, Uint32 tile_size) {
+	Uint8 size_buf[4];
+	if (SDL_RWread(src, size_buf, 1, 4) != 4) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		return NULL;
+	}
+
+	ML2_ChunkCache *cache = ML2_ChunkCache_create(width, height, read_le32(size_buf), tile_size);
+	if (!cache) return NULL;
+
+	size_t count = (size_t) cache->chunks_x * cache->chunks_y;
+	Uint8 *table = count <= SIZE_MAX / TABLE_ENTRY_SIZE ? SDL_malloc(count * TABLE_ENTRY_SIZE + 1) : NULL;
+	if (!table) {
+		SDL_SetError("Failed to load map into memory: not enough memory.");
+		goto fail;
+	}
+	if (SDL_RWread(src, table, TABLE_ENTRY_SIZE, count) != count) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		goto fail;
+	}
+
+	// Find out how much data the chunks take up, then read all of it at once.
+	size_t blobs_size;
+	if (!parse_table(cache, table, NULL, SIZE_MAX, &blobs_size)) goto fail;
+	cache->owned = SDL_malloc(blobs_size ? blobs_size : 1);
+	if (!cache->owned) {
+		SDL_SetError("Failed to load map into memory: not enough memory.");
+		goto fail;
+	}
+	if (blobs_size && SDL_RWread(src, cache->owned, 1, blobs_size) != blobs_size) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		goto fail;
+	}
+
+	parse_table(cache, table, cache->owned, blobs_size, NULL);
+	SDL_free(table);
+	return cache;
+
+	fail:
+	SDL_free(table);
+	ML2_ChunkCache_destroy(cache);
+	return NULL;
+}
+
+ML2_ChunkCache *ML2_ChunkCache_loadFromMem(const void *src, size_t size, Uint32 width, Uint32 height, Uint32 tile_size) {
+	const Uint8 *bytes = src;
+	if (size < 4) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		return NULL;
+	}
+
+	ML2_ChunkCache *cache = ML2_ChunkCache_create(width, height, read_le32(bytes), tile_size);
+	if (!cache) return NULL;
+
+	size_t count = (size_t) cache->chunks_x * cache->chunks_y;
+	size -= 4;
+	if (count > size / TABLE_ENTRY_SIZE) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		ML2_ChunkCache_destroy(cache);
+		return NULL;
+	}
+
+	const Uint8 *table = bytes + 4;
+	size_t table_size = count * TABLE_ENTRY_SIZE;
+	if (!parse_table(cache, table, table + table_size, size - table_size, NULL)) {
+		ML2_ChunkCache_destroy(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+// Recompress a modified chunk so it can be evicted or saved.
+static SDL_bool store_chunk(ML2_ChunkCache *cache, Chunk *chunk) {
+	size_t bound = ML2_Codec_compressBound(chunk_bytes(cache));
+	Uint8 *stored = SDL_malloc(bound);
+	if (!stored) {
+		SDL_SetError("Failed to compress chunk: not enough memory.");
+		return SDL_FALSE;
+	}
+
+	size_t size = ML2_Codec_compress(chunk->tiles, chunk_bytes(cache), stored, bound);
+	Uint8 *shrunk = SDL_realloc(stored, size);
+	if (shrunk) stored = shrunk;
+
+	SDL_free(chunk->stored);
+	chunk->stored = stored;
+	chunk->blob = stored;
+	chunk->blob_size = size;
+	chunk->dirty = SDL_FALSE;
+	return SDL_TRUE;
+}
+
+static SDL_bool evict(ML2_ChunkCache *cache, size_t slot) {
+	Chunk *chunk = &cache->chunks[cache->resident[slot]];
+	if (chunk->dirty && !store_chunk(cache, chunk)) return SDL_FALSE;
+
+	SDL_free(chunk->tiles);
+	chunk->tiles = NULL;
+	cache->resident[slot] = cache->resident[--cache->resident_count];
+	return SDL_TRUE;
+}
+
+// Evict the least recently used chunk outside of the focus.
+static void evict_lru(ML2_ChunkCache *cache) {
+	size_t lru = cache->resident_count;
+	for (size_t i = 0; i < cache->resident_count; ++i) {
+		size_t index = cache->resident[i];
+		SDL_Point pos = {index % cache->chunks_x, index / cache->chunks_x};
+		if (SDL_PointInRect(&pos, &cache->focus)) continue;
+		if (lru == cache->resident_count || cache->chunks[index].last_used < cache->chunks[cache->resident[lru]].last_used)
+			lru = i;
+	}
+	if (lru < cache->resident_count) evict(cache, lru);
+}
+
+static Uint8 *make_resident(ML2_ChunkCache *cache, size_t index) {
+	Chunk *chunk = &cache->chunks[index];
+	if (chunk->tiles) return chunk->tiles;
+
+	if (cache->resident_count >= cache->max_resident) evict_lru(cache);
+	if (cache->resident_count >= cache->max_resident) {
+		// Everything resident is in focus, so the focus is larger than the cache.
+		size_t *resident = SDL_realloc(cache->resident, cache->max_resident * 2 * sizeof(size_t));
+		if (!resident) {
+			SDL_SetError("Failed to decompress chunk: not enough memory.");
+			return NULL;
+		}
+		cache->resident = resident;
+		cache->max_resident *= 2;
+	}
+
+	// Empty chunks are never stored, they are just zeroes.
+	chunk->tiles = chunk->blob ? SDL_malloc(chunk_bytes(cache)) : SDL_calloc(1, chunk_bytes(cache));
+	if (!chunk->tiles) {
+		SDL_SetError("Failed to decompress chunk: not enough memory.");
+		return NULL;
+	}
+	if (chunk->blob && !ML2_Codec_decompress(chunk->blob, chunk->blob_size, chunk->tiles, chunk_bytes(cache))) {
+		SDL_free(chunk->tiles);
+		chunk->tiles = NULL;
+		return NULL;
+	}
+
+	cache->resident[cache->resident_count++] = index;
+	return chunk->tiles;
+}
+
+Uint8 *ML2_ChunkCache_getTile(ML2_ChunkCache *cache, Uint32 x, Uint32 y, SDL_bool write) {
+	size_t index = (size_t) (y >> cache->chunk_shift) * cache->chunks_x + (x >> cache->chunk_shift);
+	Chunk *chunk = &cache->chunks[index];
+	Uint8 *tiles = chunk->tiles ? chunk->tiles : make_resident(cache, index);
+	if (!tiles) return NULL;
+
+	chunk->last_used = cache->clock;
+	if (write) chunk->dirty = SDL_TRUE;
+	Uint32 mask = cache->chunk_size - 1;
+	return &tiles[((size_t) (y & mask) << cache->chunk_shift | (x & mask)) * cache->tile_size];
+}
+
+// Chunk containing a tile coordinate, rounding down for coordinates left of or below the map
+static int chunk_of(const ML2_ChunkCache *cache, int tile) {
+	return tile >= 0 ? tile >> cache->chunk_shift : ~(~tile >> cache->chunk_shift);
+}
+
+// Whether a chunk is in the focus, counting the copies of it either side of a map that wraps around
+static SDL_bool in_focus(const ML2_ChunkCache *cache, SDL_Point pos, SDL_bool wrap_x) {
+	if (SDL_PointInRect(&pos, &cache->focus)) return SDL_TRUE;
+	if (!wrap_x) return SDL_FALSE;
+	SDL_Point left = {pos.x - (int) cache->chunks_x, pos.y}, right = {pos.x + (int) cache->chunks_x, pos.y};
+	return SDL_PointInRect(&left, &cache->focus) || SDL_PointInRect(&right, &cache->focus);
+}
+
+void ML2_ChunkCache_setFocus(ML2_ChunkCache *cache, const SDL_Rect *region, SDL_bool wrap_x) {
+	++cache->clock;
+	if (!cache->chunks_x) wrap_x = SDL_FALSE;
+	int x0 = region->x < 0 && !wrap_x ? 0 : chunk_of(cache, region->x);
+	int y0 = region->y < 0 ? 0 : region->y >> cache->chunk_shift;
+	int x1 = region->x + region->w < 0 && !wrap_x ? 0 : chunk_of(cache, region->x + region->w);
+	int y1 = region->y + region->h < 0 ? 0 : (region->y + region->h) >> cache->chunk_shift;
+	cache->focus = (SDL_Rect) {
+		x0 - EVICT_MARGIN, y0 - EVICT_MARGIN,
+		x1 - x0 + 1 + 2 * EVICT_MARGIN, y1 - y0 + 1 + 2 * EVICT_MARGIN
+	};
+
+	// Drop everything that has gone out of range.
+	for (size_t i = 0; i < cache->resident_count;) {
+		size_t index = cache->resident[i];
+		SDL_Point pos = {index % cache->chunks_x, index / cache->chunks_x};
+		if (in_focus(cache, pos, wrap_x) || !evict(cache, i)) ++i;
+	}
+
+	/* Decompress chunks that are about to come into view. Chunks past the edges of a map that wraps around
+	 * are the ones on the other side (a partial last chunk makes this approximate, which only costs a spare chunk). */
+	int first_x = wrap_x ? x0 - LOAD_MARGIN : SDL_max(x0 - LOAD_MARGIN, 0);
+	int last_x = wrap_x ? SDL_min(x1 + LOAD_MARGIN, first_x + (int) cache->chunks_x - 1) : x1 + LOAD_MARGIN;
+	for (int y = SDL_max(y0 - LOAD_MARGIN, 0); y <= y1 + LOAD_MARGIN && (Uint32) y < cache->chunks_y; ++y) {
+		for (int x = first_x; x <= last_x; ++x) {
+			int chunk_x = x;
+			if (wrap_x) {
+				chunk_x %= (int) cache->chunks_x;
+				if (chunk_x < 0) chunk_x += cache->chunks_x;
+			} else if ((Uint32) x >= cache->chunks_x) {
+				break;
+			}
+			size_t index = (size_t) y * cache->chunks_x + chunk_x;
+			if (make_resident(cache, index)) cache->chunks[index].last_used = cache->clock;
+		}
+	}
+}
+
+SDL_bool ML2_ChunkCache_save(ML2_ChunkCache *cache, SDL_RWops *dst) {
+	size_t count = (size_t) cache->chunks_x * cache->chunks_y;
+	Uint8 *table = SDL_malloc(count * TABLE_ENTRY_SIZE + 4);
+	if (!table) {
+		SDL_SetError("Not enough memory.");
+		return SDL_FALSE;
+	}
+
+	// Modified chunks have to be compressed before the table can be written.
+	Uint64 offset = 0;
+	write_le32(table, cache->chunk_size);
+	for (size_t i = 0; i < count; ++i) {
+		Chunk *chunk = &cache->chunks[i];
+		if (chunk->dirty && !store_chunk(cache, chunk)) {
+			SDL_free(table);
+			return SDL_FALSE;
+		}
+		Uint32 size = chunk->blob ? chunk->blob_size : 0;
+		write_le64(table + 4 + i * TABLE_ENTRY_SIZE, size ? offset : 0);
+		write_le32(table + 4 + i * TABLE_ENTRY_SIZE + 8, size);
+		offset += size;
+	}
+
+	SDL_bool success = SDL_RWwrite(dst, table, 1, count * TABLE_ENTRY_SIZE + 4) == count * TABLE_ENTRY_SIZE + 4;
+	SDL_free(table);
+	for (size_t i = 0; success && i < count; ++i) {
+		Chunk *chunk = &cache->chunks[i];
+		if (chunk->blob && SDL_RWwrite(dst, chunk->blob, 1, chunk->blob_size) != chunk->blob_size)
+			success = SDL_FALSE;
+	}
+
+	return success;
+}
+
+void ML2_ChunkCache_destroy(ML2_ChunkCache *cache) {
+	if (!cache) return;
+	if (cache->chunks) {
+		size_t count = (size_t) cache->chunks_x * cache->chunks_y;
+		for (size_t i = 0; i < count; ++i) {
+			SDL_free(cache->chunks[i].tiles);
+			SDL_free(cache->chunks[i].stored);
+		}
+	}
+	SDL_free(cache->chunks);
+	SDL_free(cache->resident);
+	SDL_free(cache->owned);
+	SDL_free(cache);
+}
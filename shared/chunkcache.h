@@ -0,0 +1,115 @@
+/**
+ * @file
+ * @brief Storage for chunked maps, keeping only the chunks that are in use decompressed.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_CHUNKCACHE_H
+#define MOONLANDER_CHUNKCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Width and height of a chunk (in tiles) used for newly created chunked maps.
+ */
+#define ML2_CHUNK_SIZE 64
+
+/**
+ * @brief Opaque chunk cache type.
+ * @details Chunks are stored compressed, and are decompressed on first access.
+ * Chunks far away from the focus (set with ML2_ChunkCache_setFocus) are evicted
+ * again, and modified chunks are recompressed when they are evicted.
+ */
+typedef struct ML2_ChunkCache ML2_ChunkCache;
+
+/**
+ * @brief Create a chunk cache for an empty map.
+ *
+ * @param width Width of the map (in tiles)
+ * @param height Height of the map (in tiles)
+ * @param chunk_size Width and height of a single chunk (must be a power of two)
+ * @param tile_size Size of a single tile in bytes
+ * @return The newly created chunk cache
+ */
+ML2_ChunkCache *ML2_ChunkCache_create(Uint32 width, Uint32 height, Uint32 chunk_size, Uint32 tile_size);
+
+/**
+ * @brief Read the chunked map data section of a map file from RWops.
+ * @details All of the compressed chunks are read into memory, but none are decompressed.
+ * If there is an error or the data is invalid, the SDL error state
+ * will be set and a null pointer will be returned.
+ *
+ * @param src RWops positioned at the start of the map data
+ * @param width Width of the map (in tiles)
+ * @param height Height of the map (in tiles)
+ * @param tile_size Size of a single tile in bytes
+ * @return The newly created chunk cache
+ */
+ML2_ChunkCache *ML2_ChunkCache_loadFromRWops(SDL_RWops *src, Uint32 width, Uint32 height, Uint32 tile_size);
+
+/**
+ * @brief Use the chunked map data section of a map file in memory.
+ * @details The compressed chunks are not copied, so the memory must outlive the chunk cache.
+ * If there is an error or the data is invalid, the SDL error state
+ * will be set and a null pointer will be returned.
+ *
+ * @param src Pointer to the start of the map data
+ * @param size Number of bytes available at src
+ * @param width Width of the map (in tiles)
+ * @param height Height of the map (in tiles)
+ * @param tile_size Size of a single tile in bytes
+ * @return The newly created chunk cache
+ */
+ML2_ChunkCache *ML2_ChunkCache_loadFromMem(const void *src, size_t size, Uint32 width, Uint32 height, Uint32 tile_size);
+
+/**
+ * @brief Write the chunked map data section of a map file, compressing modified chunks.
+ * @details This will set the SDL error message if it fails
+ *
+ * @param cache The chunk cache to save
+ * @param dst RWops to write the data to
+ * @return Whether the data was written successfully
+ */
+SDL_bool ML2_ChunkCache_save(ML2_ChunkCache *cache, SDL_RWops *dst);
+
+/**
+ * @brief Frees all resources associated with a chunk cache.
+ *
+ * @param cache The chunk cache to free
+ */
+void ML2_ChunkCache_destroy(ML2_ChunkCache *cache);
+
+/**
+ * @brief Get a pointer to a tile, decompressing its chunk if it is not resident.
+ * @details The pointer is only valid until the next call to any other chunk cache function.
+ * Coordinates are not bounds checked, that is the responsibility of the map.
+ *
+ * @param cache The chunk cache to get the tile from
+ * @param x x-coordinate of the tile
+ * @param y y-coordinate of the tile
+ * @param write Whether the tile will be modified through the returned pointer
+ * @return Pointer to the first byte of the tile, or NULL if its chunk could not be decompressed
+ */
+Uint8 *ML2_ChunkCache_getTile(ML2_ChunkCache *cache, Uint32 x, Uint32 y, SDL_bool write);
+
+/**
+ * @brief Set the region of the map that is in use, usually what is on screen.
+ * @details Chunks within the region (plus a margin) are made resident,
+ * and resident chunks well outside of it are evicted.
+ *
+ * @param cache The chunk cache to update
+ * @param region The region in use (in tiles)
+ * @param wrap_x Whether the map wraps around horizontally, so a region past the left or right edge
+ * of the map uses chunks from the other side
+ */
+void ML2_ChunkCache_setFocus(ML2_ChunkCache *cache, const SDL_Rect *region, SDL_bool wrap_x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,314 @@
+/**
+ * @file
+ * @brief Compression routines for map data.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#include <SDL.h>
+
+#include "codec.h"
+
+// Runs shorter than this are cheaper to store as part of a literal.
+#define RLE_MIN_RUN 4
+
+// Shortest match the LZ compressor will emit
+#define LZ_MIN_MATCH 4
+// Matches can reach back this far, since offsets are stored in 16 bits
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+// Width of the block copies used when decompressing
+#define COPY_WIDTH 16
+
+// Writes a LEB128 varint, returns the number of bytes written or 0 if it doesn't fit.
+static size_t write_varint(Uint8 *dst, size_t dst_size, size_t value) {
+	size_t i = 0;
+	do {
+		if (i >= dst_size) return 0;
+		dst[i++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+	return i;
+}
+
+// Reads a LEB128 varint, returns the number of bytes read or 0 if it is invalid.
+static size_t read_varint(const Uint8 *src, size_t src_size, size_t *value) {
+	*value = 0;
+	for (size_t i = 0; i < src_size && i < (sizeof(size_t) * 8 + 6) / 7; ++i) {
+		*value |= (size_t) (src[i] & 0x7F) << (7 * i);
+		if (!(src[i] & 0x80)) return i + 1;
+	}
+	return 0;
+}
+
+/* Each packet starts with a varint. If the low bit is set, the rest of it is the length
+ * of a run of the following byte, otherwise it is the length of a literal that follows. */
+static size_t rle_compress(const Uint8 *src, size_t size, Uint8 *dst, size_t dst_size) {
+	size_t out = 0;
+	size_t literal_start = 0;
+	size_t i = 0;
+	while (i <= size) {
+		size_t run = 1;
+		if (i < size) while (i + run < size && src[i + run] == src[i]) ++run;
+		if (i == size || run >= RLE_MIN_RUN) {
+			// flush the pending literal
+			size_t literal_len = i - literal_start;
+			if (literal_len) {
+				size_t n = write_varint(dst + out, dst_size - out, literal_len << 1);
+				if (!n || dst_size - out - n < literal_len) return 0;
+				out += n;
+				SDL_memcpy(dst + out, src + literal_start, literal_len);
+				out += literal_len;
+			}
+			if (i == size) break;
+
+			size_t n = write_varint(dst + out, dst_size - out, run << 1 | 1);
+			if (!n || out + n >= dst_size) return 0;
+			out += n;
+			dst[out++] = src[i];
+			i += run;
+			literal_start = i;
+		} else {
+			i += run;
+		}
+	}
+	return out;
+}
+
+static SDL_bool rle_decompress(const Uint8 *src, size_t src_size, Uint8 *dst, size_t dst_size) {
+	size_t in = 0, out = 0;
+	while (in < src_size) {
+		size_t packet;
+		size_t n = read_varint(src + in, src_size - in, &packet);
+		if (!n) return SDL_FALSE;
+		in += n;
+
+		size_t len = packet >> 1;
+		if (len > dst_size - out) return SDL_FALSE;
+		if (packet & 1) {
+			if (in >= src_size) return SDL_FALSE;
+			SDL_memset(dst + out, src[in++], len);
+		} else {
+			if (len > src_size - in) return SDL_FALSE;
+			SDL_memcpy(dst + out, src + in, len);
+			in += len;
+		}
+		out += len;
+	}
+	return out == dst_size;
+}
+
+// Writes the extra length bytes for a 4-bit length field that overflowed.
+static size_t write_length(Uint8 *dst, size_t dst_size, size_t len) {
+	size_t i = 0;
+	for (; len >= 255; len -= 255) {
+		if (i >= dst_size) return 0;
+		dst[i++] = 255;
+	}
+	if (i >= dst_size) return 0;
+	dst[i++] = len;
+	return i;
+}
+
+static Uint32 lz_hash(const Uint8 *p) {
+	Uint32 v = (Uint32) p[0] | (Uint32) p[1] << 8 | (Uint32) p[2] << 16 | (Uint32) p[3] << 24;
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Each sequence starts with a token byte. The high 4 bits are the length of a literal,
+ * and the low 4 bits are the length of a match minus LZ_MIN_MATCH. If either is 15,
+ * more length bytes follow (for the literal, before it), each adding up to 255 until one is less.
+ * After the literal comes a 16-bit little-endian offset, and the match is copied from that
+ * many bytes back in the output. The last sequence is only a literal. */
+static size_t lz_compress(const Uint8 *src, size_t size, Uint8 *dst, size_t dst_size) {
+	size_t *table = SDL_calloc(1 << LZ_HASH_BITS, sizeof(size_t));
+	if (!table) return 0;
+
+	size_t out = 0, literal_start = 0, i = 0;
+	while (i + LZ_MIN_MATCH <= size) {
+		Uint32 h = lz_hash(src + i);
+		size_t candidate = table[h]; // stored off by one so 0 means empty
+		table[h] = i + 1;
+		if (
+			!candidate-- || i - candidate > LZ_MAX_OFFSET ||
+			SDL_memcmp(src + candidate, src + i, LZ_MIN_MATCH) != 0
+		) {
+			++i;
+			continue;
+		}
+
+		size_t match_len = LZ_MIN_MATCH;
+		while (i + match_len < size && src[candidate + match_len] == src[i + match_len]) ++match_len;
+
+		size_t literal_len = i - literal_start;
+		size_t ml = match_len - LZ_MIN_MATCH;
+		if (out >= dst_size) goto overflow;
+		dst[out++] = (literal_len < 15 ? literal_len : 15) << 4 | (ml < 15 ? ml : 15);
+		if (literal_len >= 15) {
+			size_t n = write_length(dst + out, dst_size - out, literal_len - 15);
+			if (!n) goto overflow;
+			out += n;
+		}
+		if (dst_size - out < literal_len + 2) goto overflow;
+		SDL_memcpy(dst + out, src + literal_start, literal_len);
+		out += literal_len;
+		dst[out++] = (i - candidate) & 0xFF;
+		dst[out++] = (i - candidate) >> 8;
+		if (ml >= 15) {
+			size_t n = write_length(dst + out, dst_size - out, ml - 15);
+			if (!n) goto overflow;
+			out += n;
+		}
+
+		i += match_len;
+		literal_start = i;
+	}
+
+	// Trailing literal
+	size_t literal_len = size - literal_start;
+	if (out >= dst_size) goto overflow;
+	dst[out++] = (literal_len < 15 ? literal_len : 15) << 4;
+	if (literal_len >= 15) {
+		size_t n = write_length(dst + out, dst_size - out, literal_len - 15);
+		if (!n) goto overflow;
+		out += n;
+	}
+	if (dst_size - out < literal_len) goto overflow;
+	SDL_memcpy(dst + out, src + literal_start, literal_len);
+	out += literal_len;
+
+	SDL_free(table);
+	return out;
+
+	overflow:
+	SDL_free(table);
+	return 0;
+}
+
+static SDL_bool read_length(const Uint8 *src, size_t src_size, size_t *in, size_t *len) {
+	Uint8 b;
+	do {
+		if (*in >= src_size) return SDL_FALSE;
+		b = src[(*in)++];
+		*len += b;
+	} while (b == 255);
+	return SDL_TRUE;
+}
+
+/* Copy a match that may overlap its own output.
+ * Maps are mostly runs and short repeating patterns, so those are expanded
+ * with memset and doubling copies, and everything else is moved COPY_WIDTH bytes at a time,
+ * which compilers turn into single vector loads and stores. */
+static void copy_match(Uint8 *dst, size_t offset, size_t len, size_t space) {
+	const Uint8 *src = dst - offset;
+	if (offset == 1) {
+		SDL_memset(dst, *src, len);
+	} else if (offset >= COPY_WIDTH) {
+		size_t i = 0;
+		// Blocks never overlap, and may write past the end of the match as long as there is room.
+		for (; i < len && space - i >= COPY_WIDTH; i += COPY_WIDTH) SDL_memcpy(dst + i, src + i, COPY_WIDTH);
+		for (; i < len; ++i) dst[i] = src[i];
+	} else {
+		// Copy the pattern once, then keep doubling it, which keeps its phase intact.
+		size_t copied = offset < len ? offset : len;
+		SDL_memcpy(dst, src, copied);
+		while (copied < len) {
+			size_t n = copied < len - copied ? copied : len - copied;
+			SDL_memcpy(dst + copied, dst, n);
+			copied += n;
+		}
+	}
+}
+
+static SDL_bool lz_decompress(const Uint8 *src, size_t src_size, Uint8 *dst, size_t dst_size) {
+	size_t in = 0, out = 0;
+	while (in < src_size) {
+		Uint8 token = src[in++];
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && !read_length(src, src_size, &in, &literal_len)) return SDL_FALSE;
+		if (literal_len > src_size - in || literal_len > dst_size - out) return SDL_FALSE;
+		SDL_memcpy(dst + out, src + in, literal_len);
+		in += literal_len;
+		out += literal_len;
+		if (in == src_size) break; // last sequence has no match
+
+		if (src_size - in < 2) return SDL_FALSE;
+		size_t offset = src[in] | src[in + 1] << 8;
+		in += 2;
+		size_t match_len = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15 && !read_length(src, src_size, &in, &match_len)) return SDL_FALSE;
+		if (!offset || offset > out || match_len > dst_size - out) return SDL_FALSE;
+		copy_match(dst + out, offset, match_len, dst_size - out);
+		out += match_len;
+	}
+	return out == dst_size;
+}
+
+size_t ML2_Codec_compressBound(size_t size) {
+	return size + 1; // worst case is stored raw
+}
+
+size_t ML2_Codec_compressMethod(int method, const Uint8 *src, size_t size, Uint8 *dst, size_t dst_size) {
+	if (dst_size < 1) return 0;
+
+	size_t compressed_size = 0;
+	switch (method) {
+	case ML2_CODEC_RAW:
+		if (dst_size - 1 < size) return 0;
+		SDL_memcpy(dst + 1, src, size);
+		compressed_size = size;
+		break;
+	case ML2_CODEC_RLE:
+		compressed_size = rle_compress(src, size, dst + 1, dst_size - 1);
+		break;
+	case ML2_CODEC_LZ:
+		compressed_size = lz_compress(src, size, dst + 1, dst_size - 1);
+		break;
+	}
+
+	if (!compressed_size && size) return 0;
+	dst[0] = method;
+	return compressed_size + 1;
+}
+
+size_t ML2_Codec_compress(const Uint8 *src, size_t size, Uint8 *dst, size_t dst_size) {
+	if (dst_size < 1) return 0;
+
+	/* RLE is cheap to try and handles most maps well. LZ only needs to beat it,
+	 * and both only have to beat storing the data raw. */
+	size_t limit = dst_size - 1 < size ? dst_size - 1 : size;
+	size_t best = ML2_Codec_compressMethod(ML2_CODEC_RLE, src, size, dst, limit);
+	if (best) limit = best - 1;
+	Uint8 *lz = limit > 1 ? SDL_malloc(limit) : NULL;
+	if (lz) {
+		size_t lz_size = ML2_Codec_compressMethod(ML2_CODEC_LZ, src, size, lz, limit);
+		if (lz_size && (!best || lz_size < best)) {
+			SDL_memcpy(dst, lz, lz_size);
+			best = lz_size;
+		}
+		SDL_free(lz);
+	}
+	if (best && best <= size) return best;
+
+	return ML2_Codec_compressMethod(ML2_CODEC_RAW, src, size, dst, dst_size);
+}
+
+SDL_bool ML2_Codec_decompress(const Uint8 *src, size_t src_size, Uint8 *dst, size_t dst_size) {
+	SDL_bool success = SDL_FALSE;
+	if (src_size >= 1) switch (src[0]) {
+	case ML2_CODEC_RAW:
+		success = src_size - 1 == dst_size;
+		if (success) SDL_memcpy(dst, src + 1, dst_size);
+		break;
+	case ML2_CODEC_RLE:
+		success = rle_decompress(src + 1, src_size - 1, dst, dst_size);
+		break;
+	case ML2_CODEC_LZ:
+		success = lz_decompress(src + 1, src_size - 1, dst, dst_size);
+		break;
+	}
+
+	if (!success) SDL_SetError("Compressed map data is corrupt.");
+	return success;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * @brief Compression routines for map data.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_CODEC_H
+#define MOONLANDER_CODEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Compression methods. Compressed data always starts with one of these as a single byte.
+ */
+enum ML2_Codec_Method {
+	ML2_CODEC_RAW, ///< Data is stored uncompressed
+	ML2_CODEC_RLE, ///< Data is run-length encoded
+	ML2_CODEC_LZ, ///< Data is compressed with an LZ77-style scheme, for patterns that aren't runs
+	ML2_CODEC_COUNT
+};
+
+/**
+ * @brief Get the largest number of bytes ML2_Codec_compress can produce for a given input size.
+ *
+ * @param size Size of the uncompressed data
+ * @return The size a destination buffer needs to be to always fit the compressed data
+ */
+size_t ML2_Codec_compressBound(size_t size);
+
+/**
+ * @brief Compress a block of data using whichever method makes it smallest.
+ * @details If the data doesn't compress, it is stored raw, so the result is never
+ * larger than ML2_Codec_compressBound(size).
+ *
+ * @param src The data to compress
+ * @param size Size of the data to compress
+ * @param dst Buffer to compress into
+ * @param dst_size Size of the destination buffer
+ * @return The size of the compressed data, or 0 if it doesn't fit in the destination buffer
+ */
+size_t ML2_Codec_compress(const Uint8 *src, size_t size, Uint8 *dst, size_t dst_size);
+
+/**
+ * @brief Compress a block of data using a specific method.
+ * @details Mainly useful for testing and benchmarking, ML2_Codec_compress should be preferred.
+ *
+ * @param method The method to use (a value from the ML2_Codec_Method enum)
+ * @param src The data to compress
+ * @param size Size of the data to compress
+ * @param dst Buffer to compress into
+ * @param dst_size Size of the destination buffer
+ * @return The size of the compressed data, or 0 if it doesn't fit in the destination buffer
+ */
+size_t ML2_Codec_compressMethod(int method, const Uint8 *src, size_t size, Uint8 *dst, size_t dst_size);
+
+/**
+ * @brief Decompress a block of data compressed with ML2_Codec_compress.
+ * @details Decompression is built around block copies and fills, so it runs much faster than
+ * the data could be read from disk uncompressed.
+ * This will set the SDL error message if the data is corrupt
+ * or does not decompress to exactly dst_size bytes.
+ *
+ * @param src The compressed data
+ * @param src_size Size of the compressed data
+ * @param dst Buffer to decompress into
+ * @param dst_size Size of the decompressed data
+ * @return Whether the data was decompressed successfully
+ */
+SDL_bool ML2_Codec_decompress(const Uint8 *src, size_t src_size, Uint8 *dst, size_t dst_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,303 @@
+/**
+ * @file
+ * @brief Signed distance fields over maps, for finding how far away the nearest terrain is.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+#include "distancefield.h"
+
+// Stands in for an infinite squared distance, for cells with nothing to measure to
+#define FAR 1e30
+#define MAX_THREADS 64
+
+struct ML2_DistanceField {
+	int cell_shift; // log2 of the size of a cell in pixels
+	int cells_x, cells_y;
+	int tile_cells_x, tile_cells_y; // cells per tile on each axis
+	float max_distance;
+	float *distance; // one per cell, rows from the bottom like the map
+};
+
+/* The exact squared distance transform of a single row or column, as the lower envelope of parabolas
+ * rooted at each cell (Felzenszwalb and Huttenlocher). Cells that are FAR away aren't added to the envelope
+ * at all, which keeps the intersections finite. Doubles are needed since q * q gets large on big maps. */
+static void transform_1d(const float *f, int n, float *d, int *v, double *z) {
+	int k = -1;
+	for (int q = 0; q < n; ++q) {
+		if (f[q] >= FAR) continue;
+		double s = 0.0;
+		while (k >= 0) {
+			s = ((f[q] + (double) q * q) - (f[v[k]] + (double) v[k] * v[k])) / (2.0 * (q - v[k]));
+			if (s > z[k]) break;
+			--k;
+		}
+		++k;
+		v[k] = q;
+		z[k] = k ? s : -FAR;
+	}
+
+	if (k < 0) {
+		for (int q = 0; q < n; ++q) d[q] = FAR;
+		return;
+	}
+	z[k + 1] = FAR;
+	for (int q = 0, j = 0; q < n; ++q) {
+		while (z[j + 1] < q) ++j;
+		d[q] = (float) ((double) (q - v[j]) * (q - v[j]) + f[v[j]]);
+	}
+}
+
+/* A window of cells being transformed. Cells are only read from within it,
+ * and only the part of it given by out_* is written to the field. */
+typedef struct {
+	ML2_DistanceField *field;
+	int x0, y0, w, h; // window in cells
+	int out_x0, out_y0, out_x1, out_y1; // part of the window to write, relative to it
+	Uint8 *solid; // whether each cell of the window is solid
+	float *to_solid, *to_empty; // squared distances down each column, then along each row
+	SDL_atomic_t failed;
+} Transform;
+
+typedef struct {
+	Transform *transform;
+	int start, end;
+} TransformJob;
+
+// Scratch space for transform_1d, for rows or columns up to n long
+typedef struct {
+	float *f, *d;
+	int *v;
+	double *z;
+} Scratch;
+
+static SDL_bool scratch_alloc(Scratch *s, int n) {
+	s->f = SDL_malloc(sizeof(float) * n);
+	s->d = SDL_malloc(sizeof(float) * n);
+	s->v = SDL_malloc(sizeof(int) * n);
+	s->z = SDL_malloc(sizeof(double) * (n + 1));
+	return s->f && s->d && s->v && s->z;
+}
+
+static void scratch_free(Scratch *s) {
+	SDL_free(s->f);
+	SDL_free(s->d);
+	SDL_free(s->v);
+	SDL_free(s->z);
+}
+
+// Distance to the nearest solid and nearest empty cell straight up or down, for a range of columns.
+static int transform_columns(void *data) {
+	TransformJob *job = data;
+	Transform *t = job->transform;
+	Scratch s;
+	if (!scratch_alloc(&s, t->h)) {
+		SDL_AtomicSet(&t->failed, 1);
+		scratch_free(&s);
+		return 0;
+	}
+
+	for (int x = job->start; x < job->end; ++x) {
+		for (int feature = 0; feature <= 1; ++feature) {
+			float *out = feature ? t->to_solid : t->to_empty;
+			for (int y = 0; y < t->h; ++y) s.f[y] = t->solid[(size_t) y * t->w + x] == feature ? 0.0f : (float) FAR;
+			transform_1d(s.f, t->h, s.d, s.v, s.z);
+			for (int y = 0; y < t->h; ++y) out[(size_t) y * t->w + x] = s.d[y];
+		}
+	}
+	scratch_free(&s);
+	return 0;
+}
+
+// Finish the transform along a range of rows, and write the signed distances to the field.
+static int transform_rows(void *data) {
+	TransformJob *job = data;
+	Transform *t = job->transform;
+	ML2_DistanceField *field = t->field;
+	Scratch s, s2;
+	SDL_bool ok = scratch_alloc(&s, t->w);
+	ok = scratch_alloc(&s2, t->w) && ok;
+	if (!ok) {
+		SDL_AtomicSet(&t->failed, 1);
+		scratch_free(&s);
+		scratch_free(&s2);
+		return 0;
+	}
+
+	float cell_size = (float) (1 << field->cell_shift);
+	for (int y = job->start; y < job->end; ++y) {
+		size_t row = (size_t) y * t->w;
+		transform_1d(t->to_solid + row, t->w, s.d, s.v, s.z);
+		transform_1d(t->to_empty + row, t->w, s2.d, s2.v, s2.z);
+
+		float *out = field->distance + (size_t) (t->y0 + y) * field->cells_x + t->x0;
+		for (int x = t->out_x0; x < t->out_x1; ++x) {
+			float distance = t->solid[row + x] ?
+				-(SDL_sqrtf(s2.d[x]) - 0.5f) * cell_size :
+				(SDL_sqrtf(s.d[x]) - 0.5f) * cell_size;
+			out[x] = SDL_max(SDL_min(distance, field->max_distance), -field->max_distance);
+		}
+	}
+	scratch_free(&s);
+	scratch_free(&s2);
+	return 0;
+}
+
+// Split count columns or rows (starting from start) between threads, with the calling thread taking the first share.
+static void run_parallel(SDL_ThreadFunction fn, Transform *t, int start, int count, int threads) {
+	threads = SDL_max(SDL_min(SDL_min(threads, count), MAX_THREADS), 1);
+	TransformJob jobs[MAX_THREADS];
+	SDL_Thread *workers[MAX_THREADS] = {0};
+	for (int i = 0; i < threads; ++i) {
+		jobs[i] = (TransformJob) {
+			.transform = t,
+			.start = start + (int) ((Sint64) count * i / threads),
+			.end = start + (int) ((Sint64) count * (i + 1) / threads)
+		};
+		if (i) workers[i] = SDL_CreateThread(fn, "ML2_DistanceField", &jobs[i]);
+	}
+
+	fn(&jobs[0]);
+	for (int i = 1; i < threads; ++i) {
+		if (workers[i]) SDL_WaitThread(workers[i], NULL);
+		else fn(&jobs[i]);
+	}
+}
+
+// Mark which cells of the window are solid, from the tiles' solidity and collision masks.
+static void rasterize(const ML2_DistanceField *field, ML2_Map *map, const Transform *t) {
+	SDL_memset(t->solid, 0, (size_t) t->w * t->h);
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	int tx1 = (t->x0 + t->w - 1) / field->tile_cells_x, ty1 = (t->y0 + t->h - 1) / field->tile_cells_y;
+	for (int ty = t->y0 / field->tile_cells_y; ty <= ty1; ++ty) {
+		for (int tx = t->x0 / field->tile_cells_x; tx <= tx1; ++tx) {
+			int flip;
+			int tile = ML2_Map_getTile(map, tx, ty, &flip);
+			int solidity = tile != -1 ? TileSheet_getSolidity(map->tiles, tile) : TILESHEET_TILE_EMPTY;
+			if (solidity == TILESHEET_TILE_EMPTY) continue;
+
+			// Pixels of the tile that land in the window, relative to the tile
+			int left = tx * tile_width, bottom = ty * tile_height;
+			int px0 = SDL_max((t->x0 << field->cell_shift) - left, 0);
+			int px1 = SDL_min(((t->x0 + t->w) << field->cell_shift) - left, tile_width);
+			int py0 = SDL_max((t->y0 << field->cell_shift) - bottom, 0);
+			int py1 = SDL_min(((t->y0 + t->h) << field->cell_shift) - bottom, tile_height);
+			const Uint32 *mask = solidity == TILESHEET_TILE_PARTIAL ? TileSheet_getMask(map->tiles, tile, flip) : NULL;
+			for (int py = py0; py < py1; ++py) {
+				Uint8 *row = t->solid + (size_t) (((bottom + py) >> field->cell_shift) - t->y0) * t->w - t->x0;
+				for (int px = px0; px < px1; ++px) {
+					if (!mask || mask[py * map->tiles->mask_words + px / 32] >> px % 32 & 1) {
+						row[(left + px) >> field->cell_shift] = 1;
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Work out the cells in the given rectangle again. Every cell within max_distance of one of them is looked at,
+ * which is all that matters since anything further is clamped anyway. */
+static SDL_bool recompute(ML2_DistanceField *field, ML2_Map *map, int x0, int y0, int x1, int y1, int threads) {
+	int margin = (int) SDL_ceilf(field->max_distance / (1 << field->cell_shift)) + 1;
+	Transform t = {.field = field};
+	t.x0 = SDL_max(x0 - margin, 0);
+	t.y0 = SDL_max(y0 - margin, 0);
+	t.w = SDL_min(x1 + margin, field->cells_x) - t.x0;
+	t.h = SDL_min(y1 + margin, field->cells_y) - t.y0;
+	t.out_x0 = x0 - t.x0, t.out_y0 = y0 - t.y0;
+	t.out_x1 = x1 - t.x0, t.out_y1 = y1 - t.y0;
+
+	size_t cells = (size_t) t.w * t.h;
+	t.solid = SDL_malloc(cells);
+	t.to_solid = SDL_malloc(sizeof(float) * cells);
+	t.to_empty = SDL_malloc(sizeof(float) * cells);
+	SDL_bool ok = t.solid && t.to_solid && t.to_empty;
+	if (ok) {
+		// Tiles are read here rather than on the threads, since chunked maps can't be read from several at once.
+		rasterize(field, map, &t);
+		run_parallel(transform_columns, &t, 0, t.w, threads);
+		if (!SDL_AtomicGet(&t.failed)) run_parallel(transform_rows, &t, t.out_y0, t.out_y1 - t.out_y0, threads);
+		ok = !SDL_AtomicGet(&t.failed);
+	}
+
+	SDL_free(t.solid);
+	SDL_free(t.to_solid);
+	SDL_free(t.to_empty);
+	if (!ok) SDL_SetError("Failed to build distance field: not enough memory.");
+	return ok;
+}
+
+ML2_DistanceField *ML2_DistanceField_create(ML2_Map *map, int cell_size, float max_distance, int threads) {
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	if (cell_size <= 0 || cell_size & (cell_size - 1) || tile_width % cell_size || tile_height % cell_size) {
+		SDL_SetError("Failed to build distance field: cell size must be a power of two that divides the tile size.");
+		return NULL;
+	}
+	if (!(max_distance > 0.0f)) {
+		SDL_SetError("Failed to build distance field: maximum distance must be positive.");
+		return NULL;
+	}
+
+	Uint64 cells_x = (Uint64) map->width * (tile_width / cell_size);
+	Uint64 cells_y = (Uint64) map->height * (tile_height / cell_size);
+	if (!cells_x || !cells_y || cells_x > SDL_MAX_SINT32 || cells_y > SDL_MAX_SINT32 || cells_x * cells_y > SIZE_MAX / sizeof(float)) {
+		SDL_SetError("Failed to build distance field: the map is too large.");
+		return NULL;
+	}
+
+	ML2_DistanceField *field = SDL_malloc(sizeof(ML2_DistanceField));
+	float *distance = field ? SDL_malloc(sizeof(float) * cells_x * cells_y) : NULL;
+	if (!distance) {
+		SDL_free(field);
+		SDL_SetError("Failed to build distance field: not enough memory.");
+		return NULL;
+	}
+
+	*field = (ML2_DistanceField) {
+		.cell_shift = SDL_MostSignificantBitIndex32(cell_size),
+		.cells_x = (int) cells_x,
+		.cells_y = (int) cells_y,
+		.tile_cells_x = tile_width / cell_size,
+		.tile_cells_y = tile_height / cell_size,
+		.max_distance = max_distance,
+		.distance = distance
+	};
+
+	if (threads <= 0) threads = SDL_GetCPUCount();
+	if (!recompute(field, map, 0, 0, field->cells_x, field->cells_y, threads)) {
+		ML2_DistanceField_destroy(field);
+		return NULL;
+	}
+	return field;
+}
+
+void ML2_DistanceField_destroy(ML2_DistanceField *field) {
+	if (!field) return;
+	SDL_free(field->distance);
+	SDL_free(field);
+}
+
+void ML2_DistanceField_update(ML2_DistanceField *field, ML2_Map *map, Uint32 x, Uint32 y) {
+	int x0 = (int) x * field->tile_cells_x, y0 = (int) y * field->tile_cells_y;
+	int margin = (int) SDL_ceilf(field->max_distance / (1 << field->cell_shift)) + 1;
+
+	// If there isn't enough memory, the old distances are left as they were.
+	recompute(
+		field, map,
+		SDL_max(x0 - margin, 0), SDL_max(y0 - margin, 0),
+		SDL_min(x0 + field->tile_cells_x + margin, field->cells_x),
+		SDL_min(y0 + field->tile_cells_y + margin, field->cells_y),
+		1
+	);
+}
+
+float ML2_DistanceField_get(const ML2_DistanceField *field, int x, int y) {
+	int cx = x < 0 ? 0 : SDL_min(x >> field->cell_shift, field->cells_x - 1);
+	int cy = y < 0 ? 0 : SDL_min(y >> field->cell_shift, field->cells_y - 1);
+	return field->distance[(size_t) cy * field->cells_x + cx];
+}
@@ -0,0 +1,74 @@
+/**
+ * @file
+ * @brief Signed distance fields over maps, for finding how far away the nearest terrain is.
+ * @details This is used through ML2_Map_createDistanceField and ML2_Map_getDistance,
+ * and must be included after map.h.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_DISTANCEFIELD_H
+#define MOONLANDER_DISTANCEFIELD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Opaque distance field type.
+ * @details The map is divided into square cells, and a cell is solid if any pixel in it is.
+ * Each cell stores the distance from its center to the nearest cell of the other kind
+ * (less half a cell, so the surface of the terrain is at 0), which is negative for solid cells.
+ */
+typedef struct ML2_DistanceField ML2_DistanceField;
+
+/**
+ * @brief Build a distance field for a map.
+ * @details Building takes time linear in the number of cells, and is split across threads.
+ * If there is an error, the SDL error state will be set and a null pointer will be returned.
+ *
+ * @param map The map to build the distance field for
+ * @param cell_size Width and height of a cell in pixels (a power of two that divides the tile width and height)
+ * @param max_distance Largest distance stored, anything further away is clamped to this (in pixels)
+ * @param threads Number of threads to use, or 0 to use one for every CPU core
+ * @return The newly created distance field
+ */
+ML2_DistanceField *ML2_DistanceField_create(ML2_Map *map, int cell_size, float max_distance, int threads);
+
+/**
+ * @brief Frees all resources associated with a distance field.
+ *
+ * @param field The distance field to free
+ */
+void ML2_DistanceField_destroy(ML2_DistanceField *field);
+
+/**
+ * @brief Bring the distance field up to date after a tile of the map has changed.
+ * @details Only cells within the maximum distance of the tile can change,
+ * so only they are worked out again.
+ * Coordinates are not bounds checked, that is the responsibility of the map.
+ *
+ * @param field The distance field to update
+ * @param map The map the distance field was built for
+ * @param x x-coordinate of the tile that changed
+ * @param y y-coordinate of the tile that changed
+ */
+void ML2_DistanceField_update(ML2_DistanceField *field, ML2_Map *map, Uint32 x, Uint32 y);
+
+/**
+ * @brief Get the signed distance stored for the cell containing a pixel.
+ * @details Pixels outside of the map use the nearest cell on the edge of the map.
+ *
+ * @param field The distance field to look in
+ * @param x x-coordinate of the pixel
+ * @param y y-coordinate of the pixel
+ * @return The distance to the nearest terrain (in pixels), negative inside of it
+ */
+float ML2_DistanceField_get(const ML2_DistanceField *field, int x, int y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
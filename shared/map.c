@@ -6,38 +6,358 @@
  * See LICENSE or <https://www.gnu.org/licenses/>
  */
 
+/* Required for mmap and friends, since the project is built with -std=c11.
+ * These are only used on platforms that provide them, see ML2_Map_mapFile and ML2_Map_probe. */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
 #include <SDL.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define ML2_HAVE_MMAP
+#define ML2_HAVE_POSIX_IO
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// SDL_RenderGeometry was added in SDL 2.0.18, older versions copy tiles to the screen one by one.
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+#define ML2_HAVE_RENDER_GEOMETRY
+#endif
+
 #include "tilesheet.h"
 #include "tiles.h"
+#include "codec.h"
+#include "chunkcache.h"
+#include "bufferedrw.h"
+#include "atomicfile.h"
 #include "map.h"
+#include "distancefield.h"
 
 // Correct signature is the null-terminated string "ML2"
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN 
-#define CORRECT_SIG 0x4D4C3200
-#else
-#define CORRECT_SIG 0x00324C4D
-#endif
+#define CORRECT_SIG "ML2"
+
+#define CURRENT_REV 3
+
+/* Collision only needs the masks, so built-in sheets don't keep a surface.
+ * Embedded sheets keep theirs, since it is written back out when the map is saved. */
+#define BUILTIN_SHEET_FLAGS TILESHEET_CREATEMASKS
+#define EMBEDDED_SHEET_FLAGS (TILESHEET_CREATESURFACE | TILESHEET_CREATEMASKS)
+
+// Header flags this implementation understands
+#define SUPPORTED_FLAGS (ML2_MAP_CHUNKED | ML2_MAP_COMPRESSED | ML2_MAP_RAW_SHEET | ML2_MAP_WIDE_TILES | ML2_MAP_WRAP_X)
+
+// Size of a single tile in bytes for a map with the given header flags
+static Uint32 tile_bytes(Uint32 flags) {
+	return flags & ML2_MAP_WIDE_TILES ? 2 : 1;
+}
+
+static Uint16 read_le16(const Uint8 *p) {
+	return (Uint16) (p[0] | p[1] << 8);
+}
+
+static Uint32 read_le32(const Uint8 *p) {
+	return (Uint32) p[0] | (Uint32) p[1] << 8 | (Uint32) p[2] << 16 | (Uint32) p[3] << 24;
+}
+
+static Uint64 read_le64(const Uint8 *p) {
+	Uint64 value = 0;
+	for (int i = 7; i >= 0; --i) value = value << 8 | p[i];
+	return value;
+}
+
+/* Decompress the data section of a compressed (unchunked) map.
+ * It is a little-endian 64-bit size followed by that many bytes of compressed data. */
+static SDL_bool decompress_data(const Uint8 *src, size_t src_size, Uint8 *dst, size_t map_size) {
+	if (src_size < 8 || read_le64(src) > src_size - 8) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		return SDL_FALSE;
+	}
+	return ML2_Codec_decompress(src + 8, read_le64(src), dst, map_size);
+}
 
-#define CURRENT_REV 2
+/* Find the size of the tile data of an unchunked map.
+ * Fails if it wouldn't fit in memory along with the map itself. */
+static SDL_bool data_size(Uint32 width, Uint32 height, Uint32 flags, size_t *size) {
+	Uint64 tiles = (Uint64) width * height; // can't overflow, both are 32 bits
+	if (tiles > (SIZE_MAX - sizeof(ML2_Map)) / tile_bytes(flags)) return SDL_FALSE;
+	*size = tiles * tile_bytes(flags);
+	return SDL_TRUE;
+}
+
+// Blank maps with at least this much tile data get their own anonymous mapping
+#define LAZY_ZERO_THRESHOLD (1 << 20)
 
 ML2_Map *ML2_Map_create(ML2_Map params, SDL_Renderer *renderer) {
 	params.rev = CURRENT_REV;
 	if (params.tilesheet_enum) {
-		params.tiles = TileSheet_create(TILESHEET_PATHS[params.tilesheet_enum], renderer, 16, 16, TILESHEET_CREATESURFACE);
+		params.tiles = TileSheet_createShared(TILESHEET_PATHS[params.tilesheet_enum], renderer, 16, 16, BUILTIN_SHEET_FLAGS);
 	}
 	if (!params.tiles) return NULL;
 
-	size_t map_size = params.width * params.height;
-	ML2_Map *map = SDL_malloc(sizeof(ML2_Map) + map_size);
+	// Chunked maps are created with every chunk empty, so no tile data is allocated up front.
+	SDL_bool chunked = !!(params.flags & ML2_MAP_CHUNKED);
+	size_t map_size = 0;
+	if (!chunked && !data_size(params.width, params.height, params.flags, &map_size)) {
+		SDL_SetError("Failed to create map: it is too large.");
+		goto fail;
+	}
+	
+	/* Tile data is never memset, it comes zeroed from the OS and pages are only committed
+	 * once a tile on them is painted, so even enormous blank maps are created instantly. */
+	void *mapping = NULL;
+#ifdef ML2_HAVE_MMAP
+	if (map_size >= LAZY_ZERO_THRESHOLD) {
+		int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+		mmap_flags |= MAP_NORESERVE; // only painted pages count against overcommit
+#endif
+		mapping = mmap(NULL, map_size, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+		if (mapping == MAP_FAILED) {
+			SDL_SetError("Failed to create map: not enough memory.");
+			goto fail;
+		}
+	}
+#endif
+	ML2_Map *map = SDL_calloc(1, sizeof(ML2_Map) + (mapping ? 0 : map_size));
 	if (!map) {
+#ifdef ML2_HAVE_MMAP
+		if (mapping) munmap(mapping, map_size);
+#endif
 		SDL_SetError("Failed to create map: not enough memory.");
-		return NULL;
+		goto fail;
 	}
 	
 	*map = params;
-	memset(map->data, 0, map_size);
+	map->data = chunked ? NULL : mapping ? mapping : (Uint8 *) (map + 1);
+	map->chunks = chunked ? ML2_ChunkCache_create(params.width, params.height, ML2_CHUNK_SIZE, tile_bytes(params.flags)) : NULL;
+	map->mapping = mapping;
+	map->mapping_size = mapping ? map_size : 0;
+	map->readonly = SDL_FALSE;
+	map->distance = NULL;
+	map->generation = 0;
+	map->heights = NULL;
+	map->geometry = NULL;
+	if (chunked && !map->chunks) {
+		SDL_free(map);
+		goto fail;
+	}
 	return map;
+	
+	fail:
+	// Built-in sheets were loaded here, custom ones still belong to the caller.
+	if (params.tilesheet_enum) TileSheet_destroy(params.tiles);
+	return NULL;
+}
+
+// Size of the fixed part of the header (everything before the tilesheet) for each revision
+static size_t header_size(Uint32 rev) {
+	return rev < 2 ? 16 : rev < 3 ? 33 : 37;
+}
+
+#define MAX_HEADER_SIZE 37
+
+/* Parse the fixed part of a header that is already in memory.
+ * buf must hold at least header_size bytes for the revision it contains. */
+static SDL_bool parse_info(const Uint8 *buf, ML2_MapInfo *info) {
+	*info = (ML2_MapInfo) {
+		.rev = read_le32(buf + 4),
+		.width = read_le32(buf + 8),
+		.height = read_le32(buf + 12)
+	};
+	
+	if (info->rev < 2) { // Use old hardcoded values for revision 1 maps.
+		info->start_x = 5;
+		info->start_y = 6;
+		info->start_fuel = 1000;
+		info->bgcolor = (SDL_Color) {0, 0, 0, 255};
+		info->tilesheet_enum = TILESHEET_MOON;
+		return SDL_TRUE;
+	}
+	
+	// Revision 2 additions
+	info->start_x = read_le32(buf + 16);
+	info->start_y = read_le32(buf + 20);
+	info->start_fuel = read_le32(buf + 24);
+	info->bgcolor = (SDL_Color) {buf[28], buf[29], buf[30], buf[31]};
+	info->tilesheet_enum = buf[32];
+	
+	if (info->rev >= 3) { // get flags
+		info->flags = read_le32(buf + 33);
+		if (info->flags & ~SUPPORTED_FLAGS) {
+			SDL_SetError("Map uses features that are not supported by this version.");
+			return SDL_FALSE;
+		}
+	}
+	
+	if (info->tilesheet_enum >= TILESHEET_COUNT) {
+		SDL_SetError("Map contains an invalid tilesheet.");
+		return SDL_FALSE;
+	}
+	return SDL_TRUE;
+}
+
+/* Maps with identical embedded tilesheets share them, which means hashing the whole bitmap,
+ * so it is read into memory using the size from its file header. */
+/* The largest a bitmap with the given info header could sensibly be: the largest headers and palette,
+ * and pixel data at up to twice its uncompressed size, since RLE can come out bigger than the raw pixels. */
+static Uint64 max_bmp_size(const Uint8 info[16]) {
+	Uint32 header_size = read_le32(info);
+	Sint64 width, height;
+	int bpp;
+	if (header_size == 12) { // OS/2 headers have 16-bit dimensions
+		width = read_le16(info + 4);
+		height = read_le16(info + 6);
+		bpp = read_le16(info + 10);
+	} else {
+		width = (Sint32) read_le32(info + 4);
+		height = (Sint32) read_le32(info + 8);
+		bpp = read_le16(info + 14);
+	}
+	if (width < 0) width = -width;
+	if (height < 0) height = -height; // top-down bitmap
+	
+	Uint64 overhead = 14 + SDL_min(header_size, 124) + 16 + 256 * 4;
+	Uint64 row = ((Uint64) width * bpp + 31) / 32 * 4 + 2; // padded row, plus an end-of-line code for RLE
+	if (height && row > (SDL_MAX_UINT32 - overhead) / 2 / height) return SDL_MAX_UINT32;
+	return overhead + 2 * row * height + 2;
+}
+
+static TileSheet *load_embedded_sheet(SDL_RWops *src, SDL_Renderer *renderer, int tile_width, int tile_height) {
+	Uint8 file_header[14];
+	if (SDL_RWread(src, file_header, 1, sizeof(file_header)) != sizeof(file_header)) {
+		SDL_SetError("Map contains an invalid tilesheet.");
+		return NULL;
+	}
+	
+	// Some programs leave the size out, those sheets are loaded without being shared.
+	Uint32 bmp_size = read_le32(file_header + 2);
+	if (bmp_size <= sizeof(file_header)) {
+		if (SDL_RWseek(src, -(Sint64) sizeof(file_header), RW_SEEK_CUR) < 0) return NULL;
+		return TileSheet_createFromRWops(src, 0, renderer, tile_width, tile_height, EMBEDDED_SHEET_FLAGS);
+	}
+	
+	/* The size comes straight from the file, so check it before allocating that much:
+	 * against what is left of the map if the size of that is known, otherwise against the dimensions in the info header. */
+	Uint8 info[16];
+	size_t have = sizeof(file_header);
+	Sint64 size = SDL_RWsize(src), offset = SDL_RWtell(src);
+	if (size >= 0 && offset >= 0 && offset <= size) {
+		if (bmp_size - sizeof(file_header) > (Uint64) (size - offset)) {
+			SDL_SetError("Map contains an invalid tilesheet.");
+			return NULL;
+		}
+	} else {
+		if (
+			bmp_size < sizeof(file_header) + sizeof(info) ||
+			SDL_RWread(src, info, 1, sizeof(info)) != sizeof(info) ||
+			bmp_size > max_bmp_size(info)
+		) {
+			SDL_SetError("Map contains an invalid tilesheet.");
+			return NULL;
+		}
+		have += sizeof(info);
+	}
+	
+	Uint8 *bmp = SDL_malloc(bmp_size);
+	if (!bmp) {
+		SDL_SetError("Failed to load map into memory: not enough memory.");
+		return NULL;
+	}
+	
+	TileSheet *tiles = NULL;
+	SDL_memcpy(bmp, file_header, sizeof(file_header));
+	if (have > sizeof(file_header)) SDL_memcpy(bmp + sizeof(file_header), info, sizeof(info));
+	size_t rest = bmp_size - have;
+	if (SDL_RWread(src, bmp + have, 1, rest) != rest) {
+		SDL_SetError("Map contains an invalid tilesheet.");
+	} else {
+		tiles = TileSheet_createSharedFromMem(bmp, bmp_size, renderer, tile_width, tile_height, EMBEDDED_SHEET_FLAGS);
+	}
+	SDL_free(bmp);
+	return tiles;
+}
+
+/* Raw sheets are the width and height of the sheet in pixels, followed by the pixels in RGBA order,
+ * with transparency already applied. They can be uploaded to a texture without any conversion. */
+static TileSheet *load_raw_sheet(SDL_RWops *src, SDL_Renderer *renderer, int tile_width, int tile_height) {
+	Uint32 dim[2];
+	if (SDL_RWread(src, dim, sizeof(Uint32), 2) != 2) {
+		SDL_SetError("Map contains an invalid tilesheet.");
+		return NULL;
+	}
+	
+	Uint32 width = SDL_SwapLE32(dim[0]), height = SDL_SwapLE32(dim[1]);
+	if (!width || !height || width > SDL_MAX_SINT32 / 4 / height) {
+		SDL_SetError("Map contains an invalid tilesheet.");
+		return NULL;
+	}
+	
+	size_t size = (size_t) width * height * 4;
+	Uint8 *pixels = SDL_malloc(size);
+	if (!pixels) {
+		SDL_SetError("Failed to load map into memory: not enough memory.");
+		return NULL;
+	}
+	
+	TileSheet *tiles = NULL;
+	if (SDL_RWread(src, pixels, 1, size) != size) {
+		SDL_SetError("Map contains an invalid tilesheet.");
+	} else {
+		tiles = TileSheet_createSharedFromPixels(pixels, width, height, renderer, tile_width, tile_height, EMBEDDED_SHEET_FLAGS);
+	}
+	SDL_free(pixels);
+	return tiles;
+}
+
+/* Reads everything before the map data from src into map_header, including the tilesheet.
+ * On success, src is left positioned at the start of the map data. */
+static SDL_bool load_header(SDL_RWops *src, ML2_Map *map_header, SDL_Renderer *renderer) {
+	// Copy header into memory and check for validity
+	Uint8 buf[MAX_HEADER_SIZE];
+	*map_header = (ML2_Map) {0};
+	if (SDL_RWread(src, buf, 1, 8) != 8 || SDL_memcmp(buf, CORRECT_SIG, 4) != 0) {
+		SDL_SetError("Attempted to load an invalid map.");
+		return SDL_FALSE;
+	}
+	
+	size_t size = header_size(read_le32(buf + 4));
+	if (SDL_RWread(src, buf + 8, 1, size - 8) != size - 8) {
+		SDL_SetError("Attempted to load an invalid map.");
+		return SDL_FALSE;
+	}
+	
+	ML2_MapInfo info;
+	if (!parse_info(buf, &info)) return SDL_FALSE;
+	*map_header = (ML2_Map) {
+		.rev = info.rev,
+		.width = info.width,
+		.height = info.height,
+		.start_x = info.start_x,
+		.start_y = info.start_y,
+		.start_fuel = info.start_fuel,
+		.bgcolor = info.bgcolor,
+		.tilesheet_enum = info.tilesheet_enum,
+		.flags = info.flags
+	};
+	
+	if (map_header->tilesheet_enum) { // use built-in sheet
+		map_header->tiles = TileSheet_createShared(TILESHEET_PATHS[map_header->tilesheet_enum], renderer, 16, 16, BUILTIN_SHEET_FLAGS);
+	} else { // load embedded sheet
+		struct {Uint32 w, h;} dim;
+		if (SDL_RWread(src, &dim, sizeof(Uint32), 2) != 2) {
+			SDL_SetError("Map contains an invalid tilesheet.");
+			return SDL_FALSE;
+		};
+		map_header->tiles = map_header->flags & ML2_MAP_RAW_SHEET ?
+			load_raw_sheet(src, renderer, SDL_SwapLE32(dim.w), SDL_SwapLE32(dim.h)) :
+			load_embedded_sheet(src, renderer, SDL_SwapLE32(dim.w), SDL_SwapLE32(dim.h));
+	}
+	
+	return map_header->tiles != NULL;
 }
 
  /* Load the contents of a map from RWops into memory so it can be used in-game.
@@ -45,85 +365,76 @@ ML2_Map *ML2_Map_create(ML2_Map params, SDL_Renderer *renderer) {
  * will be set and a null pointer will be returned. */
 ML2_Map *ML2_Map_loadFromRWops(SDL_RWops *src, SDL_bool freesrc, SDL_Renderer *renderer) {
 	ML2_Map *map = NULL;
+	
+	/* The header is read a few bytes at a time, so anything that isn't already in memory
+	 * is read through a buffer. This also lets maps be streamed from pipes, since the
+	 * buffer handles the seeking that loading an embedded tilesheet needs. */
+	if (src->type != SDL_RWOPS_MEMORY && src->type != SDL_RWOPS_MEMORY_RO) {
+		src = ML2_BufferedRW_create(src, freesrc);
+		if (!src) return NULL;
+		freesrc = SDL_TRUE;
+	}
 
-	// Copy header into memory and check for validity
-	Uint32 loaded_sig;
 	ML2_Map map_header;
-	if (
-		SDL_RWread(src, &loaded_sig, 1, 4) != 4 ||
-		loaded_sig != CORRECT_SIG ||
-		SDL_RWread(src, &map_header, 1, 12) != 12
-	) {
-		SDL_SetError("Attempted to load an invalid map.");
+	if (!load_header(src, &map_header, renderer)) {
+		TileSheet_destroy(map_header.tiles);
 		goto done;
 	}
 	
-#if SDL_BYTEORDER != SDL_LIL_ENDIAN
-	// Fix byte order of rev 1 header
-	map_header.rev = SDL_SwapLE32(map_header.rev);
-	map_header.width = SDL_SwapLE32(map_header.width);
-	map_header.height = SDL_SwapLE32(map_header.height);
-#endif
-	
-	if (map_header.rev < 2) { // Use old hardcoded values for revision 1 maps.
-		map_header.start_x = 5;
-		map_header.start_y = 6;
-		map_header.start_fuel = 1000;
-		map_header.bgcolor = (SDL_Color) {0, 0, 0, 255};
-		map_header.tilesheet_enum = TILESHEET_MOON;
-		map_header.tiles = TileSheet_create(TILESHEET_PATHS[TILESHEET_MOON], renderer, 16, 16, TILESHEET_CREATESURFACE);
-	} else { // Load revision 2 additions
-		if (SDL_RWread(src, &map_header.start_x, sizeof(Uint32), 3) != 3) { // get start position, fuel
-			SDL_SetError("Attempted to load an invalid map.");
-			goto done;
-		}
-	
-		if (SDL_RWread(src, &map_header.bgcolor, 1, 4) != 4) { // get bg color
-			SDL_SetError("Attempted to load an invalid map.");
-			goto done;
-		}
-		if (SDL_RWread(src, &map_header.tilesheet_enum, 1, 1) < 1) { // get tilesheet
-			SDL_SetError("Attempted to load an invalid map.");
-			goto done;
+	if (map_header.flags & ML2_MAP_CHUNKED) {
+		map_header.chunks = ML2_ChunkCache_loadFromRWops(src, map_header.width, map_header.height, tile_bytes(map_header.flags));
+		map = map_header.chunks ? SDL_malloc(sizeof(ML2_Map)) : NULL;
+		if (!map) {
+			if (map_header.chunks) SDL_SetError("Failed to load map into memory: not enough memory.");
+			ML2_ChunkCache_destroy(map_header.chunks);
+			TileSheet_destroy(map_header.tiles);
+		} else {
+			*map = map_header;
 		}
-		
-		if (map_header.tilesheet_enum) { // use built-in sheet
-			if (map_header.tilesheet_enum >= TILESHEET_COUNT) {
-				SDL_SetError("Map contains an invalid tilesheet.");
-				goto done;
-			} else map_header.tiles = TileSheet_create(TILESHEET_PATHS[map_header.tilesheet_enum], renderer, 16, 16, TILESHEET_CREATESURFACE);
-		} else { // load embedded sheet
-			struct {Uint32 w, h;} dim;
-			if (SDL_RWread(src, &dim, sizeof(Uint32), 2) != 2) {
-				SDL_SetError("Map contains an invalid tilesheet.");
-				goto done;
-			};
-			map_header.tiles = TileSheet_createFromRWops(src, 0, renderer, dim.w, dim.h, TILESHEET_CREATESURFACE);
-		}
-		
-#if SDL_BYTEORDER != SDL_LIL_ENDIAN
-	// Fix byte order of rev 2 header
-	map_header.start_x = SDL_SwapLE32(map_header.start_x);
-	map_header.start_y = SDL_SwapLE32(map_header.start_y);
-	map_header.start_fuel = SDL_SwapLE32(map_header.start_fuel);
-#endif
+		goto done;
 	}
 	
 	// Allocate memory for map
-	size_t map_size = map_header.width * map_header.height;
+	size_t map_size;
+	if (!data_size(map_header.width, map_header.height, map_header.flags, &map_size)) {
+		SDL_SetError("Failed to load map into memory: it is too large.");
+		TileSheet_destroy(map_header.tiles);
+		goto done;
+	}
 	map = SDL_malloc(sizeof(ML2_Map) + map_size);
 	if (!map) {
 		SDL_SetError("Failed to load map into memory: not enough memory.");
+		TileSheet_destroy(map_header.tiles);
 		goto done;
 	} else {
 		*map = map_header;
+		map->data = (Uint8 *) (map + 1);
+	}
+
+	if (map_header.flags & ML2_MAP_COMPRESSED) {
+		Uint8 size_buf[8];
+		Uint64 compressed_size = SDL_RWread(src, size_buf, 1, 8) == 8 ? read_le64(size_buf) : 0;
+		Uint8 *compressed = compressed_size && compressed_size <= SIZE_MAX - 8 ? SDL_malloc(compressed_size + 8) : NULL;
+		SDL_bool success = compressed && SDL_RWread(src, compressed + 8, 1, compressed_size) == compressed_size;
+		if (success) {
+			SDL_memcpy(compressed, size_buf, 8);
+			success = decompress_data(compressed, compressed_size + 8, map->data, map_size);
+		} else {
+			SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		}
+		SDL_free(compressed);
+		if (!success) {
+			ML2_Map_free(map);
+			map = NULL;
+		}
+		goto done;
 	}
 
 	// Copy map into memory
 	if (SDL_RWread(src, map->data, 1, map_size) != map_size) {
 		// Didn't get the correct number of bytes from the source.
 		SDL_SetError("Failed to load map into memory: it is an invalid map.");
-		SDL_free(map);
+		ML2_Map_free(map);
 		map = NULL;
 		goto done;
 	}
@@ -156,7 +467,7 @@ ML2_Map *ML2_Map_loadFromMem(void *src, int size, SDL_Renderer *renderer) {
  * If there is an error or the loaded map is invalid, the SDL error state
  * will be set and a null pointer will be returned. */
 ML2_Map *ML2_Map_loadFromFile(const char *path, SDL_Renderer *renderer) {
-	SDL_RWops *src = SDL_RWFromFile(path, "rb");
+	SDL_RWops *src = SDL_strcmp(path, "-") == 0 ? SDL_RWFromFP(stdin, SDL_FALSE) : SDL_RWFromFile(path, "rb");
 	if (!src) {
 		PREFIX_ERROR("Failed to open map file %s", path);
 		return NULL;
@@ -165,14 +476,290 @@ ML2_Map *ML2_Map_loadFromFile(const char *path, SDL_Renderer *renderer) {
 	return ML2_Map_loadFromRWops(src, 1, renderer);
 }
 
-SDL_bool ML2_Map_save(ML2_Map *map, const char *path) {
-	SDL_bool success = SDL_TRUE;
-
-	SDL_RWops *rw = SDL_RWFromFile(path, "w");
-	if (!rw) {
-		PREFIX_ERROR("Failed to save map file %s", path);
+/* Read only the fixed part of a map file's header, without loading the tilesheet or tiles.
+ * Nothing is allocated, so this is cheap enough to run over every map in a directory. */
+SDL_bool ML2_Map_probe(const char *path, ML2_MapInfo *info) {
+	Uint8 buf[MAX_HEADER_SIZE];
+	size_t size;
+#ifdef ML2_HAVE_POSIX_IO
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		SDL_SetError("Failed to open map file %s", path);
+		return SDL_FALSE;
+	}
+	ssize_t bytes_read = read(fd, buf, sizeof(buf));
+	close(fd);
+	size = bytes_read > 0 ? bytes_read : 0;
+#else
+	SDL_RWops *src = SDL_RWFromFile(path, "rb");
+	if (!src) {
+		PREFIX_ERROR("Failed to open map file %s", path);
 		return SDL_FALSE;
 	}
+	size = SDL_RWread(src, buf, 1, sizeof(buf));
+	SDL_RWclose(src);
+#endif
+	
+	if (size < 8 || SDL_memcmp(buf, CORRECT_SIG, 4) != 0 || size < header_size(read_le32(buf + 4))) {
+		SDL_SetError("Failed to probe map file %s: it is an invalid map.", path);
+		return SDL_FALSE;
+	}
+	if (!parse_info(buf, info)) {
+		PREFIX_ERROR("Failed to probe map file %s", path);
+		return SDL_FALSE;
+	}
+	return SDL_TRUE;
+}
+
+/* Map a map file directly into memory, so the tile data is never copied.
+ * On platforms without mmap, this is the same as ML2_Map_loadFromFile. */
+ML2_Map *ML2_Map_mapFile(const char *path, SDL_Renderer *renderer, int flags) {
+#ifdef ML2_HAVE_MMAP
+	// Pipes and stdin can't be mapped, but they can still be read.
+	struct stat path_st;
+	if (SDL_strcmp(path, "-") == 0 || (stat(path, &path_st) == 0 && !S_ISREG(path_st.st_mode))) {
+		return ML2_Map_loadFromFile(path, renderer);
+	}
+	
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		SDL_SetError("Failed to open map file %s", path);
+		return NULL;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		SDL_SetError("Failed to open map file %s: it is an invalid map.", path);
+		return NULL;
+	}
+	
+	size_t file_size = st.st_size;
+	SDL_bool cow = !!(flags & ML2_MAP_COPYONWRITE);
+	// Read-only mappings are shared, so every process reading this map uses the same pages.
+	void *mapping = mmap(
+		NULL, file_size,
+		cow ? PROT_READ | PROT_WRITE : PROT_READ,
+		cow ? MAP_PRIVATE : MAP_SHARED,
+		fd, 0
+	);
+	close(fd); // The mapping keeps its own reference to the file.
+	if (mapping == MAP_FAILED) {
+		SDL_SetError("Failed to map file %s into memory.", path);
+		return NULL;
+	}
+	
+	// The header is parsed in place, the RWops only exists to share code with the other loaders.
+	SDL_RWops *src = SDL_RWFromConstMem(mapping, file_size > SDL_MAX_SINT32 ? SDL_MAX_SINT32 : (int) file_size);
+	if (!src) {
+		munmap(mapping, file_size);
+		return NULL;
+	}
+	
+	ML2_Map map_header;
+	SDL_bool valid = load_header(src, &map_header, renderer);
+	size_t data_offset = SDL_RWtell(src);
+	SDL_RWclose(src);
+	
+	size_t map_size = 0;
+	if (valid && data_offset > file_size) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		valid = SDL_FALSE;
+	} else if (valid && !(map_header.flags & ML2_MAP_CHUNKED) && !data_size(map_header.width, map_header.height, map_header.flags, &map_size)) {
+		SDL_SetError("Failed to load map into memory: it is too large.");
+		valid = SDL_FALSE;
+	} else if (valid && map_header.flags & ML2_MAP_CHUNKED) {
+		// Compressed chunks are used straight out of the mapping as well.
+		map_header.chunks = ML2_ChunkCache_loadFromMem(
+			(Uint8 *) mapping + data_offset, file_size - data_offset,
+			map_header.width, map_header.height, tile_bytes(map_header.flags)
+		);
+		valid = map_header.chunks != NULL;
+	} else if (valid && !(map_header.flags & ML2_MAP_COMPRESSED) && file_size - data_offset < map_size) {
+		SDL_SetError("Failed to load map into memory: it is an invalid map.");
+		valid = SDL_FALSE;
+	}
+	
+	// Compressed tile data can't be used in place, so it gets decompressed into memory instead.
+	SDL_bool decompress = !map_header.chunks && map_header.flags & ML2_MAP_COMPRESSED;
+	ML2_Map *map = valid ? SDL_malloc(sizeof(ML2_Map) + (decompress ? map_size : 0)) : NULL;
+	if (map && decompress && !decompress_data(
+		(Uint8 *) mapping + data_offset, file_size - data_offset,
+		(Uint8 *) (map + 1), map_size
+	)) {
+		SDL_free(map);
+		map = NULL;
+		valid = SDL_FALSE;
+	}
+	if (!map) {
+		if (valid) SDL_SetError("Failed to load map into memory: not enough memory.");
+		ML2_ChunkCache_destroy(map_header.chunks);
+		TileSheet_destroy(map_header.tiles);
+		munmap(mapping, file_size);
+		PREFIX_ERROR("Failed to map file %s", path);
+		return NULL;
+	}
+	
+	*map = map_header;
+	map->readonly = !cow;
+	if (decompress) {
+		munmap(mapping, file_size);
+		map->data = (Uint8 *) (map + 1);
+	} else {
+		map->data = map->chunks ? NULL : (Uint8 *) mapping + data_offset;
+		map->mapping = mapping;
+		map->mapping_size = file_size;
+	}
+	return map;
+#else
+	(void) flags;
+	return ML2_Map_loadFromFile(path, renderer);
+#endif
+}
+
+struct ML2_MapLoader {
+	SDL_Thread *thread;
+	SDL_atomic_t done;
+	char *path;
+	int flags;
+	ML2_Map *map;
+	char *error; // The SDL error state is per-thread, so failures are passed back through here.
+};
+
+/* Loads the map without a renderer, so the tilesheet only decodes its surface.
+ * Everything that touches the renderer is left for ML2_Map_finish. */
+static int load_worker(void *data) {
+	ML2_MapLoader *loader = data;
+	loader->map = ML2_Map_mapFile(loader->path, NULL, loader->flags);
+	if (!loader->map) loader->error = SDL_strdup(SDL_GetError());
+	SDL_AtomicSet(&loader->done, 1);
+	return 0;
+}
+
+ML2_MapLoader *ML2_Map_loadAsync(const char *path, int flags) {
+	ML2_MapLoader *loader = SDL_calloc(1, sizeof(ML2_MapLoader));
+	if (!loader || !(loader->path = SDL_strdup(path))) {
+		SDL_free(loader);
+		SDL_SetError("Failed to load map file %s: not enough memory.", path);
+		return NULL;
+	}
+	
+	loader->flags = flags;
+	loader->thread = SDL_CreateThread(load_worker, "ML2_Map_loadAsync", loader);
+	if (!loader->thread) {
+		SDL_free(loader->path);
+		SDL_free(loader);
+		PREFIX_ERROR("Failed to load map file %s", path);
+		return NULL;
+	}
+	return loader;
+}
+
+SDL_bool ML2_Map_poll(ML2_MapLoader *loader) {
+	return SDL_AtomicGet(&loader->done) != 0;
+}
+
+ML2_Map *ML2_Map_finish(ML2_MapLoader *loader, SDL_Renderer *renderer) {
+	SDL_WaitThread(loader->thread, NULL);
+	
+	ML2_Map *map = loader->map;
+	if (!map) {
+		SDL_SetError("%s", loader->error ? loader->error : "Failed to load map.");
+	} else if (!TileSheet_createTexture(map->tiles, renderer)) {
+		PREFIX_ERROR("Failed to load map file %s", loader->path);
+		ML2_Map_free(map);
+		map = NULL;
+	}
+	
+	SDL_free(loader->error);
+	SDL_free(loader->path);
+	SDL_free(loader);
+	return map;
+}
+
+/* A write-only RWops that collects everything written to it in a growing buffer.
+ * SDL_SaveBMP_RW seeks back to patch its header, so seeking is supported. */
+typedef struct {
+	Uint8 *data;
+	size_t size, capacity, pos;
+} MemBuffer;
+
+static Sint64 SDLCALL membuf_size(SDL_RWops *rw) {
+	return ((MemBuffer *) rw->hidden.unknown.data1)->size;
+}
+
+static Sint64 SDLCALL membuf_seek(SDL_RWops *rw, Sint64 offset, int whence) {
+	MemBuffer *buf = rw->hidden.unknown.data1;
+	Sint64 base = whence == RW_SEEK_SET ? 0 : whence == RW_SEEK_CUR ? (Sint64) buf->pos : (Sint64) buf->size;
+	if (base + offset < 0) return SDL_SetError("Seek before start of buffer");
+	buf->pos = base + offset;
+	return buf->pos;
+}
+
+static size_t SDLCALL membuf_read(SDL_RWops *rw, void *ptr, size_t size, size_t maxnum) {
+	(void) rw; (void) ptr; (void) size; (void) maxnum;
+	SDL_SetError("Buffer is write-only");
+	return 0;
+}
+
+static size_t SDLCALL membuf_write(SDL_RWops *rw, const void *ptr, size_t size, size_t num) {
+	MemBuffer *buf = rw->hidden.unknown.data1;
+	if (size && num > (SIZE_MAX - buf->pos) / size) return 0;
+	size_t end = buf->pos + size * num;
+	if (end > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while (capacity < end) capacity = capacity > SIZE_MAX / 2 ? end : capacity * 2;
+		Uint8 *data = SDL_realloc(buf->data, capacity);
+		if (!data) {
+			SDL_SetError("Not enough memory.");
+			return 0;
+		}
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+	// A seek past the end leaves a gap, which is zeroed like it would be in a file.
+	if (buf->pos > buf->size) SDL_memset(buf->data + buf->size, 0, buf->pos - buf->size);
+	SDL_memcpy(buf->data + buf->pos, ptr, size * num);
+	buf->pos = end;
+	if (end > buf->size) buf->size = end;
+	return num;
+}
+
+static int SDLCALL membuf_close(SDL_RWops *rw) {
+	SDL_FreeRW(rw); // the buffer itself belongs to the caller
+	return 0;
+}
+
+/* Convert a tilesheet to the raw format read by load_raw_sheet.
+ * This is where the per-pixel work happens, so loading doesn't have to. */
+static SDL_bool write_raw_sheet(SDL_Surface *surface, SDL_RWops *rw) {
+	SDL_Surface *rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+	if (!rgba) return SDL_FALSE;
+	
+	// Turn the color key into alpha, using whatever color the sheet is keyed with.
+	Uint32 key;
+	SDL_bool keyed = SDL_GetColorKey(surface, &key) == 0;
+	Uint8 key_r = 0, key_g = 0, key_b = 0;
+	if (keyed) SDL_GetRGB(key, surface->format, &key_r, &key_g, &key_b);
+	for (int y = 0; keyed && y < rgba->h; ++y) {
+		Uint8 *p = (Uint8 *) rgba->pixels + y * rgba->pitch;
+		for (int x = 0; x < rgba->w; ++x, p += 4) {
+			if (p[0] == key_r && p[1] == key_g && p[2] == key_b) p[3] = 0;
+		}
+	}
+	
+	Uint32 dim[2] = {SDL_SwapLE32(rgba->w), SDL_SwapLE32(rgba->h)};
+	SDL_bool success = SDL_RWwrite(rw, dim, sizeof(Uint32), 2) == 2;
+	for (int y = 0; success && y < rgba->h; ++y) {
+		success = SDL_RWwrite(rw, (Uint8 *) rgba->pixels + y * rgba->pitch, 4, rgba->w) == (size_t) rgba->w;
+	}
+	SDL_FreeSurface(rgba);
+	return success;
+}
+
+// Writes the whole map file to rw.
+static SDL_bool write_map(ML2_Map *map, SDL_RWops *rw) {
+	SDL_bool success = SDL_TRUE;
 
 	// This intermediate header is here so we don't change byte order in the working copy
 	ML2_Map saved_header = {
@@ -186,6 +773,7 @@ SDL_bool ML2_Map_save(ML2_Map *map, const char *path) {
 		.bgcolor = map->bgcolor,
 		.tiles = map->tiles,
 		.tilesheet_enum = map->tilesheet_enum,
+		.flags = SDL_SwapLE32(map->chunks ? map->flags | ML2_MAP_CHUNKED : map->flags & ~ML2_MAP_CHUNKED)
 	};
 	
 	if (SDL_RWwrite(rw, "ML2", 1, 4) != 4) {
@@ -208,44 +796,274 @@ SDL_bool ML2_Map_save(ML2_Map *map, const char *path) {
 		goto done;
 	}
 	
-	if (!saved_header.tilesheet_enum && SDL_SaveBMP_RW(saved_header.tiles->surface, rw, 0) < 0) {
+	if (SDL_RWwrite(rw, &saved_header.flags, sizeof(Uint32), 1) != 1) {
 		success = SDL_FALSE;
 		goto done;
 	}
 	
-	size_t map_size = map->width * map->height;
+	if (!saved_header.tilesheet_enum) {
+		// Embedded sheets start with the size of a tile
+		Uint32 dim[2] = {SDL_SwapLE32(saved_header.tiles->tile_width), SDL_SwapLE32(saved_header.tiles->tile_height)};
+		if (SDL_RWwrite(rw, dim, sizeof(Uint32), 2) != 2) {
+			success = SDL_FALSE;
+			goto done;
+		}
+		if (map->flags & ML2_MAP_RAW_SHEET) {
+			success = write_raw_sheet(saved_header.tiles->surface, rw);
+			if (!success) goto done;
+		} else if (SDL_SaveBMP_RW(saved_header.tiles->surface, rw, 0) < 0) {
+			success = SDL_FALSE;
+			goto done;
+		}
+	}
+	
+	if (map->chunks) {
+		success = ML2_ChunkCache_save(map->chunks, rw);
+		goto done;
+	}
+	
+	size_t map_size = (size_t) map->width * map->height * tile_bytes(map->flags); // checked when the map was made
+	if (map->flags & ML2_MAP_COMPRESSED) {
+		size_t bound = ML2_Codec_compressBound(map_size);
+		Uint8 *compressed = SDL_malloc(bound + 8);
+		if (!compressed) {
+			SDL_SetError("Not enough memory.");
+			success = SDL_FALSE;
+			goto done;
+		}
+		
+		Uint64 compressed_size = ML2_Codec_compress(map->data, map_size, compressed + 8, bound);
+		for (int i = 0; i < 8; ++i) compressed[i] = compressed_size >> (8 * i);
+		success = SDL_RWwrite(rw, compressed, 1, compressed_size + 8) == compressed_size + 8;
+		SDL_free(compressed);
+		goto done;
+	}
+	
 	if (SDL_RWwrite(rw, map->data, 1, map_size) != map_size) {
 		success = SDL_FALSE;
 		goto done;
 	}
 	
 	done:
-	if (!success) PREFIX_ERROR("Failed to save map file %s", path);
+	return success;
+}
+
+/* Serialize a map into a single block of memory, exactly as it would be saved.
+ * The result must be freed with SDL_free. */
+void *ML2_Map_serializeToMem(ML2_Map *map, size_t *size) {
+	MemBuffer buf = {0};
+	SDL_RWops *rw = SDL_AllocRW();
+	if (!rw) return NULL;
+	
+	rw->size = membuf_size;
+	rw->seek = membuf_seek;
+	rw->read = membuf_read;
+	rw->write = membuf_write;
+	rw->close = membuf_close;
+	rw->type = SDL_RWOPS_UNKNOWN;
+	rw->hidden.unknown.data1 = &buf;
+	
+	SDL_bool success = write_map(map, rw);
 	SDL_RWclose(rw);
+	if (!success) {
+		SDL_free(buf.data);
+		return NULL;
+	}
+	
+	*size = buf.size;
+	return buf.data;
+}
+
+/* The map is serialized into memory first, so the file is written in one go.
+ * Since the old file is replaced rather than overwritten, maps that are
+ * mapped from it (see ML2_Map_mapFile) are unaffected. */
+SDL_bool ML2_Map_save(ML2_Map *map, const char *path) {
+	size_t size;
+	void *data = ML2_Map_serializeToMem(map, &size);
+	SDL_bool success = data && ML2_AtomicFile_write(path, data, size);
+	SDL_free(data);
+	if (!success) PREFIX_ERROR("Failed to save map file %s", path);
 	return success;
 }
 
-// Currently only calls free, here just in case it is needed later.
+#ifdef ML2_HAVE_RENDER_GEOMETRY
+/* Every visible tile is drawn with a single SDL_RenderGeometry call. The buffers are kept between frames,
+ * and only grow when more tiles fit on screen than ever before. */
+struct ML2_MapGeometry {
+	SDL_Vertex *vertices; // 4 for every tile
+	int *indices; // 6 for every tile, which never change
+	int capacity; // in tiles
+	float *uvs; // left, top, right, and bottom texture coordinates of every tile on the tilesheet
+	SDL_Texture *uv_texture; // texture the coordinates were worked out for
+	int uv_count;
+	SDL_bool unsupported; // the renderer can't draw geometry, so tiles are copied instead
+};
+
+static void destroy_geometry(struct ML2_MapGeometry *geometry) {
+	if (!geometry) return;
+	SDL_free(geometry->vertices);
+	SDL_free(geometry->indices);
+	SDL_free(geometry->uvs);
+	SDL_free(geometry);
+}
+#endif
+
 void ML2_Map_free(ML2_Map *map) {
 	if (!map) return;
 	TileSheet_destroy(map->tiles);
+	ML2_ChunkCache_destroy(map->chunks);
+	ML2_DistanceField_destroy(map->distance);
+	SDL_free(map->heights);
+#ifdef ML2_HAVE_RENDER_GEOMETRY
+	destroy_geometry(map->geometry);
+#endif
+#ifdef ML2_HAVE_MMAP
+	if (map->mapping) munmap(map->mapping, map->mapping_size);
+#endif
+	// Tile data is either mapped or lives in the same allocation as the map.
 	SDL_free(map);
 }
 
+/* Tiles are stored in 8 or 16 bits, with the flip in the top two bits either way.
+ * Everything that reads or writes tiles is written once as a force-inlined function that
+ * takes the width as a constant, and is instantiated once for each width, so each width
+ * gets its own kernel and the 8-bit one doesn't pay for the existence of the other. */
+
+SDL_FORCE_INLINE int decode_tile(const Uint8 *p, int wide, int *flip) {
+	if (wide) {
+		Uint16 tile_data = p[0] | p[1] << 8; // not necessarily aligned when mapped
+		*flip = tile_data >> 14;
+		return tile_data & (ML2_MAP_MAX_WIDE_TILES - 1);
+	}
+	*flip = *p >> 6;
+	return *p & (ML2_MAP_MAX_TILES - 1);
+}
+
+SDL_FORCE_INLINE void encode_tile(Uint8 *p, int wide, int tile, int flip) {
+	if (wide) {
+		Uint16 tile_data = (tile & (ML2_MAP_MAX_WIDE_TILES - 1)) | flip << 14;
+		p[0] = tile_data;
+		p[1] = tile_data >> 8;
+	} else {
+		*p = (tile & (ML2_MAP_MAX_TILES - 1)) | flip << 6;
+	}
+}
+
+SDL_FORCE_INLINE int fetch_tile(ML2_Map *map, Uint32 x, Uint32 y, int *flip, int wide) {
+	if (x >= map->width || y >= map->height) return -1;
+	const Uint8 *p;
+	if (map->chunks) {
+		p = ML2_ChunkCache_getTile(map->chunks, x, y, SDL_FALSE);
+		if (!p) return -1;
+	} else {
+		p = map->data + ((size_t) y * map->width + x) * (wide ? 2 : 1);
+	}
+	int tile_flip;
+	int tile = decode_tile(p, wide, &tile_flip);
+	if (flip) *flip = tile_flip;
+	return tile;
+}
+
+/* The column of the map a column of tiles lands in. Maps that wrap around repeat forever horizontally,
+ * which is a mask when the width is a power of two. Other maps are left alone. */
+SDL_FORCE_INLINE int wrap_column(const ML2_Map *map, int x) {
+	if (!(map->flags & ML2_MAP_WRAP_X)) return x;
+	Uint32 width = map->width;
+	if (!(width & (width - 1))) return x & (int) (width - 1);
+	Sint64 column = x % (Sint64) width;
+	return (int) (column < 0 ? column + width : column);
+}
+
+SDL_FORCE_INLINE void store_tile(ML2_Map *map, Uint32 x, Uint32 y, int tile, int flip, int wide) {
+	if (map->readonly || x >= map->width || y >= map->height) return;
+	Uint8 *p;
+	if (map->chunks) {
+		p = ML2_ChunkCache_getTile(map->chunks, x, y, SDL_TRUE);
+		if (!p) return;
+	} else {
+		p = map->data + ((size_t) y * map->width + x) * (wide ? 2 : 1);
+	}
+	encode_tile(p, wide, tile, flip);
+}
+
 /* Takes a map and coordinates, and gives you the attributes of the tile at
  * those coordinates. Returns the type of tile, and if flip is non-null,
  * it will be filled with information on what direction the tile should
  * be flipped. This value is directly usable with RenderCopyEx. */
 int ML2_Map_getTile(ML2_Map *map, Uint32 x, Uint32 y, int *flip) {
-	if (!map || x >= map->width || y >= map->height) return -1;
-	Uint8 tile_data = map->data[y * map->width + x];
-	if (flip) *flip = tile_data >> 6;
-	return tile_data & 63;
+	if (!map) return -1;
+	return map->flags & ML2_MAP_WIDE_TILES ? fetch_tile(map, x, y, flip, 1) : fetch_tile(map, x, y, flip, 0);
+}
+
+static int solidity_at(ML2_Map *map, Uint32 x, Uint32 y, int *tile, int *flip) {
+	*tile = ML2_Map_getTile(map, x, y, flip);
+	return *tile != -1 ? TileSheet_getSolidity(map->tiles, *tile) : TILESHEET_TILE_EMPTY;
+}
+
+// Height just above the highest solid pixel in one column of a tile (in pixels from the bottom of the map), or 0 if there is none
+static Uint32 tile_column_top(ML2_Map *map, Uint32 x, Uint32 y, int column) {
+	int tile, flip;
+	int solidity = solidity_at(map, x, y, &tile, &flip);
+	int tile_height = map->tiles->tile_height;
+	if (solidity == TILESHEET_TILE_EMPTY) return 0;
+	if (solidity == TILESHEET_TILE_SOLID) return (y + 1) * tile_height;
+	
+	const Uint32 *mask = TileSheet_getMask(map->tiles, tile, flip);
+	for (int row = tile_height - 1; row >= 0; --row) {
+		if (mask[row * map->tiles->mask_words + column / 32] >> column % 32 & 1) return y * tile_height + row + 1;
+	}
+	return 0;
+}
+
+// Number of rows up to the highest tile in a column that isn't empty, looking down from row top - 1
+static Uint32 scan_tile_column(ML2_Map *map, Uint32 x, Uint32 top) {
+	int tile, flip;
+	while (top > 0 && solidity_at(map, x, top - 1, &tile, &flip) == TILESHEET_TILE_EMPTY) --top;
+	return top;
+}
+
+// Height of the terrain in a column of pixels, looking down from tile row top - 1
+static Uint32 scan_pixel_column(ML2_Map *map, Uint32 x, Uint32 top) {
+	int tile_width = map->tiles->tile_width;
+	for (; top > 0; --top) {
+		Uint32 height = tile_column_top(map, x / tile_width, top - 1, x % tile_width);
+		if (height) return height;
+	}
+	return 0;
+}
+
+/* Only the columns under the tile can change, and only if the tile is at or above the surface.
+ * Anything new on top is the new surface, and if the surface was in the tile, the column is scanned down from it. */
+static void update_heightmap(ML2_Map *map, Uint32 x, Uint32 y) {
+	Uint32 *tile_heights = map->heights, *pixel_heights = map->heights + map->width;
+	int tile, flip;
+	if (tile_heights[x] == y + 1) {
+		tile_heights[x] = scan_tile_column(map, x, y + 1);
+	} else if (tile_heights[x] < y + 1 && solidity_at(map, x, y, &tile, &flip) != TILESHEET_TILE_EMPTY) {
+		tile_heights[x] = y + 1;
+	}
+	
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	Uint32 bottom = y * tile_height, top = bottom + tile_height;
+	for (int column = 0; column < tile_width; ++column) {
+		Uint32 *height = &pixel_heights[(size_t) x * tile_width + column];
+		if (*height > top) continue;
+		if (*height > bottom) {
+			*height = scan_pixel_column(map, x * tile_width + column, y + 1);
+		} else {
+			Uint32 tile_top = tile_column_top(map, x, y, column);
+			if (tile_top) *height = tile_top;
+		}
+	}
 }
 
 void ML2_Map_setTile(ML2_Map *map, Uint32 x, Uint32 y, int tile, int flip) {
-	if (map && x < map->width && y < map->height)
-		map->data[y * map->width + x] = tile | flip << 6;
+	if (!map || map->readonly || x >= map->width || y >= map->height) return;
+	if (map->flags & ML2_MAP_WIDE_TILES) store_tile(map, x, y, tile, flip, 1);
+	else store_tile(map, x, y, tile, flip, 0);
+	++map->generation;
+	if (map->distance) ML2_DistanceField_update(map->distance, map, x, y);
+	if (map->heights) update_heightmap(map, x, y);
 }
 
 // Render map onto renderer with a given tileset and camera position.
@@ -253,24 +1071,28 @@ void ML2_Map_render(ML2_Map *map, SDL_Renderer *renderer, SDL_Point *camera_pos)
 	ML2_Map_renderScaled(map, renderer, camera_pos, 1);
 }
 
-void ML2_Map_renderScaled(ML2_Map *map, SDL_Renderer *renderer, SDL_Point *camera_pos, float scale) {
-	int render_w, render_h;
-	SDL_RenderGetLogicalSize(renderer, &render_w, &render_h);
-	if (!render_w || !render_h)
-		SDL_GetRendererOutputSize(renderer, &render_w, &render_h);
+// Tiles on screen, inclusive.
+typedef struct {
+	int x0, y0, x1, y1;
+} TileRange;
+
+SDL_FORCE_INLINE void copy_tiles(
+	ML2_Map *map, SDL_Renderer *renderer, const SDL_Point *camera_pos,
+	float scale, int render_h, const TileRange *range, int wide
+) {
+	// Only use the solidity table if the tilesheet already has one, rather than making one just for rendering.
+	const Uint8 *solidity = map->tiles->solidity;
+	int tile_count = map->tiles->sheet_width * map->tiles->sheet_height;
 	
-	for (
-		int y = camera_pos->y / map->tiles->tile_height / scale;
-		y <= (camera_pos->y + render_h) / map->tiles->tile_height / scale;
-		++y
-	) {
-		for (
-			int x = camera_pos->x / map->tiles->tile_width / scale;
-			x <= (camera_pos->x + render_w) / map->tiles->tile_width / scale;
-			++x
-		) {
+	for (int y = range->y0; y <= range->y1; ++y) {
+		// Columns past either edge of a map that wraps around come from the other side, so both are drawn in one pass.
+		for (int x = range->x0; x <= range->x1; ++x) {
 			int flip = 0;
-			int tile = ML2_Map_getTile(map, x, y, &flip);
+			int tile = fetch_tile(map, wrap_column(map, x), y, &flip, wide);
+			if (tile == -1 || tile >= tile_count) continue;
+			
+			// Fully transparent tiles would draw nothing, so don't make the renderer copy them.
+			if (solidity && solidity[tile] == TILESHEET_TILE_EMPTY) continue;
 			SDL_Rect src = TileSheet_getTileRect(map->tiles, tile);
 			SDL_Rect dst = {
 				.x = x * map->tiles->tile_width * scale - camera_pos->x,
@@ -283,80 +1105,742 @@ void ML2_Map_renderScaled(ML2_Map *map, SDL_Renderer *renderer, SDL_Point *camer
 	}
 }
 
+static void copy_tiles_8(ML2_Map *map, SDL_Renderer *renderer, const SDL_Point *camera_pos, float scale, int render_h, const TileRange *range) {
+	copy_tiles(map, renderer, camera_pos, scale, render_h, range, 0);
+}
+
+static void copy_tiles_16(ML2_Map *map, SDL_Renderer *renderer, const SDL_Point *camera_pos, float scale, int render_h, const TileRange *range) {
+	copy_tiles(map, renderer, camera_pos, scale, render_h, range, 1);
+}
+
+#ifdef ML2_HAVE_RENDER_GEOMETRY
+// Make room for a number of tiles, filling in the indices of the new ones.
+static SDL_bool reserve_geometry(struct ML2_MapGeometry *geometry, int tiles) {
+	if (tiles <= geometry->capacity) return SDL_TRUE;
+	int capacity = geometry->capacity > tiles / 2 ? geometry->capacity * 2 : tiles;
+	if (capacity > SDL_MAX_SINT32 / 6) capacity = tiles;
+	
+	SDL_Vertex *vertices = SDL_realloc(geometry->vertices, sizeof(SDL_Vertex) * 4 * (size_t) capacity);
+	if (!vertices) return SDL_FALSE;
+	geometry->vertices = vertices;
+	int *indices = SDL_realloc(geometry->indices, sizeof(int) * 6 * (size_t) capacity);
+	if (!indices) return SDL_FALSE;
+	geometry->indices = indices;
+	
+	// Two triangles for every tile: top left, top right, bottom left, then bottom left, top right, bottom right.
+	for (int i = geometry->capacity; i < capacity; ++i) {
+		int *p = &indices[i * 6];
+		p[0] = i * 4, p[1] = i * 4 + 1, p[2] = i * 4 + 2;
+		p[3] = i * 4 + 2, p[4] = i * 4 + 1, p[5] = i * 4 + 3;
+	}
+	geometry->capacity = capacity;
+	return SDL_TRUE;
+}
+
+// Work out where every tile is on the texture ahead of time, so it doesn't take a division for every tile drawn.
+static SDL_bool update_uvs(struct ML2_MapGeometry *geometry, TileSheet *tiles, int tile_count) {
+	if (geometry->uvs && geometry->uv_texture == tiles->texture && geometry->uv_count == tile_count) return SDL_TRUE;
+	
+	int texture_w, texture_h;
+	if (SDL_QueryTexture(tiles->texture, NULL, NULL, &texture_w, &texture_h) < 0) return SDL_FALSE;
+	float *uvs = SDL_realloc(geometry->uvs, sizeof(float) * 4 * (size_t) tile_count);
+	if (!uvs) return SDL_FALSE;
+	geometry->uvs = uvs;
+	
+	for (int row = 0, tile = 0; row < tiles->sheet_height; ++row) {
+		for (int column = 0; column < tiles->sheet_width; ++column, ++tile) {
+			float *uv = &uvs[tile * 4];
+			uv[0] = (float) (column * tiles->tile_width) / texture_w;
+			uv[1] = (float) (row * tiles->tile_height) / texture_h;
+			uv[2] = (float) ((column + 1) * tiles->tile_width) / texture_w;
+			uv[3] = (float) ((row + 1) * tiles->tile_height) / texture_h;
+		}
+	}
+	geometry->uv_texture = tiles->texture;
+	geometry->uv_count = tile_count;
+	return SDL_TRUE;
+}
+
+/* Fill the vertex buffer with the tiles on screen, and return how many there were.
+ * Flipped tiles have their texture coordinates swapped instead of being rotated. */
+SDL_FORCE_INLINE int batch_tiles(
+	ML2_Map *map, struct ML2_MapGeometry *geometry, const SDL_Point *camera_pos,
+	float scale, int render_h, const TileRange *range, SDL_Color color, int wide
+) {
+	const Uint8 *solidity = map->tiles->solidity;
+	int tile_count = map->tiles->sheet_width * map->tiles->sheet_height;
+	float scaled_width = map->tiles->tile_width * scale, scaled_height = map->tiles->tile_height * scale;
+	
+	SDL_Vertex *v = geometry->vertices;
+	int count = 0;
+	for (int y = range->y0; y <= range->y1; ++y) {
+		// Edges shared by neighbouring tiles are worked out the same way for both, so there are no seams.
+		float top = render_h + camera_pos->y - (y + 1) * scaled_height;
+		float bottom = render_h + camera_pos->y - y * scaled_height;
+		for (int x = range->x0; x <= range->x1; ++x) {
+			int flip = 0;
+			int tile = fetch_tile(map, wrap_column(map, x), y, &flip, wide);
+			if (tile == -1 || tile >= tile_count) continue;
+			if (solidity && solidity[tile] == TILESHEET_TILE_EMPTY) continue;
+			
+			const float *uv = &geometry->uvs[tile * 4];
+			float u0 = uv[0], u1 = uv[2], v0 = uv[1], v1 = uv[3];
+			if (flip & SDL_FLIP_HORIZONTAL) u0 = uv[2], u1 = uv[0];
+			if (flip & SDL_FLIP_VERTICAL) v0 = uv[3], v1 = uv[1];
+			float left = x * scaled_width - camera_pos->x, right = (x + 1) * scaled_width - camera_pos->x;
+			v[0] = (SDL_Vertex) {{left, top}, color, {u0, v0}};
+			v[1] = (SDL_Vertex) {{right, top}, color, {u1, v0}};
+			v[2] = (SDL_Vertex) {{left, bottom}, color, {u0, v1}};
+			v[3] = (SDL_Vertex) {{right, bottom}, color, {u1, v1}};
+			v += 4;
+			++count;
+		}
+	}
+	return count;
+}
+
+static int batch_tiles_8(ML2_Map *map, struct ML2_MapGeometry *geometry, const SDL_Point *camera_pos, float scale, int render_h, const TileRange *range, SDL_Color color) {
+	return batch_tiles(map, geometry, camera_pos, scale, render_h, range, color, 0);
+}
+
+static int batch_tiles_16(ML2_Map *map, struct ML2_MapGeometry *geometry, const SDL_Point *camera_pos, float scale, int render_h, const TileRange *range, SDL_Color color) {
+	return batch_tiles(map, geometry, camera_pos, scale, render_h, range, color, 1);
+}
+
+/* Draw the tiles with one call to the renderer. Returns false if they have to be copied one by one instead,
+ * because the renderer can't draw geometry or there isn't enough memory. */
+static SDL_bool render_geometry(ML2_Map *map, SDL_Renderer *renderer, const SDL_Point *camera_pos, float scale, int render_h, const TileRange *range) {
+	if (!map->tiles->texture) return SDL_FALSE;
+	if (!map->geometry) {
+		map->geometry = SDL_calloc(1, sizeof(struct ML2_MapGeometry));
+		if (!map->geometry) return SDL_FALSE;
+	}
+	
+	struct ML2_MapGeometry *geometry = map->geometry;
+	Sint64 visible = ((Sint64) range->x1 - range->x0 + 1) * ((Sint64) range->y1 - range->y0 + 1);
+	if (geometry->unsupported || visible > SDL_MAX_SINT32 / 6) return SDL_FALSE;
+	if (!reserve_geometry(geometry, (int) visible)) return SDL_FALSE;
+	if (!update_uvs(geometry, map->tiles, map->tiles->sheet_width * map->tiles->sheet_height)) return SDL_FALSE;
+	
+	// Vertex colors take the place of the texture's color and alpha modulation.
+	SDL_Color color = {255, 255, 255, 255};
+	SDL_GetTextureColorMod(map->tiles->texture, &color.r, &color.g, &color.b);
+	SDL_GetTextureAlphaMod(map->tiles->texture, &color.a);
+	
+	int count = map->flags & ML2_MAP_WIDE_TILES ?
+		batch_tiles_16(map, geometry, camera_pos, scale, render_h, range, color) :
+		batch_tiles_8(map, geometry, camera_pos, scale, render_h, range, color);
+	if (!count) return SDL_TRUE;
+	if (SDL_RenderGeometry(renderer, map->tiles->texture, geometry->vertices, count * 4, geometry->indices, count * 6) < 0) {
+		geometry->unsupported = SDL_TRUE;
+		return SDL_FALSE;
+	}
+	return SDL_TRUE;
+}
+#endif
+
+void ML2_Map_renderScaled(ML2_Map *map, SDL_Renderer *renderer, SDL_Point *camera_pos, float scale) {
+	int render_w, render_h;
+	SDL_RenderGetLogicalSize(renderer, &render_w, &render_h);
+	if (!render_w || !render_h)
+		SDL_GetRendererOutputSize(renderer, &render_w, &render_h);
+	
+	// Rounded down, since the camera can be left of a map that wraps around.
+	float scaled_width = map->tiles->tile_width * scale, scaled_height = map->tiles->tile_height * scale;
+	TileRange range = {
+		.x0 = SDL_floorf(camera_pos->x / scaled_width),
+		.y0 = SDL_floorf(camera_pos->y / scaled_height),
+		.x1 = SDL_floorf((camera_pos->x + render_w) / scaled_width),
+		.y1 = SDL_floorf((camera_pos->y + render_h) / scaled_height)
+	};
+	
+	// Keep the chunks that are on screen decompressed, and let go of the rest.
+	if (map->chunks) {
+		SDL_Rect visible = {range.x0, range.y0, range.x1 - range.x0 + 1, range.y1 - range.y0 + 1};
+		ML2_ChunkCache_setFocus(map->chunks, &visible, !!(map->flags & ML2_MAP_WRAP_X));
+	}
+	
+	// Nothing is drawn off the edges of the map, except past the sides of one that wraps around.
+	if (range.y0 < 0) range.y0 = 0;
+	if ((Sint64) range.y1 >= map->height) range.y1 = (int) map->height - 1;
+	if (!(map->flags & ML2_MAP_WRAP_X)) {
+		if (range.x0 < 0) range.x0 = 0;
+		if ((Sint64) range.x1 >= map->width) range.x1 = (int) map->width - 1;
+	}
+	if (range.x1 < range.x0 || range.y1 < range.y0) return;
+	
+#ifdef ML2_HAVE_RENDER_GEOMETRY
+	if (render_geometry(map, renderer, camera_pos, scale, render_h, &range)) return;
+#endif
+	if (map->flags & ML2_MAP_WIDE_TILES) copy_tiles_16(map, renderer, camera_pos, scale, render_h, &range);
+	else copy_tiles_8(map, renderer, camera_pos, scale, render_h, &range);
+}
+
+/* Find the first solid pixel of a tile mask within a rectangle (in pixels from the bottom left of the tile),
+ * in the order the pixels appear on the tilesheet, so the result is the same as checking them one by one. */
+static SDL_bool find_solid(const Uint32 *mask, int words, int flip, int x0, int x1, int y0, int y1, SDL_Point *hit) {
+	int first = x0 / 32, last = (x1 - 1) / 32;
+	for (int i = 0; i < y1 - y0; ++i) {
+		int y = flip & SDL_FLIP_VERTICAL ? y0 + i : y1 - 1 - i;
+		for (int j = 0; j <= last - first; ++j) {
+			int w = flip & SDL_FLIP_HORIZONTAL ? last - j : first + j;
+			int lo = SDL_max(x0 - w * 32, 0), hi = SDL_min(x1 - w * 32, 32);
+			Uint32 span = (hi == 32 ? ~0u : (1u << hi) - 1) & ~((1u << lo) - 1);
+			Uint32 bits = mask[y * words + w] & span;
+			if (bits) {
+				hit->x = w * 32 + SDL_MostSignificantBitIndex32(flip & SDL_FLIP_HORIZONTAL ? bits : bits & -bits);
+				hit->y = y;
+				return SDL_TRUE;
+			}
+		}
+	}
+	return SDL_FALSE;
+}
+
+// Division by a positive number that rounds towards negative infinity, so pixels left of or below the map land in negative tiles.
+SDL_FORCE_INLINE int floor_div(int a, int b) {
+	int q = a / b;
+	return q - (q * b > a);
+}
+
+// log2 of a tile size if it is a power of two, otherwise -1
+static int tile_shift(int tile_size) {
+	return tile_size & (tile_size - 1) ? -1 : SDL_MostSignificantBitIndex32(tile_size);
+}
+
+// floor_div by a tile size, which is a shift if it is a power of two (~a is -a - 1, so it rounds the right way)
+SDL_FORCE_INLINE int tile_div(int a, int tile_size, int shift) {
+	if (shift < 0) return floor_div(a, tile_size);
+	return a >= 0 ? a >> shift : ~(~a >> shift);
+}
+
+/* The tiles covering the pixels from start to start + size along one axis, cut down to the ones in the map.
+ * Tiles are nearly always a power of two in size, and shifting is a lot faster than dividing. */
+SDL_FORCE_INLINE SDL_bool tile_span(int start, int size, int tile_size, int shift, Uint32 count, int *first, int *last) {
+	if (size <= 0) return SDL_FALSE;
+	int a = tile_div(start, tile_size, shift), b = tile_div(start + size - 1, tile_size, shift);
+	if (b < 0 || (a >= 0 && (Uint32) a >= count)) return SDL_FALSE;
+	*first = SDL_max(a, 0);
+	*last = (Uint32) b >= count ? (int) (count - 1) : b;
+	return SDL_TRUE;
+}
+
+/* Like tile_span for columns, except that maps that wrap around aren't cut down.
+ * A rectangle wider than the map covers every column, plus the one it started in again for the part
+ * of it that was left of where it started. */
+SDL_FORCE_INLINE SDL_bool column_span(const ML2_Map *map, int start, int size, int tile_size, int shift, int *first, int *last) {
+	if (!(map->flags & ML2_MAP_WRAP_X)) return tile_span(start, size, tile_size, shift, map->width, first, last);
+	if (size <= 0 || !map->width) return SDL_FALSE;
+	*first = tile_div(start, tile_size, shift);
+	*last = tile_div(start + size - 1, tile_size, shift);
+	if ((Uint32) (*last - *first) > map->width) *last = *first + (int) map->width;
+	return SDL_TRUE;
+}
+
+/* Check the rectangle against every tile it covers, a row at a time from the bottom,
+ * stopping at the first tile it touches a solid pixel of. */
+SDL_FORCE_INLINE int collide_tiles(
+	ML2_Map *map, const SDL_Rect *r, const SDL_Rect *r_old,
+	int tx0, int tx1, int ty0, int ty1, int wide
+) {
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	for (int ty = ty0; ty <= ty1; ++ty) {
+		// Only the first and last rows and columns can be partly covered.
+		int bottom = ty * tile_height;
+		int y0 = SDL_max(r->y - bottom, 0), y1 = SDL_min(r->y + r->h - bottom, tile_height);
+		for (int tx = tx0; tx <= tx1; ++tx) {
+			int flip;
+			int tile = fetch_tile(map, wrap_column(map, tx), ty, &flip, wide);
+			int solidity = tile != -1 ? TileSheet_getSolidity(map->tiles, tile) : TILESHEET_TILE_EMPTY;
+			if (solidity == TILESHEET_TILE_EMPTY) continue;
+			
+			// The part of the rectangle that overlaps this tile, relative to its bottom left corner
+			int left = tx * tile_width;
+			int x0 = tx == tx0 ? SDL_max(r->x - left, 0) : 0;
+			int x1 = tx == tx1 ? SDL_min(r->x + r->w - left, tile_width) : tile_width;
+			
+			// In a solid tile, the first pixel find_solid would reach is the corner it starts from.
+			SDL_Point hit;
+			if (solidity == TILESHEET_TILE_SOLID) {
+				hit.x = flip & SDL_FLIP_HORIZONTAL ? x1 - 1 : x0;
+				hit.y = flip & SDL_FLIP_VERTICAL ? y0 : y1 - 1;
+			} else if (!find_solid(TileSheet_getMask(map->tiles, tile, flip), map->tiles->mask_words, flip, x0, x1, y0, y1, &hit)) {
+				continue;
+			}
+			
+			SDL_Point collider = {left + hit.x, bottom + hit.y};
+			if (!r_old) return ML2_MAP_COLLIDED_X | ML2_MAP_COLLIDED_Y;
+			SDL_bool collided_left = r_old->x + r_old->w < collider.x && r->x + r->w >= collider.x;
+			SDL_bool collided_right = r_old->x >= collider.x && r->x < collider.x;
+			SDL_bool collided_top = r_old->y + r_old->h < collider.y && r->y + r->h >= collider.y;
+			SDL_bool collided_bottom = r_old->y >= collider.y && r->y < collider.y;
+			int result = 0;
+			if (collided_left || collided_right) result |= ML2_MAP_COLLIDED_X;
+			if (collided_top || collided_bottom) result |= ML2_MAP_COLLIDED_Y;
+			return result == 0 ? ML2_MAP_COLLIDED_X | ML2_MAP_COLLIDED_Y : result; // hack
+		}
+	}
+
+	return 0;
+}
+
+SDL_FORCE_INLINE int collide(ML2_Map *map, const SDL_Rect *r, const SDL_Rect *r_old, int wide) {
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	int tx0, tx1, ty0, ty1;
+	if (
+		!column_span(map, r->x, r->w, tile_width, tile_shift(tile_width), &tx0, &tx1) ||
+		!tile_span(r->y, r->h, tile_height, tile_shift(tile_height), map->height, &ty0, &ty1)
+	) return 0;
+	return collide_tiles(map, r, r_old, tx0, tx1, ty0, ty1, wide);
+}
+
+static int collide_8(ML2_Map *map, const SDL_Rect *r, const SDL_Rect *r_old) {
+	return collide(map, r, r_old, 0);
+}
+
+static int collide_16(ML2_Map *map, const SDL_Rect *r, const SDL_Rect *r_old) {
+	return collide(map, r, r_old, 1);
+}
+
 // Returns whether the rectangle is currently colliding with a tile and the direction.
 int ML2_Map_doCollision(ML2_Map *map, const SDL_Rect *r, const SDL_Rect *r_old) {
-	struct {
-		SDL_Point point;
-		int tile;
-		int flip;
-	} possible_tiles[4] = {
-		{.point = {r->x / map->tiles->tile_width, r->y / map->tiles->tile_width}},
-		{.point = {(r->x + r->w) / map->tiles->tile_width, r->y / map->tiles->tile_width}},
-		{.point = {r->x / map->tiles->tile_width, (r->y + r->h) / map->tiles->tile_width}},
-		{.point = {(r->x + r->w) / map->tiles->tile_width, (r->y + r->h) / map->tiles->tile_width}}
+	return map->flags & ML2_MAP_WIDE_TILES ? collide_16(map, r, r_old) : collide_8(map, r, r_old);
+}
+
+// Fewest rectangles worth starting a thread for
+#define BATCH_MIN_PER_THREAD 1024
+#define BATCH_MAX_THREADS 64
+
+typedef struct {
+	ML2_Map *map;
+	const ML2_Map_RectArrays *rects, *rects_old;
+	Uint8 *results;
+	int start, end;
+} CollisionBatch;
+
+// Checks each rectangle in the batch's range in turn, the same way ML2_Map_doCollision does.
+SDL_FORCE_INLINE void collide_batch(const CollisionBatch *batch, int wide) {
+	ML2_Map *map = batch->map;
+	const ML2_Map_RectArrays *r = batch->rects, *old = batch->rects_old;
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	int shift_x = tile_shift(tile_width), shift_y = tile_shift(tile_height);
+	for (int j = batch->start; j < batch->end; ++j) {
+		int tx0, tx1, ty0, ty1;
+		if (
+			!column_span(map, r->x[j], r->w[j], tile_width, shift_x, &tx0, &tx1) ||
+			!tile_span(r->y[j], r->h[j], tile_height, shift_y, map->height, &ty0, &ty1)
+		) {
+			batch->results[j] = 0;
+			continue;
+		}
+		SDL_Rect rect = {r->x[j], r->y[j], r->w[j], r->h[j]};
+		SDL_Rect rect_old = old ? (SDL_Rect) {old->x[j], old->y[j], old->w[j], old->h[j]} : (SDL_Rect) {0};
+		batch->results[j] = collide_tiles(map, &rect, old ? &rect_old : NULL, tx0, tx1, ty0, ty1, wide);
+	}
+}
+
+static int collide_batch_8(void *data) {
+	collide_batch(data, 0);
+	return 0;
+}
+
+static int collide_batch_16(void *data) {
+	collide_batch(data, 1);
+	return 0;
+}
+
+void ML2_Map_doCollisionBatch(
+	ML2_Map *map,
+	const ML2_Map_RectArrays *rects,
+	const ML2_Map_RectArrays *rects_old,
+	Uint8 *results,
+	int count,
+	int threads
+) {
+	if (count <= 0) return;
+	SDL_ThreadFunction worker = map->flags & ML2_MAP_WIDE_TILES ? collide_batch_16 : collide_batch_8;
+	
+	// Masks are made the first time they are needed, which has to happen before the threads share them.
+	TileSheet_getSolidity(map->tiles, 0);
+	
+	if (threads <= 0) threads = SDL_GetCPUCount();
+	if (map->chunks) threads = 1;
+	threads = SDL_min(threads, SDL_min(SDL_max(count / BATCH_MIN_PER_THREAD, 1), BATCH_MAX_THREADS));
+	
+	CollisionBatch batches[BATCH_MAX_THREADS];
+	SDL_Thread *workers[BATCH_MAX_THREADS] = {0};
+	for (int i = 0; i < threads; ++i) {
+		batches[i] = (CollisionBatch) {
+			.map = map,
+			.rects = rects,
+			.rects_old = rects_old,
+			.results = results,
+			.start = (Sint64) count * i / threads,
+			.end = (Sint64) count * (i + 1) / threads
+		};
+		if (i) workers[i] = SDL_CreateThread(worker, "ML2_Map_doCollisionBatch", &batches[i]);
+	}
+	
+	// The calling thread takes the first share, and any share a thread couldn't be started for.
+	worker(&batches[0]);
+	for (int i = 1; i < threads; ++i) {
+		if (workers[i]) SDL_WaitThread(workers[i], NULL);
+		else worker(&batches[i]);
+	}
+}
+
+// 32 bits of a tile mask row starting at bit start, with zeroes for anything outside of the row
+static Uint32 mask_window(const Uint32 *row, int words, int start) {
+	int w = floor_div(start, 32), shift = start - w * 32;
+	Uint64 lo = w >= 0 && w < words ? row[w] : 0;
+	Uint64 hi = w + 1 >= 0 && w + 1 < words ? row[w + 1] : 0;
+	return (Uint32) ((lo | hi << 32) >> shift);
+}
+
+SDL_FORCE_INLINE SDL_bool collide_mask(ML2_Map *map, int x, int y, const Uint32 *mask, int height, int wide) {
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	int tx1 = floor_div(x + 31, tile_width), ty1 = floor_div(y + height - 1, tile_height);
+	for (int ty = floor_div(y, tile_height); ty <= ty1; ++ty) {
+		for (int tx = floor_div(x, tile_width); tx <= tx1; ++tx) {
+			int flip;
+			int tile = fetch_tile(map, wrap_column(map, tx), ty, &flip, wide);
+			int solidity = tile != -1 ? TileSheet_getSolidity(map->tiles, tile) : TILESHEET_TILE_EMPTY;
+			if (solidity == TILESHEET_TILE_EMPTY) continue;
+			
+			int bottom = ty * tile_height;
+			int y0 = SDL_max(bottom, y), y1 = SDL_min(bottom + tile_height, y + height);
+			if (solidity == TILESHEET_TILE_SOLID) {
+				// Every column the tile covers is solid, so only the mask needs to be looked at.
+				int lo = SDL_max(tx * tile_width - x, 0), hi = SDL_min(tx * tile_width + tile_width - x, 32);
+				Uint32 span = (hi == 32 ? ~0u : (1u << hi) - 1) & ~((1u << lo) - 1);
+				for (int row = y0; row < y1; ++row) {
+					if (mask[row - y] & span) return SDL_TRUE;
+				}
+				continue;
+			}
+			
+			// Line the tile's rows up with the mask's and AND them together.
+			const Uint32 *tile_mask = TileSheet_getMask(map->tiles, tile, flip);
+			for (int row = y0; row < y1; ++row) {
+				const Uint32 *tile_row = tile_mask + (row - bottom) * map->tiles->mask_words;
+				if (mask[row - y] & mask_window(tile_row, map->tiles->mask_words, x - tx * tile_width)) return SDL_TRUE;
+			}
+		}
+	}
+	return SDL_FALSE;
+}
+
+static SDL_bool collide_mask_8(ML2_Map *map, int x, int y, const Uint32 *mask, int height) {
+	return collide_mask(map, x, y, mask, height, 0);
+}
+
+static SDL_bool collide_mask_16(ML2_Map *map, int x, int y, const Uint32 *mask, int height) {
+	return collide_mask(map, x, y, mask, height, 1);
+}
+
+SDL_bool ML2_Map_doMaskCollision(ML2_Map *map, int x, int y, const Uint32 *mask, int height) {
+	return map->flags & ML2_MAP_WIDE_TILES ? collide_mask_16(map, x, y, mask, height) : collide_mask_8(map, x, y, mask, height);
+}
+
+// The largest value below a whole number b that still rounds down to the number before it
+static float just_below(float b) {
+	float v = b - 1.0f / 256.0f;
+	return SDL_floorf(v) < b ? v : b - 1.0f;
+}
+
+// Keep a coordinate within the pixel starting at c.
+static float clamp_to_pixel(float v, int c) {
+	return v < c ? c : v >= c + 1 ? just_below(c + 1) : v;
+}
+
+/* Step the mask's bottom left corner through every pixel along the movement, like a DDA
+ * stepping through grid cells. Only one axis changes per step, so nothing can be skipped,
+ * and the axis that was stepped when the mask hits is the one the surface faces along. */
+SDL_FORCE_INLINE SDL_bool sweep_mask(
+	ML2_Map *map, float x, float y, float dx, float dy,
+	const Uint32 *mask, int height, ML2_Map_Sweep *sweep, int wide
+) {
+	int cx = (int) SDL_floorf(x), cy = (int) SDL_floorf(y);
+	*sweep = (ML2_Map_Sweep) {.time = 1.0f, .x = x + dx, .y = y + dy};
+	if (collide_mask(map, cx, cy, mask, height, wide)) {
+		*sweep = (ML2_Map_Sweep) {.time = 0.0f, .x = x, .y = y};
+		return SDL_TRUE;
+	}
+	
+	int end_x = (int) SDL_floorf(x + dx), end_y = (int) SDL_floorf(y + dy);
+	int step_x = dx < 0 ? -1 : 1, step_y = dy < 0 ? -1 : 1;
+	
+	// Time at which the next pixel boundary is crossed on each axis, and the time between boundaries
+	float next_x = dx ? (dx < 0 ? x - cx : cx + 1 - x) / SDL_fabsf(dx) : 0.0f;
+	float next_y = dy ? (dy < 0 ? y - cy : cy + 1 - y) / SDL_fabsf(dy) : 0.0f;
+	float delta_x = dx ? 1.0f / SDL_fabsf(dx) : 0.0f, delta_y = dy ? 1.0f / SDL_fabsf(dy) : 0.0f;
+	
+	while (cx != end_x || cy != end_y) {
+		SDL_bool along_x = cx != end_x && (cy == end_y || next_x <= next_y);
+		float time = along_x ? next_x : next_y;
+		int nx = along_x ? cx + step_x : cx, ny = along_x ? cy : cy + step_y;
+		if (collide_mask(map, nx, ny, mask, height, wide)) {
+			sweep->time = SDL_min(time, 1.0f);
+			sweep->x = clamp_to_pixel(x + dx * sweep->time, cx);
+			sweep->y = clamp_to_pixel(y + dy * sweep->time, cy);
+			sweep->normal_x = along_x ? -step_x : 0;
+			sweep->normal_y = along_x ? 0 : -step_y;
+			return SDL_TRUE;
+		}
+		
+		cx = nx, cy = ny;
+		if (along_x) next_x += delta_x;
+		else next_y += delta_y;
+	}
+	return SDL_FALSE;
+}
+
+static SDL_bool sweep_mask_8(ML2_Map *map, float x, float y, float dx, float dy, const Uint32 *mask, int height, ML2_Map_Sweep *sweep) {
+	return sweep_mask(map, x, y, dx, dy, mask, height, sweep, 0);
+}
+
+static SDL_bool sweep_mask_16(ML2_Map *map, float x, float y, float dx, float dy, const Uint32 *mask, int height, ML2_Map_Sweep *sweep) {
+	return sweep_mask(map, x, y, dx, dy, mask, height, sweep, 1);
+}
+
+SDL_bool ML2_Map_sweepMask(ML2_Map *map, float x, float y, float dx, float dy, const Uint32 *mask, int height, ML2_Map_Sweep *sweep) {
+	return map->flags & ML2_MAP_WIDE_TILES ?
+		sweep_mask_16(map, x, y, dx, dy, mask, height, sweep) :
+		sweep_mask_8(map, x, y, dx, dy, mask, height, sweep);
+}
+
+/* Stepping through a grid along a ray, one cell boundary at a time.
+ * Times are distances along the ray, since its direction is normalized. */
+typedef struct {
+	int x, y; // current cell
+	int step_x, step_y;
+	float next_x, next_y; // time the next boundary is crossed on each axis
+	float delta_x, delta_y; // time between boundaries on each axis
+} GridWalk;
+
+static void grid_walk_start(GridWalk *w, float x, float y, float dx, float dy, int cx, int cy, int cell_w, int cell_h, float never) {
+	w->x = cx, w->y = cy;
+	w->step_x = dx < 0 ? -1 : 1, w->step_y = dy < 0 ? -1 : 1;
+	w->next_x = dx ? ((float) (cx + (dx > 0)) * cell_w - x) / dx : never;
+	w->next_y = dy ? ((float) (cy + (dy > 0)) * cell_h - y) / dy : never;
+	w->delta_x = dx ? cell_w / SDL_fabsf(dx) : 0.0f;
+	w->delta_y = dy ? cell_h / SDL_fabsf(dy) : 0.0f;
+}
+
+// Move to the next cell, returning the time it is entered at and which axis was crossed (1 for x, 2 for y).
+static float grid_walk_step(GridWalk *w, int *axis) {
+	float t;
+	if (w->next_x <= w->next_y) {
+		t = w->next_x;
+		w->x += w->step_x;
+		w->next_x += w->delta_x;
+		*axis = 1;
+	} else {
+		t = w->next_y;
+		w->y += w->step_y;
+		w->next_y += w->delta_y;
+		*axis = 2;
+	}
+	return t;
+}
+
+// Cut the part of the ray where one coordinate is within [0, size) out of [t0, t1].
+static SDL_bool clip_ray(float origin, float dir, float size, float *t0, float *t1, SDL_bool *entered) {
+	if (!dir) return origin >= 0 && origin < size;
+	float a = -origin / dir, b = (size - origin) / dir;
+	if (a > b) {
+		float swap = a;
+		a = b, b = swap;
+	}
+	*entered = a > *t0;
+	if (a > *t0) *t0 = a;
+	if (b < *t1) *t1 = b;
+	return *t0 <= *t1;
+}
+
+static int clamp_int(int v, int lo, int hi) {
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void set_hit(ML2_Map_RayHit *hit, float t, int x, int y, int axis, const GridWalk *w) {
+	*hit = (ML2_Map_RayHit) {
+		.hit = SDL_TRUE,
+		.distance = t,
+		.x = x,
+		.y = y,
+		.normal_x = axis == 1 ? -w->step_x : 0,
+		.normal_y = axis == 2 ? -w->step_y : 0
 	};
+}
 
-	possible_tiles[0].tile = ML2_Map_getTile(
-		map,
-		possible_tiles[0].point.x,
-		possible_tiles[0].point.y,
-		&possible_tiles[0].flip
-	);
+/* Walk the map a tile at a time, and only walk pixels inside tiles that are partially solid.
+ * The cell the ray is in is worked out once and then only stepped, and clamped to the tile
+ * it should be in, so rounding can never skip a cell. */
+SDL_FORCE_INLINE void raycast(ML2_Map *map, float x, float y, float dir_x, float dir_y, float max_distance, ML2_Map_RayHit *hit, int wide) {
+	*hit = (ML2_Map_RayHit) {.distance = max_distance};
+	float length = SDL_sqrtf(dir_x * dir_x + dir_y * dir_y);
+	if (!length || !(max_distance >= 0)) return;
+	float dx = dir_x / length, dy = dir_y / length;
 	
-	possible_tiles[1].tile = ML2_Map_getTile(
-		map,
-		possible_tiles[1].point.x,
-		possible_tiles[1].point.y,
-		&possible_tiles[1].flip
-	);
+	/* Only the part of the ray over the map can hit anything. Maps that wrap around have no edges
+	 * horizontally, but a flat ray has seen every column once it has crossed the whole map. */
+	int tile_width = map->tiles->tile_width, tile_height = map->tiles->tile_height;
+	SDL_bool wrap = !!(map->flags & ML2_MAP_WRAP_X);
+	float t = 0.0f, t_end = max_distance;
+	SDL_bool entered_x = SDL_FALSE, entered_y = SDL_FALSE;
+	if (wrap && !dy) t_end = SDL_min(t_end, ((float) map->width + 1.0f) * tile_width);
+	if (
+		(!wrap && !clip_ray(x, dx, (float) map->width * tile_width, &t, &t_end, &entered_x)) ||
+		!clip_ray(y, dy, (float) map->height * tile_height, &t, &t_end, &entered_y)
+	) return;
+	int axis = entered_y ? 2 : entered_x ? 1 : 0;
+	float never = t_end + 1.0f;
 	
-	possible_tiles[2].tile = ML2_Map_getTile(
-		map,
-		possible_tiles[2].point.x,
-		possible_tiles[2].point.y,
-		&possible_tiles[2].flip
+	GridWalk tiles;
+	float px = x + dx * t, py = y + dy * t;
+	int start_x = SDL_floorf(px / tile_width);
+	grid_walk_start(
+		&tiles, x, y, dx, dy,
+		wrap ? start_x : clamp_int(start_x, 0, map->width - 1),
+		clamp_int(SDL_floorf(py / tile_height), 0, map->height - 1),
+		tile_width, tile_height, never
 	);
 	
-	possible_tiles[3].tile = ML2_Map_getTile(
-		map,
-		possible_tiles[3].point.x,
-		possible_tiles[3].point.y,
-		&possible_tiles[3].flip
-	);
-
-	for (int i = 0; i < 4; ++i) {
-		if (possible_tiles[i].tile != -1) {
-			for (int y = 0; y < map->tiles->tile_height; ++y) {
-				for (int x = 0; x < map->tiles->tile_width; ++x) {
-					if (
-						TileSheet_getPixel(map->tiles, possible_tiles[i].tile, x, y) !=
-						SDL_MapRGB(map->tiles->surface->format, 0, 255, 0)
-					) {
-						SDL_Point collider = {
-							.x = possible_tiles[i].flip & SDL_FLIP_HORIZONTAL ?
-								possible_tiles[i].point.x * map->tiles->tile_width + (map->tiles->tile_width - 1 - x) :
-								possible_tiles[i].point.x * map->tiles->tile_width + x,
-							.y = possible_tiles[i].flip & SDL_FLIP_VERTICAL ?
-								possible_tiles[i].point.y * map->tiles->tile_height + y :
-								possible_tiles[i].point.y * map->tiles->tile_height + (map->tiles->tile_height - 1 - y)
-						};
-						
-						if (SDL_PointInRect(&collider, r)) {
-							if (!r_old) return ML2_MAP_COLLIDED_X | ML2_MAP_COLLIDED_Y;
-							SDL_bool collided_left = r_old->x + r_old->w < collider.x && r->x + r->w >= collider.x;
-							SDL_bool collided_right = r_old->x >= collider.x && r->x < collider.x;
-							SDL_bool collided_top = r_old->y + r_old->h < collider.y && r->y + r->h >= collider.y;
-							SDL_bool collided_bottom = r_old->y >= collider.y && r->y < collider.y;
-							int result = 0;
-							if (collided_left || collided_right) result |= ML2_MAP_COLLIDED_X;
-							if (collided_top || collided_bottom) result |= ML2_MAP_COLLIDED_Y;
-							return result == 0 ? ML2_MAP_COLLIDED_X | ML2_MAP_COLLIDED_Y : result; // hack
-						}
-					}
+	for (;;) {
+		int flip = 0;
+		int tile = fetch_tile(map, wrap_column(map, tiles.x), tiles.y, &flip, wide);
+		int solidity = tile != -1 ? TileSheet_getSolidity(map->tiles, tile) : TILESHEET_TILE_EMPTY;
+		int left = tiles.x * tile_width, bottom = tiles.y * tile_height;
+		
+		// Where the ray is within the tile when it enters it
+		int pixel_x = clamp_int(SDL_floorf(x + dx * t) - left, 0, tile_width - 1);
+		int pixel_y = clamp_int(SDL_floorf(y + dy * t) - bottom, 0, tile_height - 1);
+		if (solidity == TILESHEET_TILE_SOLID) {
+			set_hit(hit, t, left + pixel_x, bottom + pixel_y, axis, &tiles);
+			return;
+		} else if (solidity == TILESHEET_TILE_PARTIAL) {
+			const Uint32 *mask = TileSheet_getMask(map->tiles, tile, flip);
+			int words = map->tiles->mask_words;
+			float tile_end = SDL_min(SDL_min(tiles.next_x, tiles.next_y), t_end);
+			
+			GridWalk pixels;
+			grid_walk_start(&pixels, x, y, dx, dy, left + pixel_x, bottom + pixel_y, 1, 1, never);
+			float pt = t;
+			int pixel_axis = axis;
+			for (;;) {
+				int mx = pixels.x - left, my = pixels.y - bottom;
+				if (mx < 0 || mx >= tile_width || my < 0 || my >= tile_height || pt > tile_end) break;
+				if (mask[my * words + mx / 32] >> mx % 32 & 1) {
+					set_hit(hit, pt, pixels.x, pixels.y, pixel_axis, &pixels);
+					return;
 				}
+				pt = grid_walk_step(&pixels, &pixel_axis);
 			}
 		}
+		
+		t = grid_walk_step(&tiles, &axis);
+		if (t > t_end || tiles.y < 0 || (Uint32) tiles.y >= map->height) return;
+		if (!wrap && (tiles.x < 0 || (Uint32) tiles.x >= map->width)) return;
 	}
+}
 
-	return 0;
+static void raycast_8(ML2_Map *map, float x, float y, float dir_x, float dir_y, float max_distance, ML2_Map_RayHit *hit) {
+	raycast(map, x, y, dir_x, dir_y, max_distance, hit, 0);
+}
+
+static void raycast_16(ML2_Map *map, float x, float y, float dir_x, float dir_y, float max_distance, ML2_Map_RayHit *hit) {
+	raycast(map, x, y, dir_x, dir_y, max_distance, hit, 1);
+}
+
+SDL_bool ML2_Map_raycast(ML2_Map *map, float x, float y, float dir_x, float dir_y, float max_distance, ML2_Map_RayHit *hit) {
+	ML2_Map_RayHit result;
+	if (map->flags & ML2_MAP_WIDE_TILES) raycast_16(map, x, y, dir_x, dir_y, max_distance, &result);
+	else raycast_8(map, x, y, dir_x, dir_y, max_distance, &result);
+	if (hit) *hit = result;
+	return result.hit;
+}
+
+SDL_FORCE_INLINE void raycast_batch(ML2_Map *map, const ML2_Map_RayArrays *rays, float max_distance, ML2_Map_RayHit *hits, int count, int wide) {
+	for (int i = 0; i < count; ++i) {
+		raycast(map, rays->x[i], rays->y[i], rays->dir_x[i], rays->dir_y[i], max_distance, &hits[i], wide);
+	}
+}
+
+static void raycast_batch_8(ML2_Map *map, const ML2_Map_RayArrays *rays, float max_distance, ML2_Map_RayHit *hits, int count) {
+	raycast_batch(map, rays, max_distance, hits, count, 0);
+}
+
+static void raycast_batch_16(ML2_Map *map, const ML2_Map_RayArrays *rays, float max_distance, ML2_Map_RayHit *hits, int count) {
+	raycast_batch(map, rays, max_distance, hits, count, 1);
+}
+
+void ML2_Map_raycastBatch(ML2_Map *map, const ML2_Map_RayArrays *rays, float max_distance, ML2_Map_RayHit *hits, int count) {
+	if (map->flags & ML2_MAP_WIDE_TILES) raycast_batch_16(map, rays, max_distance, hits, count);
+	else raycast_batch_8(map, rays, max_distance, hits, count);
+}
+
+SDL_bool ML2_Map_lineOfSight(ML2_Map *map, float x0, float y0, float x1, float y1) {
+	float dx = x1 - x0, dy = y1 - y0;
+	return !ML2_Map_raycast(map, x0, y0, dx, dy, SDL_sqrtf(dx * dx + dy * dy), NULL);
+}
+
+SDL_bool ML2_Map_createDistanceField(ML2_Map *map, int cell_size, float max_distance, int threads) {
+	ML2_DistanceField *field = ML2_DistanceField_create(map, cell_size, max_distance, threads);
+	if (!field) return SDL_FALSE;
+	ML2_DistanceField_destroy(map->distance);
+	map->distance = field;
+	return SDL_TRUE;
+}
+
+float ML2_Map_getDistance(const ML2_Map *map, int x, int y) {
+	return ML2_DistanceField_get(map->distance, x, y);
+}
+
+SDL_bool ML2_Map_createHeightmap(ML2_Map *map) {
+	int tile_width = map->tiles->tile_width;
+	Uint64 columns = (Uint64) map->width * (1 + tile_width);
+	if (
+		(Uint64) map->width * tile_width > SDL_MAX_SINT32 ||
+		(Uint64) map->height * map->tiles->tile_height > SDL_MAX_UINT32 ||
+		columns > SIZE_MAX / sizeof(Uint32)
+	) {
+		SDL_SetError("Failed to create heightmap: the map is too large.");
+		return SDL_FALSE;
+	}
+	
+	Uint32 *heights = SDL_malloc(sizeof(Uint32) * columns);
+	if (!heights) {
+		SDL_SetError("Failed to create heightmap: not enough memory.");
+		return SDL_FALSE;
+	}
+	
+	// Nothing in a column of pixels is above the highest tile in its column of tiles.
+	Uint32 *pixel_heights = heights + map->width;
+	for (Uint32 x = 0; x < map->width; ++x) {
+		heights[x] = scan_tile_column(map, x, map->height);
+		for (int column = 0; column < tile_width; ++column) {
+			Uint32 px = x * tile_width + column;
+			pixel_heights[px] = scan_pixel_column(map, px, heights[x]);
+		}
+	}
+	
+	SDL_free(map->heights);
+	map->heights = heights;
+	return SDL_TRUE;
+}
+
+Uint32 ML2_Map_getSurfaceHeight(const ML2_Map *map, int x) {
+	if (map->flags & ML2_MAP_WRAP_X) {
+		// Move to the same place in the column of tiles it wraps around to.
+		int tile_width = map->tiles->tile_width, tx = floor_div(x, tile_width);
+		x = wrap_column(map, tx) * tile_width + (x - tx * tile_width);
+	}
+	if (x < 0 || (Uint64) x >= (Uint64) map->width * map->tiles->tile_width) return 0;
+	return map->heights[map->width + x];
+}
+
+Uint32 ML2_Map_getSurfaceTile(const ML2_Map *map, int x) {
+	x = wrap_column(map, x);
+	if (x < 0 || (Uint32) x >= map->width) return 0;
+	return map->heights[x];
 }
@@ -21,6 +21,35 @@ enum ML2_Map_CollisionAxis {
 	ML2_MAP_COLLIDED_Y = 2
 };
 
+/**
+ * @brief Flags for ML2_Map_mapFile
+ */
+enum ML2_Map_MapFlags {
+	ML2_MAP_READONLY = 0, ///< Map the file read-only, sharing pages with every other process using it (default behavior)
+	ML2_MAP_COPYONWRITE = 1 ///< Map the file privately so tiles can be edited without touching the file
+};
+
+/**
+ * @brief Flags stored in the header of a map file (revision 3 and later)
+ */
+enum ML2_Map_HeaderFlags {
+	ML2_MAP_CHUNKED = 1, ///< Tile data is split into individually compressed chunks
+	ML2_MAP_COMPRESSED = 2, ///< Tile data is compressed as a whole (ignored for chunked maps)
+	ML2_MAP_RAW_SHEET = 4, ///< Embedded tilesheet is stored as raw RGBA pixels instead of a bitmap
+	ML2_MAP_WIDE_TILES = 8, ///< Tiles are 16 bits wide instead of 8, allowing up to ML2_MAP_MAX_WIDE_TILES types of tiles
+	ML2_MAP_WRAP_X = 16 ///< The map wraps around horizontally, so its left edge joins onto its right edge for rendering and collision
+};
+
+/**
+ * @brief Number of types of tiles a map can address with 8-bit tiles
+ */
+#define ML2_MAP_MAX_TILES 64
+
+/**
+ * @brief Number of types of tiles a map can address with 16-bit tiles (see ML2_MAP_WIDE_TILES)
+ */
+#define ML2_MAP_MAX_WIDE_TILES 16384
+
 /**
  * @brief Map data
  */
@@ -32,13 +61,85 @@ typedef struct {
 	Uint32 start_y; ///< y coordinate for player's starting position
 	Uint32 start_fuel; ///< Amount of fuel the player will start with
 	SDL_Color bgcolor; ///< Background color
-	TileSheet *tiles; ///< Loaded tilesheet for the map
+	TileSheet *tiles; ///< Loaded tilesheet for the map (shared with other maps using the same sheet)
 	Uint8 tilesheet_enum; ///< Used when saving maps
-	Uint8 data[]; ///< Tile data
+	Uint32 flags; ///< Flags from the map header (values from the ML2_Map_HeaderFlags enum)
+	Uint8 *data; ///< Tile data, 1 byte per tile or 2 with ML2_MAP_WIDE_TILES (NULL for chunked maps)
+	struct ML2_ChunkCache *chunks; ///< Tile data for chunked maps, otherwise NULL
+	void *mapping; ///< Start of the mapped map file if the map was loaded with ML2_Map_mapFile, or of the tile data of a large blank map, otherwise NULL
+	size_t mapping_size; ///< Size of the mapping
+	SDL_bool readonly; ///< Whether the tile data is read-only (ML2_Map_setTile does nothing)
+	struct ML2_DistanceField *distance; ///< Distance field of the map (see ML2_Map_createDistanceField), otherwise NULL
+	Uint32 generation; ///< Incremented every time ML2_Map_setTile changes a tile, so anything worked out from the tiles can tell when it is out of date
+	Uint32 *heights; ///< Height of the terrain in every column of tiles, then every column of pixels (see ML2_Map_createHeightmap), otherwise NULL
+	struct ML2_MapGeometry *geometry; ///< Vertices reused every time the map is rendered, NULL until it is first rendered
 } ML2_Map;
 
+/**
+ * @brief Information from the header of a map file, see ML2_Map_probe
+ */
+typedef struct {
+	Uint32 rev; ///< Revision of the spec that this map conforms to
+	Uint32 width; ///< Width of the map
+	Uint32 height; ///< Height of the map
+	Uint32 start_x; ///< x coordinate for player's starting position
+	Uint32 start_y; ///< y coordinate for player's starting position
+	Uint32 start_fuel; ///< Amount of fuel the player will start with
+	SDL_Color bgcolor; ///< Background color
+	Uint8 tilesheet_enum; ///< Built-in tilesheet used by the map, or TILESHEET_CUSTOM if it is embedded
+	Uint32 flags; ///< Flags from the map header (values from the ML2_Map_HeaderFlags enum)
+} ML2_MapInfo;
+
+/**
+ * @brief Where a mask moving across the map first touched it, see ML2_Map_sweepMask
+ */
+typedef struct {
+	float time; ///< Fraction of the movement made before touching the map (1 if nothing was hit)
+	float x; ///< x-coordinate of the furthest position along the movement where the mask is clear of the map
+	float y; ///< y-coordinate of the furthest position along the movement where the mask is clear of the map
+	int normal_x; ///< Which way the surface that was hit faces along the x-axis (-1, 0 or 1)
+	int normal_y; ///< Which way the surface that was hit faces along the y-axis (-1, 0 or 1)
+} ML2_Map_Sweep;
+
+/**
+ * @brief Rectangles stored as one array per field, for checking many at once with ML2_Map_doCollisionBatch
+ */
+typedef struct {
+	const int *x; ///< x-coordinates of the rectangles
+	const int *y; ///< y-coordinates of the rectangles
+	const int *w; ///< Widths of the rectangles
+	const int *h; ///< Heights of the rectangles
+} ML2_Map_RectArrays;
+
+/**
+ * @brief The first solid pixel along a ray, see ML2_Map_raycast
+ */
+typedef struct {
+	SDL_bool hit; ///< Whether the ray hit anything before reaching its maximum distance
+	float distance; ///< Distance from the start of the ray to where it entered the pixel (in pixels)
+	int x; ///< x-coordinate of the pixel that was hit
+	int y; ///< y-coordinate of the pixel that was hit
+	int normal_x; ///< Which way the side of the pixel the ray entered through faces along the x-axis (-1, 0 or 1)
+	int normal_y; ///< Which way the side of the pixel the ray entered through faces along the y-axis (-1, 0 or 1)
+} ML2_Map_RayHit;
+
+/**
+ * @brief Rays stored as one array per field, for casting many at once with ML2_Map_raycastBatch
+ */
+typedef struct {
+	const float *x; ///< x-coordinates of the starts of the rays
+	const float *y; ///< y-coordinates of the starts of the rays
+	const float *dir_x; ///< x-components of the directions of the rays
+	const float *dir_y; ///< y-components of the directions of the rays
+} ML2_Map_RayArrays;
+
 /**
  * @brief Create an empty map
+ * @details If ML2_MAP_CHUNKED is set in the flags, the map is stored in chunks,
+ * and no memory is used for chunks that have never been touched.
+ * Otherwise, large maps get zeroed memory straight from the OS, which is only committed once tiles are set,
+ * so creating a blank map takes the same amount of time regardless of its size.
+ * If ML2_MAP_WIDE_TILES is set, each tile takes 2 bytes so more types of tiles can be used.
  *
  * @param params ML2_Map struct to use as a template
  * @param renderer Renderer to associate the loaded tilesheet with
@@ -48,7 +149,10 @@ ML2_Map *ML2_Map_create(ML2_Map params, SDL_Renderer *renderer);
 
 /**
  * @brief Load the contents of a map from RWops into memory so it can be used in-game.
- * @details If there is an error or the loaded map is invalid, the SDL error state
+ * @details Unless src reads from memory, it is read through a buffer (see ML2_BufferedRW_create),
+ * so it doesn't need to be able to seek, and maps can be streamed from pipes.
+ * If src can't seek and isn't freed, anything after the map that was read into the buffer is lost.
+ * If there is an error or the loaded map is invalid, the SDL error state
  * will be set and a null pointer will be returned. 
  * 
  * @param src RWops to load the map data from
@@ -74,19 +178,103 @@ ML2_Map *ML2_Map_loadFromMem(void *src, int size, SDL_Renderer *renderer);
 
 /**
  * @brief Load the contents of a map file into memory so it can be used in-game.
- * @details If there is an error or the loaded map is invalid, the SDL error state
+ * @details The file may be a pipe, and a path of "-" reads the map from stdin.
+ * If there is an error or the loaded map is invalid, the SDL error state
  * will be set and a null pointer will be returned.
  * 
- * @param path Path to the map file
+ * @param path Path to the map file, or "-" for stdin
  * @param renderer Renderer to associate the loaded tilesheet with
  * @return The newly created map object
  */
 ML2_Map *ML2_Map_loadFromFile(const char *path, SDL_Renderer *renderer);
 
 /**
- * @brief Save the contents of a map to disk
+ * @brief Read the header of a map file without loading the map.
+ * @details Only the fixed part of the header is read, so the tilesheet is not decoded,
+ * no renderer is needed and nothing is allocated. Revision 1 maps get the same defaults
+ * as they would when loaded.
+ * If there is an error or the map is invalid, the SDL error state will be set.
+ *
+ * @param path Path to the map file
+ * @param info Filled with the information from the header
+ * @return Whether the header was read successfully
+ */
+SDL_bool ML2_Map_probe(const char *path, ML2_MapInfo *info);
+
+/**
+ * @brief Map a map file into memory, pointing the tile data directly at the mapped file.
+ * @details Nothing but the header is copied, so loading takes the same amount of time regardless
+ * of the size of the map, and pages are only read from disk once they are touched.
+ * With ML2_MAP_READONLY, ML2_Map_setTile has no effect and every process that maps the
+ * same file shares the same pages. ML2_MAP_COPYONWRITE lets tiles be modified (for the editor),
+ * copying only the pages that are written to.
+ * On platforms without mmap, and for pipes and stdin (a path of "-"), this falls back to ML2_Map_loadFromFile.
+ * If there is an error or the loaded map is invalid, the SDL error state
+ * will be set and a null pointer will be returned.
+ *
+ * @param path Path to the map file
+ * @param renderer Renderer to associate the loaded tilesheet with
+ * @param flags Values from the ML2_Map_MapFlags enum
+ * @return The newly created map object
+ */
+ML2_Map *ML2_Map_mapFile(const char *path, SDL_Renderer *renderer, int flags);
+
+/**
+ * @brief Opaque handle for a map that is being loaded in the background.
+ */
+typedef struct ML2_MapLoader ML2_MapLoader;
+
+/**
+ * @brief Start loading a map file on a worker thread.
+ * @details The file is read, decompressed and its tilesheet is decoded on the worker thread,
+ * the same way ML2_Map_mapFile would. Textures can only be created on the render thread,
+ * so that is left for ML2_Map_finish.
+ * If the thread can't be started, the SDL error state will be set and a null pointer will be returned.
+ *
+ * @param path Path to the map file
+ * @param flags Values from the ML2_Map_MapFlags enum
+ * @return Handle to the load in progress
+ */
+ML2_MapLoader *ML2_Map_loadAsync(const char *path, int flags);
+
+/**
+ * @brief Check whether a map being loaded in the background is ready to be finished.
+ * @details This never blocks, so it can be called every frame.
+ *
+ * @param loader The load in progress
+ * @return Whether ML2_Map_finish will return without waiting
+ */
+SDL_bool ML2_Map_poll(ML2_MapLoader *loader);
+
+/**
+ * @brief Finish loading a map in the background, creating its textures.
+ * @details This must be called on the render thread. If the worker thread is still running,
+ * this waits for it. The loader is freed, whether or not loading succeeded.
+ * If there is an error or the loaded map is invalid, the SDL error state
+ * will be set and a null pointer will be returned.
+ *
+ * @param loader The load in progress
+ * @param renderer Renderer to associate the loaded tilesheet with
+ * @return The newly created map object
+ */
+ML2_Map *ML2_Map_finish(ML2_MapLoader *loader, SDL_Renderer *renderer);
+
+/**
+ * @brief Serialize a map into a block of memory, with the same contents as a saved map file.
  * @details This will set the SDL error message if it fails
  *
+ * @param map Map to serialize
+ * @param size Filled with the size of the serialized map
+ * @return The serialized map, which must be freed with SDL_free, or NULL on failure
+ */
+void *ML2_Map_serializeToMem(ML2_Map *map, size_t *size);
+
+/**
+ * @brief Save the contents of a map to disk
+ * @details The map is written to a temporary file in a single write, which then replaces
+ * the file at path. If saving fails partway through, the original file is left intact.
+ * This will set the SDL error message if it fails
+ *
  * @param map Map to save
  * @param path File path to save to
  * @return Whether the map was saved successfully
@@ -95,6 +283,7 @@ SDL_bool ML2_Map_save(ML2_Map *map, const char *path);
 
 /**
  * @brief Frees all resources associated with a map.
+ * @details The tilesheet is only freed if no other map is using it.
  * 
  * @param map The map to free
  */
@@ -124,9 +313,11 @@ int ML2_Map_getTile(ML2_Map *map, Uint32 x, Uint32 y, int *flip);
  * @param map The map to set the tile on
  * @param x x-coordinate of the tile
  * @param y y-coordinate of the tile
- * @param tile The type of tile to set the tile to
+ * @param tile The type of tile to set the tile to (less than ML2_MAP_MAX_TILES, or ML2_MAP_MAX_WIDE_TILES for maps with ML2_MAP_WIDE_TILES)
  * @param flip The direction the tile should be flipped in.
  * This should be an SDL_RendererFlip value.
+ * If the map has a distance field or a heightmap, they are updated around the tile.
+ * The generation of the map is incremented, unless the map is read-only or the coordinates are out of bounds.
  */
 void ML2_Map_setTile(ML2_Map *map, Uint32 x, Uint32 y, int tile, int flip);
 
@@ -134,6 +325,9 @@ void ML2_Map_setTile(ML2_Map *map, Uint32 x, Uint32 y, int tile, int flip);
 
 /**
  * @brief Returns whether the rectangle is currently colliding with a tile and the direction it is colliding in.
+ * @details Every tile the rectangle covers is checked, a row at a time from the bottom,
+ * so rectangles of any size can be used. On maps with ML2_MAP_WRAP_X, rectangles past the left
+ * or right edge of the map collide with the tiles on the other side.
  * 
  * @param map The map object to check collision on
  * @param r An AABB of the collision object
@@ -142,8 +336,178 @@ void ML2_Map_setTile(ML2_Map *map, Uint32 x, Uint32 y, int tile, int flip);
  */
 int ML2_Map_doCollision(ML2_Map *map, const SDL_Rect *r, const SDL_Rect *r_old);
 
+/**
+ * @brief Check many rectangles for collision at once, as if ML2_Map_doCollision was called on each of them.
+ * @details This is a threaded scalar batch: each rectangle gets the same check as ML2_Map_doCollision,
+ * and the rectangles are split between threads, which are started for this call and finished
+ * before it returns, so it is only worth using several for thousands of rectangles.
+ * Chunked maps are always checked on the calling thread, since their chunks are decompressed
+ * as they are needed.
+ * 
+ * @param map The map object to check collision on
+ * @param rects AABBs of the collision objects
+ * @param rects_old AABBs of the collision objects at their old positions (may be NULL, like r_old)
+ * @param results Where to write the collision status of each rectangle (ML2_Map_CollisionAxis flags)
+ * @param count Number of rectangles
+ * @param threads Number of threads to use, or 0 to use one for every CPU core
+ */
+void ML2_Map_doCollisionBatch(
+	ML2_Map *map,
+	const ML2_Map_RectArrays *rects,
+	const ML2_Map_RectArrays *rects_old,
+	Uint8 *results,
+	int count,
+	int threads
+);
+
+/**
+ * @brief Check whether a bitmask overlaps any solid pixel of the map.
+ * @details This is for pixel-perfect collision with sprites, such as a rotated lander.
+ * It is tested against the collision masks of the tiles (see TileSheet_getMask),
+ * a row at a time, so it costs about the same as ML2_Map_doCollision.
+ * 
+ * @param map The map object to check collision on
+ * @param x x-coordinate of the bottom left corner of the mask (in pixels)
+ * @param y y-coordinate of the bottom left corner of the mask (in pixels)
+ * @param mask One word per row, starting from the bottom. Bit n of a row is set if the pixel
+ * n pixels from the left is solid, so the mask can be at most 32 pixels wide.
+ * @param height Number of rows in the mask
+ * @return Whether any solid pixel of the mask overlaps a solid pixel of the map
+ */
+SDL_bool ML2_Map_doMaskCollision(ML2_Map *map, int x, int y, const Uint32 *mask, int height);
+
+/**
+ * @brief Move a bitmask across the map, stopping at the first solid pixel it touches.
+ * @details Every pixel position the bottom left corner of the mask passes through is checked,
+ * in order, so the mask can't pass through anything no matter how far it moves.
+ * A rectangle up to 32 pixels wide can be swept by giving a mask with every bit of its width set.
+ * 
+ * If the mask is already touching the map where it starts, the time is 0 and both normals are 0.
+ * Otherwise the normal points back against the movement on the axis of the pixel boundary that was crossed
+ * when the map was hit, so a landing on the ground has a normal_y of 1.
+ * 
+ * @param map The map object to check collision on
+ * @param x x-coordinate of the bottom left corner of the mask at the start of the movement (in pixels)
+ * @param y y-coordinate of the bottom left corner of the mask at the start of the movement (in pixels)
+ * @param dx Distance to move along the x-axis (in pixels)
+ * @param dy Distance to move along the y-axis (in pixels)
+ * @param mask The mask to move, see ML2_Map_doMaskCollision
+ * @param height Number of rows in the mask
+ * @param sweep Where to put the time of impact, the position the mask can move to, and the normal of the surface that was hit
+ * @return Whether the mask hit the map
+ */
+SDL_bool ML2_Map_sweepMask(ML2_Map *map, float x, float y, float dx, float dy, const Uint32 *mask, int height, ML2_Map_Sweep *sweep);
+
+/**
+ * @brief Find the first solid pixel of the map along a ray.
+ * @details The ray walks the map a tile at a time, skipping empty tiles and stopping at the edge
+ * of a fully solid one. Partially solid tiles are walked a pixel at a time through their collision mask
+ * (see TileSheet_getMask), so the pixel that is hit is exact. Nothing above or below the map is solid,
+ * and neither is anything left or right of it unless the map has ML2_MAP_WRAP_X. Then the ray carries on
+ * through the other side, and the pixel that is hit is given as if the map repeated forever.
+ * If the ray starts inside a solid pixel, that pixel is hit at a distance of 0 and both normals are 0.
+ * 
+ * @param map The map object to cast the ray on
+ * @param x x-coordinate of the start of the ray (in pixels)
+ * @param y y-coordinate of the start of the ray (in pixels)
+ * @param dir_x x-component of the direction of the ray (it doesn't need to be normalized)
+ * @param dir_y y-component of the direction of the ray
+ * @param max_distance How far to follow the ray (in pixels)
+ * @param hit Where to put the pixel that was hit (may be NULL)
+ * @return Whether anything was hit
+ */
+SDL_bool ML2_Map_raycast(ML2_Map *map, float x, float y, float dir_x, float dir_y, float max_distance, ML2_Map_RayHit *hit);
+
+/**
+ * @brief Cast many rays at once, as if ML2_Map_raycast was called on each of them.
+ * @details This saves the per-call overhead of ML2_Map_raycast, for things like sensors that cast hundreds of rays each frame.
+ * 
+ * @param map The map object to cast the rays on
+ * @param rays The rays to cast
+ * @param max_distance How far to follow each ray (in pixels)
+ * @param hits Where to put the result of each ray
+ * @param count Number of rays
+ */
+void ML2_Map_raycastBatch(ML2_Map *map, const ML2_Map_RayArrays *rays, float max_distance, ML2_Map_RayHit *hits, int count);
+
+/**
+ * @brief Check whether there is a clear line between two points on the map.
+ * 
+ * @param map The map object to check on
+ * @param x0 x-coordinate of the first point (in pixels)
+ * @param y0 y-coordinate of the first point (in pixels)
+ * @param x1 x-coordinate of the second point (in pixels)
+ * @param y1 y-coordinate of the second point (in pixels)
+ * @return Whether no solid pixel is in the way
+ */
+SDL_bool ML2_Map_lineOfSight(ML2_Map *map, float x0, float y0, float x1, float y1);
+
+/**
+ * @brief Build a signed distance field for the map, so how far away the nearest terrain is can be looked up directly.
+ * @details The field is built from the collision masks of the tiles (see TileSheet_getMask),
+ * and is kept up to date by ML2_Map_setTile. Any existing field is replaced.
+ * If there is an error, the SDL error state will be set and the existing field is kept.
+ * 
+ * @param map The map to build the distance field for
+ * @param cell_size Width and height of each cell of the field in pixels
+ * (a power of two that divides the tile width and height, 1 for a field that is exact to the pixel)
+ * @param max_distance Largest distance stored (in pixels), anything further away is clamped to this.
+ * Smaller distances make ML2_Map_setTile cheaper.
+ * @param threads Number of threads to build the field with, or 0 to use one for every CPU core
+ * @return Whether the field was built successfully
+ */
+SDL_bool ML2_Map_createDistanceField(ML2_Map *map, int cell_size, float max_distance, int threads);
+
+/**
+ * @brief Get how far a pixel is from the nearest terrain, using the map's distance field.
+ * @details The map must have a distance field (see ML2_Map_createDistanceField).
+ * The distance is accurate to the size of a cell, and pixels outside of the map use the nearest cell on its edge.
+ * 
+ * @param map The map to look on
+ * @param x x-coordinate of the pixel
+ * @param y y-coordinate of the pixel
+ * @return The distance to the nearest solid pixel, or negative for the distance to the nearest empty one
+ */
+float ML2_Map_getDistance(const ML2_Map *map, int x, int y);
+
+/**
+ * @brief Build an index of how high the terrain is in every column of the map, for altitude and landing checks.
+ * @details Each column is scanned from the top down to the first solid tile or pixel (see TileSheet_getMask),
+ * so this is quick for maps that are mostly sky. The index is kept up to date by ML2_Map_setTile.
+ * If there is an error, the SDL error state will be set. Any existing index is kept either way.
+ * 
+ * @param map The map to build the index for
+ * @return Whether the index was built successfully
+ */
+SDL_bool ML2_Map_createHeightmap(ML2_Map *map);
+
+/**
+ * @brief Get the height of the terrain in a column of pixels.
+ * @details The map must have a heightmap (see ML2_Map_createHeightmap).
+ * 
+ * @param map The map to look on
+ * @param x x-coordinate of the column (in pixels)
+ * @return How far above the bottom of the map the highest solid pixel in the column ends (in pixels),
+ * which is where something resting on it would be. Columns with nothing solid and columns outside of the map are 0,
+ * except on maps with ML2_MAP_WRAP_X, where columns outside of the map are the ones they wrap around to.
+ */
+Uint32 ML2_Map_getSurfaceHeight(const ML2_Map *map, int x);
+
+/**
+ * @brief Get the height of the terrain in a column of tiles.
+ * @details The map must have a heightmap (see ML2_Map_createHeightmap).
+ * 
+ * @param map The map to look on
+ * @param x x-coordinate of the column (in tiles)
+ * @return One more than the y-coordinate of the highest tile in the column that isn't empty (in tiles).
+ * Columns with nothing solid and columns outside of the map are 0 (or wrap around, as with ML2_Map_getSurfaceHeight).
+ */
+Uint32 ML2_Map_getSurfaceTile(const ML2_Map *map, int x);
+
 /**
  * @brief Render map onto renderer with a given tileset and camera position.
+ * @details On maps with ML2_MAP_WRAP_X, the camera can be past the left or right edge of the map,
+ * and the other side of the map is drawn there.
  * 
  * @param map The map to render
  * @param renderer The renderer to render on
@@ -153,6 +517,8 @@ void ML2_Map_render(ML2_Map *map, SDL_Renderer *renderer, SDL_Point *camera_pos)
 
 /**
  * @brief Render map onto renderer with a given tileset, camera position, and scale factor.
+ * @details All of the visible tiles are drawn with a single call to SDL_RenderGeometry, using vertices kept in the map
+ * between frames. If SDL is older than 2.0.18 or the renderer can't draw geometry, they are copied one by one instead.
  * 
  * @param map The map to render
  * @param renderer The renderer to render on
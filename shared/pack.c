@@ -0,0 +1,347 @@
+/**
+ * @file
+ * @brief Map packs, which store many maps in a single file.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+// Required for mmap, since the project is built with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <SDL.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ML2_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "tilesheet.h"
+#include "map.h"
+#include "pack.h"
+#include "atomicfile.h"
+
+// Correct signature is the string "ML2P"
+#define CORRECT_SIG "ML2P"
+#define CURRENT_REV 1
+
+#define HEADER_SIZE 16
+#define ENTRY_SIZE 72
+#define SHEET_ENTRY_SIZE 16
+#define NO_SHEET 0xFFFFFFFF
+
+/* Embedded sheets (bitmap or raw) in a map saved with the current revision start
+ * after the 37 byte header and the 8 byte tile size (see map_file_spec.md). */
+#define MAP_SHEET_OFFSET 45
+
+typedef struct {
+	char name[ML2_PACK_MAX_NAME + 1];
+	const Uint8 *map; // map file with its embedded sheet (if any) cut out
+	size_t map_size;
+	const Uint8 *sheet; // the cut out sheet, NULL if the map uses a built-in one
+	size_t sheet_size;
+	size_t sheet_at; // where the sheet goes back in
+} PackEntry;
+
+struct ML2_Pack {
+	Uint8 *data;
+	size_t size;
+	SDL_bool mapped;
+	int count;
+	PackEntry entries[];
+};
+
+static Uint32 read_le32(const Uint8 *p) {
+	return (Uint32) p[0] | (Uint32) p[1] << 8 | (Uint32) p[2] << 16 | (Uint32) p[3] << 24;
+}
+
+static Uint64 read_le64(const Uint8 *p) {
+	Uint64 value = 0;
+	for (int i = 7; i >= 0; --i) value = value << 8 | p[i];
+	return value;
+}
+
+static void write_le32(Uint8 *p, Uint32 value) {
+	for (int i = 0; i < 4; ++i) p[i] = value >> (8 * i);
+}
+
+static void write_le64(Uint8 *p, Uint64 value) {
+	for (int i = 0; i < 8; ++i) p[i] = value >> (8 * i);
+}
+
+// Whether a block of size bytes at offset fits within the pack.
+static SDL_bool in_bounds(Uint64 offset, Uint64 size, size_t pack_size) {
+	return offset <= pack_size && size <= pack_size - offset;
+}
+
+static void *read_pack(const char *path, size_t *size, SDL_bool *mapped) {
+#ifdef ML2_HAVE_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		void *mapping = fstat(fd, &st) == 0 && st.st_size > 0 ?
+			mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (mapping != MAP_FAILED) {
+			*size = st.st_size;
+			*mapped = SDL_TRUE;
+			return mapping;
+		}
+	}
+#endif
+	*mapped = SDL_FALSE;
+	return SDL_LoadFile(path, size);
+}
+
+static void free_pack_data(void *data, size_t size, SDL_bool mapped) {
+#ifdef ML2_HAVE_MMAP
+	if (mapped) {
+		munmap(data, size);
+		return;
+	}
+#endif
+	(void) size;
+	(void) mapped;
+	SDL_free(data);
+}
+
+ML2_Pack *ML2_Pack_open(const char *path) {
+	size_t size;
+	SDL_bool mapped;
+	Uint8 *data = read_pack(path, &size, &mapped);
+	if (!data) {
+		SDL_SetError("Failed to open map pack %s", path);
+		return NULL;
+	}
+
+	Uint32 count = size >= HEADER_SIZE ? read_le32(data + 8) : 0;
+	Uint32 sheet_count = size >= HEADER_SIZE ? read_le32(data + 12) : 0;
+	if (
+		size < HEADER_SIZE ||
+		SDL_memcmp(data, CORRECT_SIG, 4) != 0 ||
+		read_le32(data + 4) != CURRENT_REV ||
+		count > SDL_MAX_SINT32 ||
+		!in_bounds(HEADER_SIZE, (Uint64) count * ENTRY_SIZE + (Uint64) sheet_count * SHEET_ENTRY_SIZE, size)
+	) {
+		free_pack_data(data, size, mapped);
+		SDL_SetError("Failed to open map pack %s: it is an invalid pack.", path);
+		return NULL;
+	}
+
+	ML2_Pack *pack = SDL_malloc(sizeof(ML2_Pack) + count * sizeof(PackEntry));
+	if (!pack) {
+		free_pack_data(data, size, mapped);
+		SDL_SetError("Failed to open map pack %s: not enough memory.", path);
+		return NULL;
+	}
+	*pack = (ML2_Pack) {.data = data, .size = size, .mapped = mapped, .count = count};
+
+	const Uint8 *sheets = data + HEADER_SIZE + count * ENTRY_SIZE;
+	for (Uint32 i = 0; i < count; ++i) {
+		const Uint8 *entry = data + HEADER_SIZE + i * ENTRY_SIZE;
+		Uint64 offset = read_le64(entry + 48);
+		Uint64 map_size = read_le64(entry + 56);
+		Uint32 sheet = read_le32(entry + 64);
+		Uint32 sheet_at = read_le32(entry + 68);
+		if (
+			entry[ML2_PACK_MAX_NAME] != '\0' ||
+			!in_bounds(offset, map_size, size) ||
+			(sheet != NO_SHEET && (sheet >= sheet_count || sheet_at > map_size))
+		) goto invalid;
+
+		PackEntry *e = &pack->entries[i];
+		SDL_memcpy(e->name, entry, sizeof(e->name));
+		e->map = data + offset;
+		e->map_size = map_size;
+		e->sheet = NULL;
+		e->sheet_size = 0;
+		e->sheet_at = sheet_at;
+		if (sheet != NO_SHEET) {
+			Uint64 sheet_offset = read_le64(sheets + sheet * SHEET_ENTRY_SIZE);
+			Uint64 sheet_size = read_le64(sheets + sheet * SHEET_ENTRY_SIZE + 8);
+			if (!in_bounds(sheet_offset, sheet_size, size)) goto invalid;
+			e->sheet = data + sheet_offset;
+			e->sheet_size = sheet_size;
+		}
+	}
+	return pack;
+
+	invalid:
+	ML2_Pack_close(pack);
+	SDL_SetError("Failed to open map pack %s: it is an invalid pack.", path);
+	return NULL;
+}
+
+void ML2_Pack_close(ML2_Pack *pack) {
+	if (!pack) return;
+	free_pack_data(pack->data, pack->size, pack->mapped);
+	SDL_free(pack);
+}
+
+int ML2_Pack_getMapCount(ML2_Pack *pack) {
+	return pack->count;
+}
+
+const char *ML2_Pack_getMapName(ML2_Pack *pack, int index) {
+	return index >= 0 && index < pack->count ? pack->entries[index].name : NULL;
+}
+
+ML2_Map *ML2_Pack_loadMap(ML2_Pack *pack, const char *name, SDL_Renderer *renderer) {
+	const PackEntry *e = NULL;
+	for (int i = 0; i < pack->count && !e; ++i) {
+		if (SDL_strcmp(pack->entries[i].name, name) == 0) e = &pack->entries[i];
+	}
+	if (!e) {
+		SDL_SetError("Map pack does not contain a map named %s", name);
+		return NULL;
+	}
+
+	size_t total = e->map_size + e->sheet_size;
+	if (total > SDL_MAX_SINT32) {
+		SDL_SetError("Failed to load map %s from pack: it is too large.", name);
+		return NULL;
+	}
+
+	// Maps with a built-in tilesheet are loaded straight out of the pack, the loader only reads from it.
+	if (!e->sheet) return ML2_Map_loadFromMem((void *) e->map, (int) e->map_size, renderer);
+
+	// Otherwise the shared sheet has to be put back where it was cut out.
+	Uint8 *map_file = SDL_malloc(total);
+	if (!map_file) {
+		SDL_SetError("Failed to load map %s from pack: not enough memory.", name);
+		return NULL;
+	}
+	SDL_memcpy(map_file, e->map, e->sheet_at);
+	SDL_memcpy(map_file + e->sheet_at, e->sheet, e->sheet_size);
+	SDL_memcpy(map_file + e->sheet_at + e->sheet_size, e->map + e->sheet_at, e->map_size - e->sheet_at);
+	ML2_Map *map = ML2_Map_loadFromMem(map_file, (int) total, renderer);
+	SDL_free(map_file);
+	return map;
+}
+
+SDL_bool ML2_Pack_save(const char *path, int count, const char *const *names, ML2_Map *const *maps) {
+	SDL_bool success = SDL_FALSE;
+	Uint8 *out = NULL;
+	Uint8 **files = SDL_calloc(count ? count : 1, sizeof(Uint8 *));
+	PackEntry *entries = SDL_calloc(count ? count : 1, sizeof(PackEntry));
+	int *sheet_index = SDL_calloc(count ? count : 1, sizeof(int));
+	if (!files || !entries || !sheet_index) {
+		SDL_SetError("Not enough memory.");
+		goto done;
+	}
+
+	// Serialize every map, and cut out the embedded sheets, keeping only the first copy of each.
+	int sheet_count = 0;
+	size_t total = HEADER_SIZE + (size_t) count * ENTRY_SIZE;
+	for (int i = 0; i < count; ++i) {
+		if (SDL_strlen(names[i]) > ML2_PACK_MAX_NAME) {
+			SDL_SetError("Map name %s is too long.", names[i]);
+			goto done;
+		}
+		for (int j = 0; j < i; ++j) {
+			if (SDL_strcmp(names[i], names[j]) == 0) {
+				SDL_SetError("Map name %s is used more than once.", names[i]);
+				goto done;
+			}
+		}
+
+		size_t size;
+		files[i] = ML2_Map_serializeToMem(maps[i], &size);
+		if (!files[i]) goto done;
+
+		PackEntry *e = &entries[i];
+		SDL_strlcpy(e->name, names[i], sizeof(e->name));
+		e->map = files[i];
+		e->map_size = size;
+		sheet_index[i] = -1;
+		if (maps[i]->tilesheet_enum) {
+			total += size;
+			continue;
+		}
+
+		// The size of a bitmap is in its file header, raw sheets start with their dimensions.
+		e->sheet = files[i] + MAP_SHEET_OFFSET;
+		e->sheet_at = MAP_SHEET_OFFSET;
+		if (size < MAP_SHEET_OFFSET + 8) {
+			e->sheet_size = 0;
+		} else if (maps[i]->flags & ML2_MAP_RAW_SHEET) {
+			e->sheet_size = 8 + (size_t) read_le32(e->sheet) * read_le32(e->sheet + 4) * 4;
+		} else {
+			e->sheet_size = read_le32(e->sheet + 2);
+		}
+		if (e->sheet_size < 8 || e->sheet_size > size - MAP_SHEET_OFFSET) {
+			SDL_SetError("Map %s has an invalid tilesheet.", names[i]);
+			goto done;
+		}
+		e->map_size = size - e->sheet_size;
+		total += e->map_size;
+
+		for (int j = 0; j < i && sheet_index[i] < 0; ++j) {
+			if (
+				sheet_index[j] >= 0 && entries[j].sheet_size == e->sheet_size &&
+				SDL_memcmp(entries[j].sheet, e->sheet, e->sheet_size) == 0
+			) sheet_index[i] = sheet_index[j];
+		}
+		if (sheet_index[i] < 0) {
+			sheet_index[i] = sheet_count++;
+			total += e->sheet_size;
+		}
+	}
+	total += (size_t) sheet_count * SHEET_ENTRY_SIZE;
+
+	/* Layout: header, table of contents, sheet table, sheets, maps.
+	 * It is all built in memory so it can be written in one go. */
+	out = SDL_calloc(1, total);
+	if (!out) {
+		SDL_SetError("Not enough memory.");
+		goto done;
+	}
+	SDL_memcpy(out, CORRECT_SIG, 4);
+	write_le32(out + 4, CURRENT_REV);
+	write_le32(out + 8, count);
+	write_le32(out + 12, sheet_count);
+
+	Uint8 *sheet_table = out + HEADER_SIZE + (size_t) count * ENTRY_SIZE;
+	size_t pos = HEADER_SIZE + (size_t) count * ENTRY_SIZE + (size_t) sheet_count * SHEET_ENTRY_SIZE;
+	for (int i = 0, next_sheet = 0; i < count; ++i) {
+		if (sheet_index[i] != next_sheet) continue; // not the first use of this sheet
+		Uint8 *sheet_entry = sheet_table + (size_t) next_sheet++ * SHEET_ENTRY_SIZE;
+		write_le64(sheet_entry, pos);
+		write_le64(sheet_entry + 8, entries[i].sheet_size);
+		SDL_memcpy(out + pos, entries[i].sheet, entries[i].sheet_size);
+		pos += entries[i].sheet_size;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		const PackEntry *e = &entries[i];
+		Uint8 *entry = out + HEADER_SIZE + (size_t) i * ENTRY_SIZE;
+		SDL_memcpy(entry, e->name, sizeof(e->name));
+		write_le64(entry + 48, pos);
+		write_le64(entry + 56, e->map_size);
+		write_le32(entry + 64, sheet_index[i] < 0 ? NO_SHEET : (Uint32) sheet_index[i]);
+		write_le32(entry + 68, e->sheet_at);
+
+		SDL_memcpy(out + pos, e->map, e->sheet_at);
+		SDL_memcpy(out + pos + e->sheet_at, e->map + e->sheet_at + e->sheet_size, e->map_size - e->sheet_at);
+		pos += e->map_size;
+	}
+
+	// Replaced rather than overwritten, so a crash can't truncate the pack, and readers that have it mapped are unaffected.
+	success = ML2_AtomicFile_write(path, out, total);
+
+	done:
+	if (!success) {
+		char *error = SDL_strdup(SDL_GetError());
+		SDL_SetError("Failed to save map pack %s: %s", path, error);
+		SDL_free(error);
+	}
+	for (int i = 0; files && i < count; ++i) SDL_free(files[i]);
+	SDL_free(files);
+	SDL_free(entries);
+	SDL_free(sheet_index);
+	SDL_free(out);
+	return success;
+}
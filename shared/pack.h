@@ -0,0 +1,98 @@
+/**
+ * @file
+ * @brief Map packs, which store many maps in a single file.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_PACK_H
+#define MOONLANDER_PACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Longest name a map in a pack can have (not counting the null terminator)
+ */
+#define ML2_PACK_MAX_NAME 47
+
+/**
+ * @brief Opaque map pack type.
+ * @details The pack file is mapped into memory when it is opened (or read in
+ * whole on platforms without mmap), and maps are loaded straight out of it.
+ */
+typedef struct ML2_Pack ML2_Pack;
+
+/**
+ * @brief Open a map pack.
+ * @details Only the table of contents is checked, maps are not loaded until they are asked for.
+ * If there is an error or the pack is invalid, the SDL error state
+ * will be set and a null pointer will be returned.
+ *
+ * @param path Path to the pack file
+ * @return The opened pack
+ */
+ML2_Pack *ML2_Pack_open(const char *path);
+
+/**
+ * @brief Close a map pack.
+ * @details Maps loaded from the pack have their own copy of everything they need,
+ * so they may outlive it.
+ *
+ * @param pack The pack to close
+ */
+void ML2_Pack_close(ML2_Pack *pack);
+
+/**
+ * @brief Get the number of maps in a pack.
+ *
+ * @param pack The pack
+ * @return The number of maps
+ */
+int ML2_Pack_getMapCount(ML2_Pack *pack);
+
+/**
+ * @brief Get the name of a map in a pack.
+ *
+ * @param pack The pack
+ * @param index Index of the map, in the order they were packed
+ * @return The name of the map, or NULL if the index is out of range
+ */
+const char *ML2_Pack_getMapName(ML2_Pack *pack, int index);
+
+/**
+ * @brief Load a map from a pack by name.
+ * @details Maps sharing a tilesheet share the same copy in the pack, and the loaded
+ * tilesheet is shared as well (see TileSheet_createSharedFromMem), so it is only decoded once.
+ * If there is an error or the map is not in the pack, the SDL error state
+ * will be set and a null pointer will be returned.
+ *
+ * @param pack The pack to load from
+ * @param name Name of the map
+ * @param renderer Renderer to associate the loaded tilesheet with
+ * @return The newly created map object
+ */
+ML2_Map *ML2_Pack_loadMap(ML2_Pack *pack, const char *name, SDL_Renderer *renderer);
+
+/**
+ * @brief Write a set of maps to a pack file.
+ * @details Identical embedded tilesheets are only stored once.
+ * An existing pack is replaced all at once (see ML2_AtomicFile_write), so a crash can't leave it truncated
+ * and packs opened by other programs are unaffected.
+ * This will set the SDL error message if it fails
+ *
+ * @param path Path to write the pack to
+ * @param count Number of maps
+ * @param names Name of each map (at most ML2_PACK_MAX_NAME characters, must be unique)
+ * @param maps The maps to pack
+ * @return Whether the pack was written successfully
+ */
+SDL_bool ML2_Pack_save(const char *path, int count, const char *const *names, ML2_Map *const *maps);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
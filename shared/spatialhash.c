@@ -0,0 +1,275 @@
+/**
+ * @file
+ * @brief Spatial hash for finding which moving objects (landers, particles, pickups) overlap each other.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+#include "spatialhash.h"
+
+// Fewest buckets a hash is created with
+#define MIN_BUCKETS 64
+
+// One of the tiles covered by an object, linked into the chain of its bucket.
+typedef struct {
+	int cell_x, cell_y;
+	int id;
+	int prev, next; // in the bucket, or -1
+	int next_cell; // next node of the same object, or the free list
+} Node;
+
+typedef struct {
+	SDL_Rect rect;
+	int x0, y0, x1, y1; // tiles covered, inclusive (x1 < x0 if none)
+	int first; // first node, or -1
+	SDL_bool active;
+} Object;
+
+struct ML2_SpatialHash {
+	int tile_width, tile_height;
+	int shift_x, shift_y; // log2 of the tile size, or -1 if it isn't a power of two
+	Uint32 map_width;
+	Object *objects;
+	int capacity, active;
+	Node *nodes;
+	int node_count, node_capacity;
+	int free_node;
+	int *buckets; // first node in each bucket, or -1
+	int bucket_shift; // 32 - log2 of the number of buckets
+};
+
+static int tile_shift(int tile_size) {
+	return tile_size & (tile_size - 1) ? -1 : SDL_MostSignificantBitIndex32(tile_size);
+}
+
+// Rounds towards negative infinity, so objects just off the left or bottom of the map get their own tiles
+SDL_FORCE_INLINE int tile_div(int a, int tile_size, int shift) {
+	if (shift >= 0) return a >= 0 ? a >> shift : ~(~a >> shift);
+	int q = a / tile_size;
+	return q - (q * tile_size > a);
+}
+
+SDL_FORCE_INLINE int bucket_of(const ML2_SpatialHash *hash, int cell_x, int cell_y) {
+	Uint32 key = (Uint32) cell_y * hash->map_width + (Uint32) cell_x;
+	return (int) ((key * 0x9E3779B1u) >> hash->bucket_shift);
+}
+
+// The tiles a rectangle covers, which is none if it is empty.
+static void cell_span(const ML2_SpatialHash *hash, const SDL_Rect *r, int *x0, int *y0, int *x1, int *y1) {
+	if (r->w <= 0 || r->h <= 0) {
+		*x0 = *y0 = 0;
+		*x1 = *y1 = -1;
+		return;
+	}
+	*x0 = tile_div(r->x, hash->tile_width, hash->shift_x);
+	*x1 = tile_div(r->x + r->w - 1, hash->tile_width, hash->shift_x);
+	*y0 = tile_div(r->y, hash->tile_height, hash->shift_y);
+	*y1 = tile_div(r->y + r->h - 1, hash->tile_height, hash->shift_y);
+}
+
+/* Overlapping rectangles share many tiles, but only the tile holding the bottom left corner of
+ * their overlap reports them, so nothing is reported twice. */
+SDL_FORCE_INLINE SDL_bool owns_overlap(const ML2_SpatialHash *hash, const SDL_Rect *a, const SDL_Rect *b, int cell_x, int cell_y) {
+	return
+		tile_div(SDL_max(a->x, b->x), hash->tile_width, hash->shift_x) == cell_x &&
+		tile_div(SDL_max(a->y, b->y), hash->tile_height, hash->shift_y) == cell_y;
+}
+
+ML2_SpatialHash *ML2_SpatialHash_create(const ML2_Map *map, int capacity) {
+	if (capacity <= 0 || capacity > SDL_MAX_SINT32 / 8) {
+		SDL_SetError("Failed to create spatial hash: capacity must be between 1 and %d.", SDL_MAX_SINT32 / 8);
+		return NULL;
+	}
+
+	// Around two buckets per object keeps the chains short.
+	int bucket_bits = SDL_MostSignificantBitIndex32(capacity) + 2;
+	while (bucket_bits < 31 && 1 << bucket_bits < MIN_BUCKETS) ++bucket_bits;
+
+	ML2_SpatialHash *hash = SDL_calloc(1, sizeof(ML2_SpatialHash));
+	if (!hash) goto fail;
+	hash->tile_width = map->tiles->tile_width;
+	hash->tile_height = map->tiles->tile_height;
+	hash->shift_x = tile_shift(hash->tile_width);
+	hash->shift_y = tile_shift(hash->tile_height);
+	hash->map_width = map->width;
+	hash->capacity = capacity;
+	hash->bucket_shift = 32 - bucket_bits;
+	hash->objects = SDL_malloc(sizeof(Object) * capacity);
+	hash->buckets = SDL_malloc(sizeof(int) * ((size_t) 1 << bucket_bits));
+	if (!hash->objects || !hash->buckets) goto fail;
+
+	ML2_SpatialHash_clear(hash);
+	return hash;
+
+fail:
+	ML2_SpatialHash_destroy(hash);
+	SDL_SetError("Failed to create spatial hash: not enough memory.");
+	return NULL;
+}
+
+void ML2_SpatialHash_destroy(ML2_SpatialHash *hash) {
+	if (!hash) return;
+	SDL_free(hash->objects);
+	SDL_free(hash->nodes);
+	SDL_free(hash->buckets);
+	SDL_free(hash);
+}
+
+void ML2_SpatialHash_clear(ML2_SpatialHash *hash) {
+	for (int i = 0; i < hash->capacity; ++i) {
+		hash->objects[i] = (Object) {.x1 = -1, .y1 = -1, .first = -1};
+	}
+	SDL_memset(hash->buckets, 0xFF, sizeof(int) << (32 - hash->bucket_shift));
+	hash->active = 0;
+	hash->node_count = 0;
+	hash->free_node = -1;
+}
+
+// Take the object out of the buckets of the tiles it covers.
+static void unlink_object(ML2_SpatialHash *hash, Object *object) {
+	int node = object->first;
+	while (node != -1) {
+		Node *n = &hash->nodes[node];
+		if (n->prev != -1) hash->nodes[n->prev].next = n->next;
+		else hash->buckets[bucket_of(hash, n->cell_x, n->cell_y)] = n->next;
+		if (n->next != -1) hash->nodes[n->next].prev = n->prev;
+
+		int next = n->next_cell;
+		n->next_cell = hash->free_node;
+		hash->free_node = node;
+		node = next;
+	}
+	object->first = -1;
+}
+
+static int alloc_node(ML2_SpatialHash *hash) {
+	if (hash->free_node != -1) {
+		int node = hash->free_node;
+		hash->free_node = hash->nodes[node].next_cell;
+		return node;
+	}
+
+	if (hash->node_count == hash->node_capacity) {
+		if (hash->node_capacity > SDL_MAX_SINT32 / 2) return -1;
+		int new_capacity = hash->node_capacity ? hash->node_capacity * 2 : hash->capacity;
+		Node *nodes = SDL_realloc(hash->nodes, sizeof(Node) * (size_t) new_capacity);
+		if (!nodes) return -1;
+		hash->nodes = nodes;
+		hash->node_capacity = new_capacity;
+	}
+	return hash->node_count++;
+}
+
+SDL_bool ML2_SpatialHash_set(ML2_SpatialHash *hash, int id, const SDL_Rect *rect) {
+	if (id < 0 || id >= hash->capacity) {
+		SDL_SetError("Failed to add object to spatial hash: id %d is out of range.", id);
+		return SDL_FALSE;
+	}
+
+	Object *object = &hash->objects[id];
+	int x0, y0, x1, y1;
+	cell_span(hash, rect, &x0, &y0, &x1, &y1);
+	object->rect = *rect;
+	if (!object->active) {
+		object->active = SDL_TRUE;
+		++hash->active;
+	} else if (x0 == object->x0 && y0 == object->y0 && x1 == object->x1 && y1 == object->y1) {
+		// Still in the same tiles
+		return SDL_TRUE;
+	}
+
+	unlink_object(hash, object);
+	object->x0 = x0, object->y0 = y0;
+	object->x1 = x1, object->y1 = y1;
+	for (int y = y0; y <= y1; ++y) {
+		for (int x = x0; x <= x1; ++x) {
+			int node = alloc_node(hash);
+			if (node == -1) {
+				ML2_SpatialHash_remove(hash, id);
+				SDL_SetError("Failed to add object to spatial hash: not enough memory.");
+				return SDL_FALSE;
+			}
+
+			int bucket = bucket_of(hash, x, y);
+			hash->nodes[node] = (Node) {
+				.cell_x = x, .cell_y = y,
+				.id = id,
+				.prev = -1, .next = hash->buckets[bucket],
+				.next_cell = object->first
+			};
+			if (hash->buckets[bucket] != -1) hash->nodes[hash->buckets[bucket]].prev = node;
+			hash->buckets[bucket] = node;
+			object->first = node;
+		}
+	}
+	return SDL_TRUE;
+}
+
+void ML2_SpatialHash_remove(ML2_SpatialHash *hash, int id) {
+	if (id < 0 || id >= hash->capacity || !hash->objects[id].active) return;
+	Object *object = &hash->objects[id];
+	unlink_object(hash, object);
+	*object = (Object) {.x1 = -1, .y1 = -1, .first = -1};
+	--hash->active;
+}
+
+void ML2_SpatialHash_forEachPair(const ML2_SpatialHash *hash, ML2_SpatialHash_PairCallback callback, void *userdata) {
+	int bucket_count = 1 << (32 - hash->bucket_shift);
+	for (int bucket = 0; bucket < bucket_count; ++bucket) {
+		for (int i = hash->buckets[bucket]; i != -1; i = hash->nodes[i].next) {
+			const Node *a = &hash->nodes[i];
+			const SDL_Rect *rect_a = &hash->objects[a->id].rect;
+			for (int j = a->next; j != -1; j = hash->nodes[j].next) {
+				// Different tiles can land in the same bucket.
+				const Node *b = &hash->nodes[j];
+				if (b->cell_x != a->cell_x || b->cell_y != a->cell_y) continue;
+
+				const SDL_Rect *rect_b = &hash->objects[b->id].rect;
+				if (SDL_HasIntersection(rect_a, rect_b) && owns_overlap(hash, rect_a, rect_b, a->cell_x, a->cell_y)) {
+					callback(SDL_min(a->id, b->id), SDL_max(a->id, b->id), userdata);
+				}
+			}
+		}
+	}
+}
+
+int ML2_SpatialHash_query(const ML2_SpatialHash *hash, const SDL_Rect *region, int *ids, int max_ids) {
+	int x0, y0, x1, y1;
+	cell_span(hash, region, &x0, &y0, &x1, &y1);
+	if (x1 < x0) return 0;
+
+	int found = 0;
+	Uint64 cells = (Uint64) ((Sint64) x1 - x0 + 1) * (Uint64) ((Sint64) y1 - y0 + 1);
+	if (cells > (Uint64) hash->active) {
+		// Large regions are quicker to check against every object.
+		for (int id = 0; id < hash->capacity; ++id) {
+			const Object *object = &hash->objects[id];
+			if (object->active && SDL_HasIntersection(&object->rect, region)) {
+				if (found < max_ids) ids[found] = id;
+				++found;
+			}
+		}
+		return found;
+	}
+
+	for (int y = y0; y <= y1; ++y) {
+		for (int x = x0; x <= x1; ++x) {
+			for (int i = hash->buckets[bucket_of(hash, x, y)]; i != -1; i = hash->nodes[i].next) {
+				const Node *n = &hash->nodes[i];
+				if (n->cell_x != x || n->cell_y != y) continue;
+
+				const SDL_Rect *rect = &hash->objects[n->id].rect;
+				if (SDL_HasIntersection(rect, region) && owns_overlap(hash, rect, region, x, y)) {
+					if (found < max_ids) ids[found] = n->id;
+					++found;
+				}
+			}
+		}
+	}
+	return found;
+}
@@ -0,0 +1,108 @@
+/**
+ * @file
+ * @brief Spatial hash for finding which moving objects (landers, particles, pickups) overlap each other.
+ * @details Objects are bucketed by the tiles of a map they cover, so only objects sharing a tile
+ * are ever compared. This must be included after map.h.
+ * @author Will Brown
+ * @copyright Licensed under the GNU General Public License v3 (c) 2023 Will Brown
+ * See LICENSE or <https://www.gnu.org/licenses/>
+ */
+
+#ifndef MOONLANDER_SPATIALHASH_H
+#define MOONLANDER_SPATIALHASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Opaque spatial hash type.
+ * @details Objects are identified by numbers from 0 up to the capacity given to ML2_SpatialHash_create,
+ * and each has a rectangle in map coordinates (in pixels, with y going up from the bottom of the map).
+ * Rectangles don't have to be on the map.
+ */
+typedef struct ML2_SpatialHash ML2_SpatialHash;
+
+/**
+ * @brief Called for every pair of overlapping objects found by ML2_SpatialHash_forEachPair.
+ *
+ * @param a The object with the lower id
+ * @param b The object with the higher id
+ * @param userdata The pointer given to ML2_SpatialHash_forEachPair
+ */
+typedef void (*ML2_SpatialHash_PairCallback)(int a, int b, void *userdata);
+
+/**
+ * @brief Create an empty spatial hash, with cells the size of the tiles of a map.
+ * @details If there is an error, the SDL error state will be set and a null pointer will be returned.
+ *
+ * @param map The map the objects move around on
+ * @param capacity Number of objects that can be in the hash (ids go from 0 to capacity - 1)
+ * @return The newly created spatial hash
+ */
+ML2_SpatialHash *ML2_SpatialHash_create(const ML2_Map *map, int capacity);
+
+/**
+ * @brief Frees all resources associated with a spatial hash.
+ *
+ * @param hash The spatial hash to free
+ */
+void ML2_SpatialHash_destroy(ML2_SpatialHash *hash);
+
+/**
+ * @brief Remove every object from a spatial hash, to rebuild it from scratch.
+ *
+ * @param hash The spatial hash to clear
+ */
+void ML2_SpatialHash_clear(ML2_SpatialHash *hash);
+
+/**
+ * @brief Add an object to a spatial hash, or move it if it is already there.
+ * @details Moving an object within the tiles it already covers only updates its rectangle,
+ * so updating every object each frame is cheap when they move slowly.
+ * If there is an error, the SDL error state will be set and the object will be removed.
+ *
+ * @param hash The spatial hash to add the object to
+ * @param id The object to add (less than the capacity of the hash)
+ * @param rect The rectangle the object covers, which can be empty
+ * @return Whether the object was added successfully
+ */
+SDL_bool ML2_SpatialHash_set(ML2_SpatialHash *hash, int id, const SDL_Rect *rect);
+
+/**
+ * @brief Remove an object from a spatial hash.
+ * @details Objects that aren't in the hash are ignored.
+ *
+ * @param hash The spatial hash to remove the object from
+ * @param id The object to remove
+ */
+void ML2_SpatialHash_remove(ML2_SpatialHash *hash, int id);
+
+/**
+ * @brief Find every pair of objects whose rectangles overlap.
+ * @details Each pair is given to the callback exactly once, in no particular order.
+ * The hash must not be changed by the callback.
+ *
+ * @param hash The spatial hash to look in
+ * @param callback Function to call for every pair
+ * @param userdata Pointer passed on to the callback
+ */
+void ML2_SpatialHash_forEachPair(const ML2_SpatialHash *hash, ML2_SpatialHash_PairCallback callback, void *userdata);
+
+/**
+ * @brief Find the objects whose rectangles overlap a region.
+ * @details Each object is found once, in no particular order.
+ *
+ * @param hash The spatial hash to look in
+ * @param region The region to look in (in pixels)
+ * @param ids Array to fill with the ids of the objects found
+ * @param max_ids Size of the ids array
+ * @return The number of objects found, which can be more than max_ids (only the first max_ids are stored)
+ */
+int ML2_SpatialHash_query(const ML2_SpatialHash *hash, const SDL_Rect *region, int *ids, int max_ids);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
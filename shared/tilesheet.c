@@ -12,8 +12,129 @@
 
 #include "tilesheet.h"
 
-// Takes an SDL Surface, and the width and height of each tile, and creates a tilesheet.
-TileSheet *TileSheet_createFromSurface(
+/* What a shared tilesheet was loaded from: a path, a bitmap, or pixels. Two hashes with different seeds
+ * and the length of the key make it vanishingly unlikely that different keys are mistaken for each other. */
+typedef struct {
+	Uint64 hash, check;
+	size_t size;
+} SheetKey;
+
+typedef struct {
+	TileSheet *tilesheet;
+	SheetKey key;
+	int flags; // flags it was created with
+} SharedSheet;
+
+/* Registry of shared tilesheets. It is small and only searched when loading,
+ * so a plain array is enough. Maps may be loaded on a worker thread, so it is guarded by a lock. */
+static SharedSheet *shared_sheets;
+static int shared_count, shared_capacity;
+static SDL_SpinLock shared_lock;
+
+/* Pixels that are already RGBA with transparency applied are uploaded as they are,
+ * everything else goes through SDL's format conversion. */
+static SDL_Texture *create_texture(SDL_Renderer *renderer, SDL_Surface *surface) {
+	if (surface->format->format != SDL_PIXELFORMAT_RGBA32 || SDL_HasColorKey(surface)) {
+		return SDL_CreateTextureFromSurface(renderer, surface);
+	}
+	
+	SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, surface->w, surface->h);
+	if (!texture) return NULL;
+	if (SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch) < 0) {
+		SDL_DestroyTexture(texture);
+		return NULL;
+	}
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+	return texture;
+}
+
+// Reads a pixel from a locked surface.
+static Uint32 read_pixel(SDL_Surface *surface, int x, int y) {
+	int bpp = surface->format->BytesPerPixel;
+	Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
+	
+	switch (bpp) {
+	case 1:
+		return *p;
+	case 2:
+		return *(Uint16 *)p;
+	case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+		return p[0] << 16 | p[1] << 8 | p[2];
+#else
+		return p[0] | p[1] << 8 | p[2] << 16;
+#endif
+	case 4:
+		return *(Uint32 *)p;
+	default:
+		return 0;
+	}
+}
+
+/* Bake a bitmask of the solid pixels of every tile, once for each way it can be flipped,
+ * so collision only has to AND words together instead of looking at pixels.
+ * Each tile is also classified as empty, solid or partial, so most tiles don't need their mask at all. */
+static SDL_bool create_masks(TileSheet *tilesheet) {
+	SDL_Surface *surface = tilesheet->surface;
+	if (!surface) {
+		SDL_SetError("Tilesheet has no surface to create collision masks from.");
+		return SDL_FALSE;
+	}
+	
+	int tw = tilesheet->tile_width, th = tilesheet->tile_height;
+	int words = (tw + 31) / 32;
+	size_t per_flip = (size_t) th * words;
+	size_t count = (size_t) tilesheet->sheet_width * tilesheet->sheet_height;
+	size_t total = count * 4 * per_flip;
+	Uint32 *masks = SDL_calloc(total ? total : 1, sizeof(Uint32));
+	Uint8 *solidity = SDL_malloc(count ? count : 1);
+	if (!masks || !solidity) {
+		SDL_free(masks);
+		SDL_free(solidity);
+		SDL_SetError("Failed to allocate memory for collision masks.");
+		return SDL_FALSE;
+	}
+	
+	Uint32 key;
+	SDL_bool keyed = SDL_GetColorKey(surface, &key) == 0;
+	Uint32 alpha = surface->format->Amask;
+	if (SDL_LockSurface(surface) < 0) {
+		SDL_free(masks);
+		SDL_free(solidity);
+		return SDL_FALSE;
+	}
+	
+	for (size_t i = 0; i < count; ++i) {
+		Uint32 *mask = masks + i * 4 * per_flip;
+		int x0 = (int) (i % tilesheet->sheet_width) * tw, y0 = (int) (i / tilesheet->sheet_width) * th;
+		long solid = 0;
+		for (int y = 0; y < th; ++y) {
+			for (int x = 0; x < tw; ++x) {
+				Uint32 pixel = read_pixel(surface, x0 + x, y0 + y);
+				if (keyed ? pixel == key : alpha && !(pixel & alpha)) continue;
+				++solid;
+				
+				// Mask rows start from the bottom, and the vertical flip undoes that.
+				int up = th - 1 - y, mirrored = tw - 1 - x;
+				mask[up * words + x / 32] |= 1u << x % 32;
+				mask[per_flip + up * words + mirrored / 32] |= 1u << mirrored % 32;
+				mask[2 * per_flip + y * words + x / 32] |= 1u << x % 32;
+				mask[3 * per_flip + y * words + mirrored / 32] |= 1u << mirrored % 32;
+			}
+		}
+		
+		// Flipping only moves pixels around, so one class covers all four flips.
+		solidity[i] = !solid ? TILESHEET_TILE_EMPTY : solid == (long) tw * th ? TILESHEET_TILE_SOLID : TILESHEET_TILE_PARTIAL;
+	}
+	
+	SDL_UnlockSurface(surface);
+	tilesheet->masks = masks;
+	tilesheet->mask_words = words;
+	tilesheet->solidity = solidity;
+	return SDL_TRUE;
+}
+
+static TileSheet *create_tilesheet(
 	SDL_Surface *surface,
 	SDL_Renderer *renderer,
 	int tile_width,
@@ -21,13 +142,15 @@ TileSheet *TileSheet_createFromSurface(
 	int flags
 )
 {
-	if (!surface) return NULL;
-	
-	// 0x00FF00 will be used as a key for transparency.
-	SDL_SetColorKey(surface, SDL_TRUE, SDL_MapRGB(surface->format, 0, 255, 0));
-	
-	SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-	if (!texture) return NULL;
+	// Without a renderer, the surface is kept around until the texture can be created.
+	SDL_Texture *texture = NULL;
+	if (renderer) {
+		texture = create_texture(renderer, surface);
+		if (!texture) {
+			if (flags & TILESHEET_FREESURFACE) SDL_FreeSurface(surface);
+			return NULL;
+		}
+	}
 	
 	TileSheet *tilesheet = SDL_malloc(sizeof(TileSheet));
 	if (!tilesheet) {
@@ -37,7 +160,9 @@ TileSheet *TileSheet_createFromSurface(
 		return NULL;
 	} else {
 		*tilesheet = (TileSheet) {
+			.refcount = 1,
 			.texture = texture,
+			.renderer = texture ? renderer : NULL,
 			.tile_width = tile_width,
 			.tile_height = tile_height,
 			.sheet_width = surface->w / tile_width,
@@ -45,8 +170,20 @@ TileSheet *TileSheet_createFromSurface(
 			.free_surface = !!(flags & TILESHEET_FREESURFACE)
 		};
 		
+		// Masks are made while the surface is still around, since it may be freed below.
+		tilesheet->surface = surface;
+		if (flags & TILESHEET_CREATEMASKS && !create_masks(tilesheet)) {
+			SDL_DestroyTexture(texture);
+			if (flags & TILESHEET_FREESURFACE) SDL_FreeSurface(surface);
+			SDL_free(tilesheet);
+			return NULL;
+		}
+		
 		if (flags & TILESHEET_CREATESURFACE) {
 			tilesheet->surface = surface;
+		} else if (!texture) {
+			tilesheet->surface = surface;
+			tilesheet->surface_pending = SDL_TRUE;
 		} else if (flags & TILESHEET_FREESURFACE) {
 			SDL_FreeSurface(surface);
 			tilesheet->surface = NULL;
@@ -58,6 +195,49 @@ TileSheet *TileSheet_createFromSurface(
 	return tilesheet;
 }
 
+// Takes an SDL Surface, and the width and height of each tile, and creates a tilesheet.
+TileSheet *TileSheet_createFromSurface(
+	SDL_Surface *surface,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+)
+{
+	if (!surface) return NULL;
+	
+	// 0x00FF00 will be used as a key for transparency.
+	SDL_SetColorKey(surface, SDL_TRUE, SDL_MapRGB(surface->format, 0, 255, 0));
+	
+	return create_tilesheet(surface, renderer, tile_width, tile_height, flags);
+}
+
+// Takes raw RGBA pixels with transparency already applied, and the width and height of each tile, and creates a tilesheet.
+TileSheet *TileSheet_createFromPixels(
+	const void *pixels,
+	int width,
+	int height,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+)
+{
+	SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!surface) return NULL;
+	
+	// Rows of the surface may be padded, so they are copied one at a time if they are.
+	const Uint8 *src = pixels;
+	int row_size = width * 4;
+	if (surface->pitch == row_size) {
+		SDL_memcpy(surface->pixels, src, (size_t) row_size * height);
+	} else for (int y = 0; y < height; ++y) {
+		SDL_memcpy((Uint8 *) surface->pixels + y * surface->pitch, src + (size_t) y * row_size, row_size);
+	}
+	
+	return create_tilesheet(surface, renderer, tile_width, tile_height, flags | TILESHEET_FREESURFACE);
+}
+
 // Takes a Windows bitmap image from RWops, and the width and height of each tile, and creates a tilesheet.
 TileSheet *TileSheet_createFromRWops(
 	SDL_RWops *src,
@@ -85,11 +265,208 @@ TileSheet *TileSheet_create(
 	return TileSheet_createFromSurface(surface, renderer, tile_width, tile_height, flags | TILESHEET_FREESURFACE);
 }
 
-// Frees all the resources for a tilesheet.
+// Create the texture for a tilesheet that was created without a renderer.
+SDL_bool TileSheet_createTexture(TileSheet *tilesheet, SDL_Renderer *renderer) {
+	if (tilesheet->texture) {
+		if (tilesheet->renderer == renderer) return SDL_TRUE;
+		SDL_SetError("Tilesheet already has a texture for a different renderer.");
+		return SDL_FALSE;
+	}
+	
+	tilesheet->texture = create_texture(renderer, tilesheet->surface);
+	if (!tilesheet->texture) return SDL_FALSE;
+	// Shared sheets are matched by renderer, possibly from another thread.
+	SDL_AtomicLock(&shared_lock);
+	tilesheet->renderer = renderer;
+	SDL_AtomicUnlock(&shared_lock);
+	
+	// Drop the surface if it was only kept for this.
+	if (tilesheet->surface_pending) {
+		if (tilesheet->free_surface) SDL_FreeSurface(tilesheet->surface);
+		tilesheet->surface = NULL;
+		tilesheet->surface_pending = SDL_FALSE;
+	}
+	return SDL_TRUE;
+}
+
+/* FNV-1a style hash, seeded so that different kinds of keys don't collide.
+ * Sheets can be several megabytes, so it consumes 8 bytes at a time. */
+static Uint64 hash_bytes(Uint64 hash, const void *data, size_t size) {
+	const Uint8 *bytes = data;
+	size_t i = 0;
+	for (; size - i >= 8; i += 8) {
+		Uint64 word;
+		SDL_memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * 0x100000001B3;
+		hash ^= hash >> 32;
+	}
+	for (; i < size; ++i) hash = (hash ^ bytes[i]) * 0x100000001B3;
+	return hash ? hash : 1; // 0 means not shared
+}
+
+#define PATH_SEED 0xCBF29CE484222325
+#define CONTENT_SEED 0x84222325CBF29CE4
+#define PIXELS_SEED 0x25CBF29CE4842223
+// Mixed into the seeds for the second hash of a key
+#define CHECK_SEED 0x9E3779B97F4A7C15
+
+static SheetKey make_key(Uint64 seed, const void *prefix, size_t prefix_size, const void *data, size_t size) {
+	return (SheetKey) {
+		.hash = hash_bytes(hash_bytes(seed, prefix, prefix_size), data, size),
+		.check = hash_bytes(hash_bytes(seed ^ CHECK_SEED, prefix, prefix_size), data, size),
+		.size = size
+	};
+}
+
+/* A sheet is only shared with someone who would have created the same one: the same key and tile size,
+ * and at least the surface and masks they asked for. Textures can't be used with any other renderer than
+ * their own, so a sheet that already has one is only shared with users of that renderer, or with users
+ * who have no renderer yet (such as maps loaded in the background). Must be called with shared_lock held. */
+static TileSheet *find_shared(const SheetKey *key, SDL_Renderer *renderer, int tile_width, int tile_height, int flags) {
+	for (int i = 0; i < shared_count; ++i) {
+		const SharedSheet *entry = &shared_sheets[i];
+		if (
+			entry->key.hash == key->hash && entry->key.check == key->check && entry->key.size == key->size &&
+			entry->tilesheet->tile_width == tile_width &&
+			entry->tilesheet->tile_height == tile_height &&
+			(!renderer || !entry->tilesheet->renderer || entry->tilesheet->renderer == renderer) &&
+			!(flags & ~entry->flags & (TILESHEET_CREATESURFACE | TILESHEET_CREATEMASKS))
+		) return entry->tilesheet;
+	}
+	return NULL;
+}
+
+// Return a new reference to a shared tilesheet if a matching one is already loaded.
+static TileSheet *get_shared(const SheetKey *key, SDL_Renderer *renderer, int tile_width, int tile_height, int flags) {
+	SDL_AtomicLock(&shared_lock);
+	TileSheet *tilesheet = find_shared(key, renderer, tile_width, tile_height, flags);
+	if (tilesheet) ++tilesheet->refcount;
+	SDL_AtomicUnlock(&shared_lock);
+	
+	if (tilesheet && renderer && !TileSheet_createTexture(tilesheet, renderer)) {
+		TileSheet_destroy(tilesheet);
+		return NULL;
+	}
+	return tilesheet;
+}
+
+/* Add a newly loaded tilesheet to the registry. If another thread loaded
+ * the same one in the meantime, that one is used instead. */
+static TileSheet *add_shared(TileSheet *tilesheet, const SheetKey *key, SDL_Renderer *renderer, int flags) {
+	if (!tilesheet) return NULL;
+	
+	SDL_AtomicLock(&shared_lock);
+	TileSheet *existing = find_shared(key, renderer, tilesheet->tile_width, tilesheet->tile_height, flags);
+	if (existing) {
+		++existing->refcount;
+	} else if (shared_count == shared_capacity) {
+		int capacity = shared_capacity ? shared_capacity * 2 : 8;
+		SharedSheet *sheets = SDL_realloc(shared_sheets, capacity * sizeof(SharedSheet));
+		if (sheets) {
+			shared_sheets = sheets;
+			shared_capacity = capacity;
+		}
+	}
+	// If the registry couldn't grow, the tilesheet still works, it just isn't shared.
+	if (!existing && shared_count < shared_capacity) {
+		tilesheet->shared_hash = key->hash;
+		shared_sheets[shared_count++] = (SharedSheet) {tilesheet, *key, flags};
+	}
+	SDL_AtomicUnlock(&shared_lock);
+	
+	if (existing) {
+		TileSheet_destroy(tilesheet);
+		if (renderer && !TileSheet_createTexture(existing, renderer)) {
+			TileSheet_destroy(existing);
+			return NULL;
+		}
+		return existing;
+	}
+	return tilesheet;
+}
+
+// Get a tilesheet from a Windows bitmap file, sharing it with anyone else who has the same file loaded.
+TileSheet *TileSheet_createShared(
+	const char *file_path,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+)
+{
+	SheetKey key = make_key(PATH_SEED, NULL, 0, file_path, SDL_strlen(file_path));
+	TileSheet *tilesheet = get_shared(&key, renderer, tile_width, tile_height, flags);
+	if (tilesheet) return tilesheet;
+	
+	return add_shared(TileSheet_create(file_path, renderer, tile_width, tile_height, flags), &key, renderer, flags);
+}
+
+// Get a tilesheet from a Windows bitmap in memory, sharing it with anyone else who has a bitmap with the same contents loaded.
+TileSheet *TileSheet_createSharedFromMem(
+	const void *bmp,
+	size_t size,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+)
+{
+	SheetKey key = make_key(CONTENT_SEED, NULL, 0, bmp, size);
+	TileSheet *tilesheet = get_shared(&key, renderer, tile_width, tile_height, flags);
+	if (tilesheet) return tilesheet;
+	
+	SDL_RWops *src = SDL_RWFromConstMem(bmp, size);
+	if (!src) return NULL;
+	return add_shared(TileSheet_createFromRWops(src, 1, renderer, tile_width, tile_height, flags), &key, renderer, flags);
+}
+
+// Get a tilesheet from raw RGBA pixels, sharing it with anyone else who has the same pixels loaded.
+TileSheet *TileSheet_createSharedFromPixels(
+	const void *pixels,
+	int width,
+	int height,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+)
+{
+	int dim[2] = {width, height};
+	SheetKey key = make_key(PIXELS_SEED, dim, sizeof(dim), pixels, (size_t) width * height * 4);
+	TileSheet *tilesheet = get_shared(&key, renderer, tile_width, tile_height, flags);
+	if (tilesheet) return tilesheet;
+	
+	return add_shared(TileSheet_createFromPixels(pixels, width, height, renderer, tile_width, tile_height, flags), &key, renderer, flags);
+}
+
+TileSheet *TileSheet_retain(TileSheet *tilesheet) {
+	SDL_AtomicLock(&shared_lock);
+	++tilesheet->refcount;
+	SDL_AtomicUnlock(&shared_lock);
+	return tilesheet;
+}
+
+// Releases a reference to a tilesheet, freeing all of its resources once nothing else uses it.
 void TileSheet_destroy(TileSheet *tilesheet) {
 	if (!tilesheet) return;
+	
+	SDL_AtomicLock(&shared_lock);
+	int refcount = --tilesheet->refcount;
+	if (!refcount && tilesheet->shared_hash) {
+		for (int i = 0; i < shared_count; ++i) {
+			if (shared_sheets[i].tilesheet == tilesheet) {
+				shared_sheets[i] = shared_sheets[--shared_count];
+				break;
+			}
+		}
+	}
+	SDL_AtomicUnlock(&shared_lock);
+	if (refcount) return;
+	
 	if (tilesheet->free_surface) SDL_FreeSurface(tilesheet->surface);
 	
+	SDL_free(tilesheet->masks);
+	SDL_free(tilesheet->solidity);
 	SDL_DestroyTexture(tilesheet->texture);
 	SDL_free(tilesheet);
 }
@@ -110,34 +487,45 @@ SDL_Rect TileSheet_getTileRect(TileSheet *tilesheet, int index) {
 	}
 }
 
+/* Whether a single pixel in a tile is transparent, either because it matches the color key
+ * or because its alpha is 0. Sheets without a surface answer from their collision masks instead. */
+SDL_bool TileSheet_isTransparent(TileSheet *tilesheet, int index, int x, int y) {
+	if (!tilesheet) return SDL_FALSE;
+	if (!tilesheet->surface) {
+		const Uint32 *mask = TileSheet_getMask(tilesheet, index, SDL_FLIP_NONE);
+		if (!mask || x < 0 || y < 0 || x >= tilesheet->tile_width || y >= tilesheet->tile_height) return SDL_FALSE;
+		const Uint32 *row = mask + (tilesheet->tile_height - 1 - y) * tilesheet->mask_words; // mask rows start from the bottom
+		return !(row[x / 32] >> x % 32 & 1);
+	}
+	
+	Uint32 pixel = TileSheet_getPixel(tilesheet, index, x, y);
+	Uint32 key;
+	if (SDL_GetColorKey(tilesheet->surface, &key) == 0) return pixel == key;
+	return tilesheet->surface->format->Amask && !(pixel & tilesheet->surface->format->Amask);
+}
+
 Uint32 TileSheet_getPixel(TileSheet *tilesheet, int index, int x, int y) {
 	if (
 		!tilesheet ||
 		!tilesheet->surface ||
-		index >= tilesheet->tile_width * tilesheet->tile_height
+		index < 0 ||
+		index >= tilesheet->sheet_width * tilesheet->sheet_height
 	) return 0;
 
 	SDL_Rect tile_rect = TileSheet_getTileRect(tilesheet, index);
-	x += tile_rect.x;
-	y += tile_rect.y;
-	
-	int bpp = tilesheet->surface->format->BytesPerPixel;
-	Uint8 *p = (Uint8 *)tilesheet->surface->pixels + y * tilesheet->surface->pitch + x * bpp;
+	return read_pixel(tilesheet->surface, x + tile_rect.x, y + tile_rect.y);
+}
+
+const Uint32 *TileSheet_getMask(TileSheet *tilesheet, int index, int flip) {
+	if (!tilesheet || index < 0 || index >= tilesheet->sheet_width * tilesheet->sheet_height) return NULL;
+	if (!tilesheet->masks && !create_masks(tilesheet)) return NULL;
 	
-	switch (bpp) {
-	case 1:
-		return *p;
-	case 2:
-		return *(Uint16 *)p;
-	case 3:
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-		return p[0] << 16 | p[1] << 8 | p[2];
-#else
-		return p[0] | p[1] << 8 | p[2] << 16;
-#endif
-	case 4:
-		return *(Uint32 *)p;
-	default:
-		return 0;
-	}
+	size_t per_flip = (size_t) tilesheet->tile_height * tilesheet->mask_words;
+	return tilesheet->masks + ((size_t) index * 4 + (flip & 3)) * per_flip;
+}
+
+int TileSheet_getSolidity(TileSheet *tilesheet, int index) {
+	if (!tilesheet || index < 0 || index >= tilesheet->sheet_width * tilesheet->sheet_height) return TILESHEET_TILE_EMPTY;
+	if (!tilesheet->masks && !create_masks(tilesheet)) return TILESHEET_TILE_EMPTY;
+	return tilesheet->solidity[index];
 }
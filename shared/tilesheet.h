@@ -19,7 +19,17 @@ extern "C" {
 enum TileSheet_flags {
 	TILESHEET_CREATETEXTURE = 0, ///< Create a texture (default behavior)
 	TILESHEET_CREATESURFACE = 1, ///< Create a surface (creates an extra copy in system memory)
-	TILESHEET_FREESURFACE = 2 ///< Free surface after it is no longer needed.
+	TILESHEET_FREESURFACE = 2, ///< Free surface after it is no longer needed.
+	TILESHEET_CREATEMASKS = 4 ///< Create collision masks (see TileSheet_getMask), so no surface is needed for collision
+};
+
+/**
+ * @brief How much of a tile is solid, so collision and rendering can skip looking at its pixels.
+ */
+enum TileSheet_solidity {
+	TILESHEET_TILE_EMPTY, ///< Every pixel is transparent
+	TILESHEET_TILE_SOLID, ///< Every pixel is solid
+	TILESHEET_TILE_PARTIAL ///< Some pixels are solid and some are transparent
 };
 
 /**
@@ -28,18 +38,27 @@ enum TileSheet_flags {
 typedef struct {
 	SDL_Surface *surface; ///< surface containing tile data
 	SDL_Texture *texture; ///< texture containing tile data
+	SDL_Renderer *renderer; ///< renderer the texture was created for, NULL until there is a texture
 	int tile_width; ///< width of a single tile
 	int tile_height; ///< height of a single tile
 	int sheet_width; ///< width of the tilesheet (in tiles)
 	int sheet_height; ///< height of the tilesheet (in tiles)
 	SDL_bool free_surface; ///< Whether to free the surface once it is no longer needed.
+	SDL_bool surface_pending; ///< Whether the surface is only kept until the texture is created.
+	int refcount; ///< Number of users of the tilesheet, it is freed once this reaches 0
+	Uint64 shared_hash; ///< Identifies a shared tilesheet in the registry, 0 if it isn't shared
+	Uint32 *masks; ///< Collision masks for every tile and flip, NULL until they are created (see TileSheet_getMask)
+	int mask_words; ///< Number of 32-bit words in each row of a collision mask
+	Uint8 *solidity; ///< Solidity of every tile (a TileSheet_solidity value), created along with the masks
 } TileSheet;
 
 /**
  * @brief Takes an SDL Surface, and the width and height of each tile, and creates a tilesheet.
+ * @details If no renderer is given, creating the texture is deferred until TileSheet_createTexture is called.
+ * This allows a tilesheet to be loaded on a thread other than the one that renders.
  * 
  * @param surface The surface to use
- * @param renderer The renderer the tilesheet will render to
+ * @param renderer The renderer the tilesheet will render to (may be NULL)
  * @param tile_width The width of a single tile
  * @param tile_height The height of a single tile
  * @param flags Flags for creating a tilesheet.
@@ -53,13 +72,38 @@ TileSheet *TileSheet_createFromSurface(
 	int flags
 );
 
+/**
+ * @brief Takes raw pixels, and the width and height of each tile, and creates a tilesheet.
+ * @details The pixels must be in SDL_PIXELFORMAT_RGBA32 with transparency already in the alpha channel,
+ * so they can be uploaded to the texture without any conversion. They are copied,
+ * so they don't need to outlive the tilesheet.
+ * 
+ * @param pixels The pixels to use, with no padding between rows
+ * @param width The width of the tilesheet (in pixels)
+ * @param height The height of the tilesheet (in pixels)
+ * @param renderer The renderer the tilesheet will render to (may be NULL, see TileSheet_createFromSurface)
+ * @param tile_width The width of a single tile
+ * @param tile_height The height of a single tile
+ * @param flags Flags for creating a tilesheet.
+ * @return The newly created tilesheet
+ */
+TileSheet *TileSheet_createFromPixels(
+	const void *pixels,
+	int width,
+	int height,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+);
+
 /**
  * @brief Takes a Windows bitmap image from RWops, and the width and height of each tile, and creates a tilesheet.
  * @details This does not set the position to 0 beforehand, nor set the position back to its initial value once the operation is complete.
  * 
  * @param src The RWops to use as the source
  * @param freesrc Whether to free the RWops once the tilesheet has been created
- * @param renderer The renderer the tilesheet will render to
+ * @param renderer The renderer the tilesheet will render to (may be NULL, see TileSheet_createFromSurface)
  * @param tile_width The width of a single tile
  * @param tile_height The height of a single tile
  * @param flags Flags for creating a tilesheet.
@@ -78,7 +122,7 @@ TileSheet *TileSheet_createFromRWops(
  * @brief Takes the file path of a Windows bitmap image, and the width and height of each tile, and creates a tilesheet.
  * 
  * @param file_path The path to the file containing the tilesheet
- * @param renderer The renderer the tilesheet will render to
+ * @param renderer The renderer the tilesheet will render to (may be NULL, see TileSheet_createFromSurface)
  * @param tile_width The width of a single tile
  * @param tile_height The height of a single tile
  * @param flags Flags for creating a tilesheet.
@@ -93,7 +137,94 @@ TileSheet *TileSheet_create(
 );
 
 /**
- * @brief Frees all the resources for a tilesheet.
+ * @brief Get a tilesheet from a Windows bitmap file, sharing it with anyone else who has the same file loaded.
+ * @details The tilesheet is only decoded and its texture only created the first time, after that
+ * another reference to the same tilesheet is returned. It must be released with TileSheet_destroy.
+ * A loaded tilesheet is only shared if it has at least the surface and masks asked for in flags and
+ * any texture it has belongs to the same renderer, otherwise a separate one is created.
+ * 
+ * @param file_path The path to the file containing the tilesheet
+ * @param renderer The renderer the tilesheet will render to (may be NULL, see TileSheet_createFromSurface)
+ * @param tile_width The width of a single tile
+ * @param tile_height The height of a single tile
+ * @param flags Flags for creating a tilesheet.
+ * @return The shared tilesheet
+ */
+TileSheet *TileSheet_createShared(
+	const char *file_path,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+);
+
+/**
+ * @brief Get a tilesheet from a Windows bitmap in memory, sharing it with anyone else who has a bitmap with the same contents loaded.
+ * @details Tilesheets are matched by a hash of the bitmap, otherwise this behaves like TileSheet_createShared.
+ * 
+ * @param bmp The bitmap data
+ * @param size Size of the bitmap data
+ * @param renderer The renderer the tilesheet will render to (may be NULL, see TileSheet_createFromSurface)
+ * @param tile_width The width of a single tile
+ * @param tile_height The height of a single tile
+ * @param flags Flags for creating a tilesheet.
+ * @return The shared tilesheet
+ */
+TileSheet *TileSheet_createSharedFromMem(
+	const void *bmp,
+	size_t size,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+);
+
+/**
+ * @brief Get a tilesheet from raw pixels, sharing it with anyone else who has the same pixels loaded.
+ * @details Tilesheets are matched by a hash of the pixels, otherwise this behaves like
+ * TileSheet_createShared. See TileSheet_createFromPixels for the pixel format.
+ * 
+ * @param pixels The pixels to use, with no padding between rows
+ * @param width The width of the tilesheet (in pixels)
+ * @param height The height of the tilesheet (in pixels)
+ * @param renderer The renderer the tilesheet will render to (may be NULL, see TileSheet_createFromSurface)
+ * @param tile_width The width of a single tile
+ * @param tile_height The height of a single tile
+ * @param flags Flags for creating a tilesheet.
+ * @return The shared tilesheet
+ */
+TileSheet *TileSheet_createSharedFromPixels(
+	const void *pixels,
+	int width,
+	int height,
+	SDL_Renderer *renderer,
+	int tile_width,
+	int tile_height,
+	int flags
+);
+
+/**
+ * @brief Add a reference to a tilesheet, so it stays alive until TileSheet_destroy is called once more.
+ * 
+ * @param tilesheet The tilesheet to reference
+ * @return The same tilesheet
+ */
+TileSheet *TileSheet_retain(TileSheet *tilesheet);
+
+/**
+ * @brief Create the texture for a tilesheet that was created without a renderer.
+ * @details This does nothing if the tilesheet already has a texture for the same renderer,
+ * and fails if it has one for a different renderer.
+ * This will set the SDL error message if it fails
+ * 
+ * @param tilesheet The tilesheet to create the texture for
+ * @param renderer The renderer the tilesheet will render to
+ * @return Whether the texture was created successfully
+ */
+SDL_bool TileSheet_createTexture(TileSheet *tilesheet, SDL_Renderer *renderer);
+
+/**
+ * @brief Releases a reference to a tilesheet, freeing all of its resources once nothing else uses it.
  * @details This WILL NOT free the surface, since this is a borrowed resource.
  * 
  * @param tilesheet The tilesheet to free
@@ -110,6 +241,45 @@ void TileSheet_destroy(TileSheet *tilesheet);
  */
 SDL_Rect TileSheet_getTileRect(TileSheet *tilesheet, int index);
 
+/**
+ * @brief Check whether a single pixel in a tile is transparent.
+ * @details This uses the surface if the tilesheet has one, otherwise its collision masks (see TileSheet_getMask).
+ * 
+ * @param tilesheet The tilesheet to get the tile from
+ * @param index The position of the tile on the tilesheet (left-to-right, top-to-bottom)
+ * @param x x-coordinate of the pixel you want
+ * @param y y-coordinate of the pixel you want
+ * @return Whether the pixel is transparent, SDL_FALSE if the tile or pixel is out of range and there is no surface
+ */
+SDL_bool TileSheet_isTransparent(TileSheet *tilesheet, int index, int x, int y);
+
+/**
+ * @brief Get the collision mask of a tile, as it appears with a given flip.
+ * @details The mask has a row for every row of pixels in the tile, starting from the bottom
+ * (matching map coordinates), and each row is mask_words 32-bit words long. Bit x of a row
+ * (counting from the least significant bit of the first word) is set if the pixel x pixels
+ * from the left of the flipped tile is solid.
+ * Masks are created along with the tilesheet if TILESHEET_CREATEMASKS is given, otherwise they
+ * are created from the surface the first time they are needed.
+ * 
+ * @param tilesheet The tilesheet to get the mask from
+ * @param index The position of the tile on the tilesheet (left-to-right, top-to-bottom)
+ * @param flip How the tile is flipped (an SDL_RendererFlip value)
+ * @return The mask, or NULL if the index is out of range or the mask can't be created
+ */
+const Uint32 *TileSheet_getMask(TileSheet *tilesheet, int index, int flip);
+
+/**
+ * @brief Get whether a tile is empty, fully solid, or partially solid.
+ * @details This is worked out along with the collision masks (see TileSheet_getMask),
+ * and creates them if they don't exist yet. Flipping a tile doesn't change its solidity.
+ * 
+ * @param tilesheet The tilesheet to get the tile from
+ * @param index The position of the tile on the tilesheet (left-to-right, top-to-bottom)
+ * @return A TileSheet_solidity value. Tiles that are out of range or have no mask are empty.
+ */
+int TileSheet_getSolidity(TileSheet *tilesheet, int index);
+
 /**
  * @brief Get the raw color data of a single pixel in a tile.
  * @details This requires that you created a surface with the tilesheet. This is not the default.
@@ -0,0 +1,54 @@
+/* What the benchmarks that need a map with terrain share: a small random number generator,
+ * an unbiased random walk for the height of the ground, and a map whose tilesheet is drawn
+ * by a function instead of loaded from a file. Include after map.h. */
+
+#ifndef MOONLANDER_TESTS_BENCHMAP_H
+#define MOONLANDER_TESTS_BENCHMAP_H
+
+// Whether pixel x of row up (counting from the bottom of the tile) of a tile is solid
+typedef SDL_bool (*BenchMap_SolidFunc)(int tile, int x, int up);
+
+static Uint32 BenchMap_random(Uint32 *state) {
+	*state = *state * 1664525 + 1013904223;
+	return *state;
+}
+
+/* Move a height down a step, up a step, or not at all, each as likely, keeping it between min and max.
+ * Once the height is more than a quarter of the range away from the middle, half of the steps further away
+ * are turned around, so over a long map it wanders around the middle instead of sitting at min or max. */
+static int BenchMap_walk(Uint32 *state, int height, int min, int max) {
+	Uint32 random = BenchMap_random(state);
+	int step = (int) (random % 3) - 1, offset = height - (min + max) / 2;
+	if (SDL_abs(offset) > (max - min) / 4 && offset * step > 0 && random >> 31) step = -step;
+	height += step;
+	return height < min ? min : height > max ? max : height;
+}
+
+/* Create an empty map whose tilesheet is a row of tile_count square tiles, with solid pixels wherever solid says
+ * and transparent ones everywhere else. There is no renderer, since benchmarks don't draw anything. */
+static ML2_Map *BenchMap_create(int width, int height, int tile_size, int tile_count, BenchMap_SolidFunc solid) {
+	int sheet_width = tile_size * tile_count;
+	Uint8 *pixels = SDL_malloc((size_t) sheet_width * tile_size * 4);
+	if (!pixels) {
+		SDL_SetError("Out of memory");
+		return NULL;
+	}
+	for (int y = 0; y < tile_size; ++y) {
+		for (int x = 0; x < sheet_width; ++x) {
+			Uint8 *p = pixels + ((size_t) y * sheet_width + x) * 4;
+			SDL_bool is_solid = solid(x / tile_size, x % tile_size, tile_size - 1 - y);
+			p[0] = 120, p[1] = 110, p[2] = 100, p[3] = is_solid ? 255 : 0;
+		}
+	}
+
+	ML2_Map params = {
+		.width = width,
+		.height = height,
+		.tiles = TileSheet_createFromPixels(pixels, sheet_width, tile_size, NULL, tile_size, tile_size, TILESHEET_CREATEMASKS),
+		.tilesheet_enum = 0
+	};
+	SDL_free(pixels);
+	return params.tiles ? ML2_Map_create(params, NULL) : NULL;
+}
+
+#endif
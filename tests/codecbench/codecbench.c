@@ -0,0 +1,130 @@
+/* Reports how well each tile data codec compresses a set of maps, and how fast it decodes.
+ * Run this from the root of the project so the built-in tilesheets can be found:
+ * tests/codecbench/codecbench *.ml2 */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "tiles.h"
+#include "codec.h"
+#include "map.h"
+
+// Each measurement runs for at least this long
+#define MIN_SECONDS 0.25
+
+static const char *METHOD_NAMES[ML2_CODEC_COUNT] = {"raw", "rle", "lz"};
+
+static double seconds(Uint64 start) {
+	return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+/* Decode repeatedly and return throughput in GB/s of decompressed data.
+ * The output is checked against the original tiles, so a broken codec can't report a speed. */
+static double decode_speed(const Uint8 *compressed, size_t compressed_size, Uint8 *out, const Uint8 *expected, size_t size) {
+	// Left over output from an earlier measurement would hide a decoder that writes nothing.
+	SDL_memset(out, 0xAA, size);
+	size_t iterations = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	double elapsed;
+	do {
+		for (int i = 0; i < 64; ++i) {
+			if (!ML2_Codec_decompress(compressed, compressed_size, out, size)) {
+				fprintf(stderr, "Decode failed: %s\n", SDL_GetError());
+				exit(1);
+			}
+		}
+		iterations += 64;
+	} while ((elapsed = seconds(start)) < MIN_SECONDS);
+
+	if (SDL_memcmp(out, expected, size) != 0) {
+		fprintf(stderr, "%s decoder output does not match the original tiles\n", METHOD_NAMES[compressed[0]]);
+		exit(1);
+	}
+	return (double) size * iterations / elapsed / 1e9;
+}
+
+static double memcpy_speed(const Uint8 *src, Uint8 *out, size_t size) {
+	size_t iterations = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	double elapsed;
+	do {
+		for (int i = 0; i < 64; ++i) SDL_memcpy(out, src, size);
+		iterations += 64;
+	} while ((elapsed = seconds(start)) < MIN_SECONDS);
+	return (double) size * iterations / elapsed / 1e9;
+}
+
+static void bench_map(const char *path, SDL_Renderer *renderer) {
+	ML2_Map *map = ML2_Map_loadFromFile(path, renderer);
+	if (!map) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		return;
+	}
+
+	// Rebuild the raw tile bytes, so chunked maps are measured the same way.
+	size_t size = (size_t) map->width * map->height;
+	Uint8 *tiles = SDL_malloc(size);
+	Uint8 *out = SDL_malloc(size);
+	Uint8 *compressed = SDL_malloc(ML2_Codec_compressBound(size));
+	if (!tiles || !out || !compressed) {
+		fprintf(stderr, "Not enough memory to benchmark %s\n", path);
+		exit(1);
+	}
+	for (Uint32 y = 0; y < map->height; ++y) {
+		for (Uint32 x = 0; x < map->width; ++x) {
+			int flip;
+			int tile = ML2_Map_getTile(map, x, y, &flip);
+			tiles[(size_t) y * map->width + x] = tile | flip << 6;
+		}
+	}
+
+	printf("%s (%ux%u, %zu bytes)\n", path, map->width, map->height, size);
+	printf("  %-6s %12.2f GB/s\n", "memcpy", memcpy_speed(tiles, out, size));
+	for (int method = 0; method < ML2_CODEC_COUNT; ++method) {
+		size_t compressed_size = ML2_Codec_compressMethod(method, tiles, size, compressed, ML2_Codec_compressBound(size));
+		if (!compressed_size) {
+			printf("  %-6s %12s\n", METHOD_NAMES[method], "(larger than raw)");
+			continue;
+		}
+		printf(
+			"  %-6s %12.2f GB/s %10zu bytes (%.1f%%)\n", METHOD_NAMES[method],
+			decode_speed(compressed, compressed_size, out, tiles, size),
+			compressed_size, 100.0 * compressed_size / size
+		);
+	}
+
+	size_t compressed_size = ML2_Codec_compress(tiles, size, compressed, ML2_Codec_compressBound(size));
+	printf("  best   %s, %zu bytes\n", METHOD_NAMES[compressed[0]], compressed_size);
+
+	SDL_free(compressed);
+	SDL_free(out);
+	SDL_free(tiles);
+	ML2_Map_free(map);
+}
+
+int main(int argc, char *argv[]) {
+	static const char *default_corpus[] = {
+		"test.ml2", "test2.ml2", "test3.ml2", "test4.ml2", "SD.ml2", "JCRFirstLevel.ml2", NULL
+	};
+
+	// Textures are still created for the tilesheets, so a software renderer stands in for a window.
+	SDL_Surface *target = SDL_CreateRGBSurfaceWithFormat(0, 1, 1, 32, SDL_PIXELFORMAT_RGBA32);
+	SDL_Renderer *renderer = target ? SDL_CreateSoftwareRenderer(target) : NULL;
+	if (!renderer) {
+		fprintf(stderr, "SDL_CreateSoftwareRenderer: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) bench_map(argv[i], renderer);
+	} else {
+		for (const char **path = default_corpus; *path; ++path) bench_map(*path, renderer);
+	}
+
+	SDL_DestroyRenderer(renderer);
+	SDL_FreeSurface(target);
+	return 0;
+}
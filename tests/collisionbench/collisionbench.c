@@ -0,0 +1,154 @@
+/* Measures how many collision queries per second a map can answer, one at a time and
+ * in batches on different numbers of threads, then one at a time with every tile forced
+ * to partially solid. That last run only simulates the code from before the solidity table:
+ * it is the same code, made to check the mask of every tile.
+ * Usage: collisionbench [number of queries] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+#include "benchmap.h"
+
+#define TILE_SIZE 16
+#define MAP_WIDTH 256
+#define MAP_HEIGHT 64
+
+enum { TILE_EMPTY, TILE_SOLID, TILE_SLOPE, TILE_BUMPS, TILE_TYPES };
+
+// Tiles are empty, solid, a slope or some bumps.
+static SDL_bool is_solid(int tile, int x, int up) {
+	switch (tile) {
+	case TILE_SOLID: return SDL_TRUE;
+	case TILE_SLOPE: return up <= x;
+	case TILE_BUMPS: return up < 4 + (x / 4 % 2) * 4;
+	default: return SDL_FALSE;
+	}
+}
+
+/* Ground that wanders up and down by at most a tile per column around the middle of the map,
+ * with solid rock under a surface of slopes and bumps and empty sky above it. */
+static void make_terrain(ML2_Map *map) {
+	Uint32 state = 12345;
+	int ground = MAP_HEIGHT / 2;
+	for (int x = 0; x < MAP_WIDTH; ++x) {
+		ground = BenchMap_walk(&state, ground, 4, MAP_HEIGHT - 4);
+		Uint32 surface = BenchMap_random(&state);
+		for (int y = 0; y < MAP_HEIGHT; ++y) {
+			int tile = y < ground ? TILE_SOLID : y == ground ? TILE_SLOPE + (surface >> 29 & 1) : TILE_EMPTY;
+			ML2_Map_setTile(map, x, y, tile, surface >> 28 & SDL_FLIP_HORIZONTAL);
+		}
+	}
+}
+
+// Which kinds of tile a rectangle is over: all empty, all solid, or anything else.
+static int classify(ML2_Map *map, const SDL_Rect *r) {
+	int empty = 1, solid = 1;
+	for (int y = r->y / TILE_SIZE; y <= (r->y + r->h - 1) / TILE_SIZE; ++y) {
+		for (int x = r->x / TILE_SIZE; x <= (r->x + r->w - 1) / TILE_SIZE; ++x) {
+			int tile = ML2_Map_getTile(map, x, y, NULL);
+			int solidity = tile != -1 ? TileSheet_getSolidity(map->tiles, tile) : TILESHEET_TILE_EMPTY;
+			empty &= solidity == TILESHEET_TILE_EMPTY;
+			solid &= solidity == TILESHEET_TILE_SOLID;
+		}
+	}
+	return empty ? TILESHEET_TILE_EMPTY : solid ? TILESHEET_TILE_SOLID : TILESHEET_TILE_PARTIAL;
+}
+
+// Rectangles the size of the lander, moving a few pixels between frames.
+static double bench_queries(ML2_Map *map, const SDL_Rect *rects, int count, long *hits) {
+	*hits = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < count; ++i) {
+		*hits += ML2_Map_doCollision(map, &rects[2 * i], &rects[2 * i + 1]) != 0;
+	}
+	double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	return count / seconds;
+}
+
+// The same rectangles as bench_queries, split into one array per field
+static double bench_batch(ML2_Map *map, const SDL_Rect *rects, int count, int threads, long *hits) {
+	int *fields = SDL_malloc(sizeof(int) * 8 * (size_t) count);
+	Uint8 *results = SDL_malloc(count);
+	if (!fields || !results) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	int *f[8];
+	for (int i = 0; i < 8; ++i) f[i] = fields + (size_t) i * count;
+	for (int i = 0; i < count; ++i) {
+		for (int old = 0; old <= 1; ++old) {
+			const SDL_Rect *r = &rects[2 * i + old];
+			f[old * 4][i] = r->x, f[old * 4 + 1][i] = r->y, f[old * 4 + 2][i] = r->w, f[old * 4 + 3][i] = r->h;
+		}
+	}
+	ML2_Map_RectArrays cur = {f[0], f[1], f[2], f[3]}, old = {f[4], f[5], f[6], f[7]};
+	SDL_memset(results, 0, count); // so page faults aren't counted
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	ML2_Map_doCollisionBatch(map, &cur, &old, results, count, threads);
+	double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+	*hits = 0;
+	for (int i = 0; i < count; ++i) *hits += results[i] != 0;
+	SDL_free(fields);
+	SDL_free(results);
+	return count / seconds;
+}
+
+int main(int argc, char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 4000000;
+	if (count <= 0) {
+		fprintf(stderr, "Number of queries must be positive\n");
+		return 1;
+	}
+
+	SDL_Rect *rects = SDL_malloc(sizeof(SDL_Rect) * 2 * (size_t) count);
+	ML2_Map *map = rects ? BenchMap_create(MAP_WIDTH, MAP_HEIGHT, TILE_SIZE, TILE_TYPES, is_solid) : NULL;
+	if (!map) {
+		fprintf(stderr, "%s\n", rects ? SDL_GetError() : "Out of memory");
+		return 1;
+	}
+	make_terrain(map);
+
+	Uint32 state = 67890;
+	for (int i = 0; i < count; ++i) {
+		Uint32 random = BenchMap_random(&state);
+		SDL_Rect r = {random % (MAP_WIDTH * TILE_SIZE - 32), (random >> 12) % (MAP_HEIGHT * TILE_SIZE - 32), 12, 16};
+		rects[2 * i] = r;
+		rects[2 * i + 1] = (SDL_Rect) {r.x + (int) (random >> 28 & 7) - 3, r.y + (int) (random >> 25 & 7) - 3, r.w, r.h};
+	}
+
+	// How much of the work the solidity table can skip depends on this mix.
+	long mix[3] = {0};
+	for (int i = 0; i < count; ++i) ++mix[classify(map, &rects[2 * i])];
+
+	long hits;
+	printf("%d queries on a %dx%d map\n", count, MAP_WIDTH, MAP_HEIGHT);
+	printf(
+		"  over only empty tiles %.1f%%, only solid tiles %.1f%%, anything else %.1f%%\n",
+		100.0 * mix[TILESHEET_TILE_EMPTY] / count, 100.0 * mix[TILESHEET_TILE_SOLID] / count, 100.0 * mix[TILESHEET_TILE_PARTIAL] / count
+	);
+	double with_table = bench_queries(map, rects, count, &hits);
+	printf("  solidity table %14.0f queries/s (%ld hits)\n", with_table, hits);
+	for (int threads = 1; threads <= SDL_GetCPUCount(); threads *= 2) {
+		double batched = bench_batch(map, rects, count, threads, &hits);
+		printf("  batch, %2d %-6s %14.0f queries/s (%ld hits)\n", threads, threads == 1 ? "thread" : "threads", batched, hits);
+	}
+
+	/* Forcing every tile to partial makes the same code check the mask of every tile, like before
+	 * there was a table. This only simulates the old code, it doesn't run it. */
+	int tiles = map->tiles->sheet_width * map->tiles->sheet_height;
+	for (int i = 0; i < tiles; ++i) map->tiles->solidity[i] = TILESHEET_TILE_PARTIAL;
+	double without_table = bench_queries(map, rects, count, &hits);
+	printf("  masks only     %14.0f queries/s (%ld hits)\n", without_table, hits);
+	printf("  speedup        %14.2fx\n", with_table / without_table);
+	printf("  (masks only forces every tile to partially solid, simulating the code before the solidity table)\n");
+
+	ML2_Map_free(map);
+	SDL_free(rects);
+	return 0;
+}
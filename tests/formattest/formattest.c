@@ -0,0 +1,230 @@
+/* Checks that maps come back the same after being saved and loaded, for every layout of revision 3
+ * (flat, compressed, chunked, wide tiles and embedded tilesheets), and that hand-written
+ * revision 1 and 2 maps still load. Exits with a nonzero status if anything doesn't match.
+ * Run this from the root of the project so the built-in tilesheets can be found:
+ * tests/formattest/formattest */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "tiles.h"
+#include "map.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAILED: "); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		++failures; \
+	} \
+} while (0)
+
+static Uint32 next_random(Uint32 *state) {
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+// A map full of different tiles and flips, with a patch of empty tiles so chunked maps have empty chunks.
+static ML2_Map *make_map(Uint32 width, Uint32 height, Uint32 flags, int tilesheet_enum, TileSheet *tiles) {
+	ML2_Map params = {
+		.width = width,
+		.height = height,
+		.start_x = 7,
+		.start_y = 9,
+		.start_fuel = 1234,
+		.bgcolor = {10, 20, 30, 255},
+		.tilesheet_enum = tilesheet_enum,
+		.tiles = tiles,
+		.flags = flags
+	};
+	ML2_Map *map = ML2_Map_create(params, NULL);
+	if (!map) return NULL;
+
+	int max_tile = flags & ML2_MAP_WIDE_TILES ? ML2_MAP_MAX_WIDE_TILES : ML2_MAP_MAX_TILES;
+	Uint32 state = width * 31 + height;
+	for (Uint32 y = 0; y < height; ++y) {
+		for (Uint32 x = 0; x < width; ++x) {
+			if (x < width / 2 && y < height / 2) continue;
+			Uint32 random = next_random(&state);
+			ML2_Map_setTile(map, x, y, random % max_tile, random >> 20 & 3);
+		}
+	}
+	return map;
+}
+
+static void compare_maps(ML2_Map *expected, ML2_Map *actual) {
+	CHECK(actual->width == expected->width && actual->height == expected->height,
+		"size is %ux%u instead of %ux%u", actual->width, actual->height, expected->width, expected->height);
+	CHECK(actual->start_x == expected->start_x && actual->start_y == expected->start_y && actual->start_fuel == expected->start_fuel,
+		"start is (%u, %u) with %u fuel", actual->start_x, actual->start_y, actual->start_fuel);
+	CHECK(!SDL_memcmp(&actual->bgcolor, &expected->bgcolor, sizeof(SDL_Color)), "background color differs");
+	CHECK(actual->tilesheet_enum == expected->tilesheet_enum, "tilesheet is %d instead of %d", actual->tilesheet_enum, expected->tilesheet_enum);
+	if (actual->width != expected->width || actual->height != expected->height) return;
+
+	long wrong = 0;
+	for (Uint32 y = 0; y < expected->height; ++y) {
+		for (Uint32 x = 0; x < expected->width; ++x) {
+			int flip, expected_flip;
+			int tile = ML2_Map_getTile(actual, x, y, &flip);
+			int expected_tile = ML2_Map_getTile(expected, x, y, &expected_flip);
+			wrong += tile != expected_tile || flip != expected_flip;
+		}
+	}
+	CHECK(!wrong, "%ld tiles differ", wrong);
+}
+
+// Compare two tilesheets pixel by pixel, by transparency since that is all masks keep.
+static void compare_sheets(TileSheet *expected, TileSheet *actual) {
+	CHECK(actual->tile_width == expected->tile_width && actual->tile_height == expected->tile_height, "tile size differs");
+	CHECK(actual->sheet_width == expected->sheet_width && actual->sheet_height == expected->sheet_height, "tilesheet size differs");
+	if (actual->tile_width != expected->tile_width || actual->sheet_width != expected->sheet_width) return;
+
+	long wrong = 0;
+	for (int i = 0; i < expected->sheet_width * expected->sheet_height; ++i) {
+		for (int y = 0; y < expected->tile_height; ++y) {
+			for (int x = 0; x < expected->tile_width; ++x) {
+				wrong += TileSheet_isTransparent(actual, i, x, y) != TileSheet_isTransparent(expected, i, x, y);
+			}
+		}
+	}
+	CHECK(!wrong, "%ld pixels of the tilesheet differ", wrong);
+}
+
+// Save a map to memory, load it back, and check that nothing changed.
+static void round_trip(const char *name, ML2_Map *map) {
+	printf("%s\n", name);
+	if (!map) {
+		CHECK(0, "couldn't create map: %s", SDL_GetError());
+		return;
+	}
+
+	size_t size;
+	void *data = ML2_Map_serializeToMem(map, &size);
+	ML2_Map *loaded = data ? ML2_Map_loadFromMem(data, (int) size, NULL) : NULL;
+	if (!loaded) {
+		CHECK(0, "couldn't save and load map: %s", SDL_GetError());
+	} else {
+		CHECK(loaded->rev == 3, "loaded as revision %u", loaded->rev);
+		CHECK(loaded->flags == map->flags, "flags are %u instead of %u", loaded->flags, map->flags);
+		compare_maps(map, loaded);
+		if (!map->tilesheet_enum) compare_sheets(map->tiles, loaded->tiles);
+	}
+
+	ML2_Map_free(loaded);
+	SDL_free(data);
+	ML2_Map_free(map);
+}
+
+static void write_le32(Uint8 *p, Uint32 value) {
+	p[0] = value, p[1] = value >> 8, p[2] = value >> 16, p[3] = value >> 24;
+}
+
+/* Write a map of an old revision by hand: the header, an embedded bitmap if there is one,
+ * then one byte per tile with the flip in the top two bits. */
+static Uint8 *write_old_map(Uint32 rev, Uint32 width, Uint32 height, const void *bmp, size_t bmp_size, size_t *size) {
+	size_t header_size = rev < 2 ? 16 : 33;
+	size_t sheet_size = bmp ? 8 + bmp_size : 0;
+	*size = header_size + sheet_size + (size_t) width * height;
+	Uint8 *data = SDL_calloc(1, *size);
+	if (!data) return NULL;
+
+	SDL_memcpy(data, "ML2", 4);
+	write_le32(data + 4, rev);
+	write_le32(data + 8, width);
+	write_le32(data + 12, height);
+	if (rev >= 2) {
+		write_le32(data + 16, 7);
+		write_le32(data + 20, 9);
+		write_le32(data + 24, 1234);
+		data[28] = 10, data[29] = 20, data[30] = 30, data[31] = 255;
+		data[32] = bmp ? TILESHEET_CUSTOM : TILESHEET_MOON;
+	}
+	if (bmp) {
+		write_le32(data + header_size, 16);
+		write_le32(data + header_size + 4, 16);
+		SDL_memcpy(data + header_size + 8, bmp, bmp_size);
+	}
+
+	Uint8 *tiles = data + header_size + sheet_size;
+	Uint32 state = 12345;
+	for (size_t i = 0; i < (size_t) width * height; ++i) tiles[i] = next_random(&state);
+	return data;
+}
+
+// Load a hand-written map of an old revision and check its tiles and the values it should get.
+static void load_old(const char *name, Uint32 rev, const void *bmp, size_t bmp_size) {
+	printf("%s\n", name);
+	Uint32 width = 40, height = 30;
+	size_t size;
+	Uint8 *data = write_old_map(rev, width, height, bmp, bmp_size, &size);
+	ML2_Map *map = data ? ML2_Map_loadFromMem(data, (int) size, NULL) : NULL;
+	if (!map) {
+		CHECK(0, "couldn't load map: %s", SDL_GetError());
+		SDL_free(data);
+		return;
+	}
+
+	CHECK(map->rev == rev && !map->flags, "loaded as revision %u with flags %u", map->rev, map->flags);
+	CHECK(map->width == width && map->height == height, "size is %ux%u", map->width, map->height);
+	if (rev < 2) {
+		CHECK(map->start_x == 5 && map->start_y == 6 && map->start_fuel == 1000, "revision 1 defaults weren't used");
+	} else {
+		CHECK(map->start_x == 7 && map->start_y == 9 && map->start_fuel == 1234, "start is (%u, %u) with %u fuel", map->start_x, map->start_y, map->start_fuel);
+	}
+	CHECK(map->tilesheet_enum == (bmp ? TILESHEET_CUSTOM : TILESHEET_MOON), "tilesheet is %d", map->tilesheet_enum);
+
+	const Uint8 *tiles = data + size - (size_t) width * height;
+	long wrong = 0;
+	for (Uint32 y = 0; y < height; ++y) {
+		for (Uint32 x = 0; x < width; ++x) {
+			int flip, tile = ML2_Map_getTile(map, x, y, &flip);
+			Uint8 expected = tiles[(size_t) y * width + x];
+			wrong += tile != (expected & 0x3F) || flip != expected >> 6;
+		}
+	}
+	CHECK(!wrong, "%ld tiles differ", wrong);
+
+	// Saving always uses the latest revision.
+	round_trip("  saved again as revision 3", map);
+	SDL_free(data);
+}
+
+int main(void) {
+	size_t bmp_size;
+	void *bmp = SDL_LoadFile(TILESHEET_PATHS[TILESHEET_MOON], &bmp_size);
+	TileSheet *sheet = TileSheet_create(TILESHEET_PATHS[TILESHEET_MOON], NULL, 16, 16, TILESHEET_CREATESURFACE);
+	if (!bmp || !sheet) {
+		fprintf(stderr, "%s (run this from the root of the project)\n", SDL_GetError());
+		return 1;
+	}
+
+	round_trip("revision 3, flat", make_map(100, 70, 0, TILESHEET_MOON, NULL));
+	round_trip("revision 3, compressed", make_map(100, 70, ML2_MAP_COMPRESSED, TILESHEET_MOON, NULL));
+	round_trip("revision 3, chunked", make_map(300, 130, ML2_MAP_CHUNKED, TILESHEET_MOON, NULL));
+	round_trip("revision 3, chunked with wide tiles", make_map(300, 130, ML2_MAP_CHUNKED | ML2_MAP_WIDE_TILES, TILESHEET_MOON, NULL));
+	round_trip("revision 3, compressed with wide tiles", make_map(100, 70, ML2_MAP_COMPRESSED | ML2_MAP_WIDE_TILES, TILESHEET_MOON, NULL));
+	round_trip("revision 3, wrapping", make_map(100, 70, ML2_MAP_WRAP_X, TILESHEET_MOON, NULL));
+
+	// Maps free their tilesheet, so each one gets its own reference.
+	round_trip("revision 3, embedded bitmap", make_map(100, 70, 0, TILESHEET_CUSTOM, TileSheet_retain(sheet)));
+	round_trip("revision 3, embedded raw pixels", make_map(100, 70, ML2_MAP_RAW_SHEET, TILESHEET_CUSTOM, TileSheet_retain(sheet)));
+	round_trip("revision 3, chunked with embedded bitmap", make_map(300, 130, ML2_MAP_CHUNKED, TILESHEET_CUSTOM, TileSheet_retain(sheet)));
+	TileSheet_destroy(sheet);
+
+	load_old("revision 1", 1, NULL, 0);
+	load_old("revision 2, built-in tilesheet", 2, NULL, 0);
+	load_old("revision 2, embedded bitmap", 2, bmp, bmp_size);
+
+	SDL_free(bmp);
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All maps matched\n");
+	return 0;
+}
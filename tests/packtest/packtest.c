@@ -0,0 +1,165 @@
+/* Checks that maps come back the same after being saved to a map pack and loaded from it,
+ * that a tilesheet shared by several maps is only stored once and loaded once,
+ * and that a pack that fails to save leaves the old one alone.
+ * Exits with a nonzero status if anything doesn't match.
+ * Run this from the root of the project so the built-in tilesheets can be found:
+ * tests/packtest/packtest */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "tiles.h"
+#include "map.h"
+#include "pack.h"
+
+#define PACK_PATH "packtest.ml2pack"
+#define MAP_COUNT 3
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAILED: "); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		++failures; \
+	} \
+} while (0)
+
+static Uint32 next_random(Uint32 *state) {
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+static ML2_Map *make_map(Uint32 width, Uint32 height, int tilesheet_enum, TileSheet *tiles) {
+	ML2_Map params = {
+		.width = width,
+		.height = height,
+		.start_fuel = 1000,
+		.tilesheet_enum = tilesheet_enum,
+		.tiles = tiles
+	};
+	ML2_Map *map = ML2_Map_create(params, NULL);
+	if (!map) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		exit(1);
+	}
+
+	Uint32 state = width * 31 + height;
+	for (Uint32 y = 0; y < height; ++y) {
+		for (Uint32 x = 0; x < width; ++x) {
+			Uint32 random = next_random(&state);
+			ML2_Map_setTile(map, x, y, random % ML2_MAP_MAX_TILES, random >> 20 & 3);
+		}
+	}
+	return map;
+}
+
+static void compare_maps(ML2_Map *expected, ML2_Map *actual) {
+	CHECK(actual->width == expected->width && actual->height == expected->height, "size is %ux%u", actual->width, actual->height);
+	CHECK(actual->tilesheet_enum == expected->tilesheet_enum, "tilesheet is %d instead of %d", actual->tilesheet_enum, expected->tilesheet_enum);
+	if (actual->width != expected->width || actual->height != expected->height) return;
+
+	long wrong = 0;
+	for (Uint32 y = 0; y < expected->height; ++y) {
+		for (Uint32 x = 0; x < expected->width; ++x) {
+			int flip, expected_flip;
+			wrong += ML2_Map_getTile(actual, x, y, &flip) != ML2_Map_getTile(expected, x, y, &expected_flip) || flip != expected_flip;
+		}
+	}
+	CHECK(!wrong, "%ld tiles differ", wrong);
+
+	TileSheet *a = actual->tiles, *b = expected->tiles;
+	CHECK(a->tile_width == b->tile_width && a->sheet_width == b->sheet_width && a->sheet_height == b->sheet_height, "tilesheet size differs");
+	if (a->tile_width != b->tile_width || a->sheet_width != b->sheet_width || a->sheet_height != b->sheet_height) return;
+	wrong = 0;
+	for (int i = 0; i < b->sheet_width * b->sheet_height; ++i) {
+		for (int y = 0; y < b->tile_height; ++y) {
+			for (int x = 0; x < b->tile_width; ++x) {
+				wrong += TileSheet_isTransparent(a, i, x, y) != TileSheet_isTransparent(b, i, x, y);
+			}
+		}
+	}
+	CHECK(!wrong, "%ld pixels of the tilesheet differ", wrong);
+}
+
+static size_t saved_size(ML2_Map *map) {
+	size_t size = 0;
+	SDL_free(ML2_Map_serializeToMem(map, &size));
+	return size;
+}
+
+int main(void) {
+	TileSheet *sheet = TileSheet_create(TILESHEET_PATHS[TILESHEET_MOON], NULL, 16, 16, TILESHEET_CREATESURFACE);
+	if (!sheet) {
+		fprintf(stderr, "%s (run this from the root of the project)\n", SDL_GetError());
+		return 1;
+	}
+
+	// Two maps with the same embedded tilesheet, and one with a built-in one
+	const char *names[MAP_COUNT] = {"first", "second", "built-in"};
+	ML2_Map *maps[MAP_COUNT] = {
+		make_map(60, 40, TILESHEET_CUSTOM, TileSheet_retain(sheet)),
+		make_map(80, 30, TILESHEET_CUSTOM, sheet),
+		make_map(50, 50, TILESHEET_MOON, NULL)
+	};
+
+	printf("saving\n");
+	if (!ML2_Pack_save(PACK_PATH, MAP_COUNT, names, maps)) {
+		printf("  FAILED: couldn't save pack: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	// The second copy of the tilesheet is left out, so the pack is smaller than the first two maps saved on their own.
+	SDL_RWops *file = SDL_RWFromFile(PACK_PATH, "rb");
+	Sint64 pack_size = file ? SDL_RWsize(file) : -1;
+	if (file) SDL_RWclose(file);
+	size_t separate = saved_size(maps[0]) + saved_size(maps[1]);
+	CHECK(pack_size > 0 && (size_t) pack_size < separate, "pack is %ld bytes, the maps with embedded tilesheets are %zu on their own", (long) pack_size, separate);
+
+	printf("loading\n");
+	ML2_Pack *pack = ML2_Pack_open(PACK_PATH);
+	if (!pack) {
+		printf("  FAILED: couldn't open pack: %s\n", SDL_GetError());
+		remove(PACK_PATH);
+		return 1;
+	}
+	CHECK(ML2_Pack_getMapCount(pack) == MAP_COUNT, "pack has %d maps", ML2_Pack_getMapCount(pack));
+	ML2_Map *loaded[MAP_COUNT] = {0};
+	for (int i = 0; i < MAP_COUNT; ++i) {
+		const char *name = ML2_Pack_getMapName(pack, i);
+		CHECK(name && !SDL_strcmp(name, names[i]), "map %d is called %s instead of %s", i, name ? name : "nothing", names[i]);
+		loaded[i] = ML2_Pack_loadMap(pack, names[i], NULL);
+		if (!loaded[i]) CHECK(0, "couldn't load %s: %s", names[i], SDL_GetError());
+		else compare_maps(maps[i], loaded[i]);
+	}
+	CHECK(!ML2_Pack_loadMap(pack, "missing", NULL), "loaded a map that isn't in the pack");
+	CHECK(loaded[0] && loaded[1] && loaded[0]->tiles == loaded[1]->tiles, "maps with the same tilesheet didn't share it");
+	ML2_Pack_close(pack);
+
+	// Maps outlive their pack.
+	if (loaded[0]) CHECK(ML2_Map_getTile(loaded[0], 1, 1, NULL) == ML2_Map_getTile(maps[0], 1, 1, NULL), "map changed after closing the pack");
+
+	printf("failing to save\n");
+	const char *bad_names[MAP_COUNT] = {"first", "first", "built-in"};
+	CHECK(!ML2_Pack_save(PACK_PATH, MAP_COUNT, bad_names, maps), "saved a pack with two maps of the same name");
+	pack = ML2_Pack_open(PACK_PATH);
+	CHECK(pack && ML2_Pack_getMapCount(pack) == MAP_COUNT, "the old pack was damaged");
+	ML2_Pack_close(pack);
+
+	for (int i = 0; i < MAP_COUNT; ++i) {
+		ML2_Map_free(maps[i]);
+		ML2_Map_free(loaded[i]);
+	}
+	remove(PACK_PATH);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All maps matched\n");
+	return 0;
+}
@@ -0,0 +1,119 @@
+/* Measures how many rays per second can be cast across a large map, one at a time
+ * and in batches, from points in the sky in random directions.
+ * The terrain is full of thin poles, ledges and overhangs, so most rays travel a long way before they hit.
+ * Usage: raybench [map width in tiles] [number of rays] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+#include "benchmap.h"
+
+#define TILE_SIZE 16
+#define MAP_HEIGHT 512
+#define MAX_DISTANCE 2048.0f
+#define BATCH_SIZE 256
+
+enum { TILE_EMPTY, TILE_SOLID, TILE_POLE, TILE_LEDGE, TILE_DIAGONAL, TILE_TYPES };
+
+/* Tiles that are hard to hit: besides empty and solid ones, a pole and a ledge one pixel thick
+ * and a one pixel diagonal line, which rays mostly pass right next to. */
+static SDL_bool is_solid(int tile, int x, int up) {
+	switch (tile) {
+	case TILE_SOLID: return SDL_TRUE;
+	case TILE_POLE: return x == TILE_SIZE / 2;
+	case TILE_LEDGE: return up == TILE_SIZE - 1;
+	case TILE_DIAGONAL: return up == x;
+	default: return SDL_FALSE;
+	}
+}
+
+/* Ground with a diagonal surface, poles standing on it, and ledges and blocks floating in the sky,
+ * so rays thread between thin features and pass under overhangs instead of flying straight into the ground. */
+static void make_terrain(ML2_Map *map) {
+	Uint32 state = 12345;
+	int ground = MAP_HEIGHT / 4;
+	for (Uint32 x = 0; x < map->width; ++x) {
+		ground = BenchMap_walk(&state, ground, 4, MAP_HEIGHT / 2);
+		
+		// Poles are up to eight tiles tall, on about one column in four.
+		int pole = BenchMap_random(&state) >> 30 ? 0 : (int) (state >> 27 & 7) + 1;
+		for (int y = 0; y < MAP_HEIGHT; ++y) {
+			int tile = y < ground ? TILE_SOLID : y == ground ? TILE_DIAGONAL : y <= ground + pole ? TILE_POLE : TILE_EMPTY;
+			ML2_Map_setTile(map, x, y, tile, state >> 26 & SDL_FLIP_HORIZONTAL);
+		}
+	}
+	
+	// Ledges up to 32 tiles long with a solid block at one end, about one for every eight columns.
+	for (Uint32 i = 0; i < map->width / 8; ++i) {
+		Uint32 x = BenchMap_random(&state) % map->width;
+		int y = MAP_HEIGHT / 2 + 2 + (int) (BenchMap_random(&state) % (MAP_HEIGHT / 2 - 4));
+		Uint32 length = (BenchMap_random(&state) >> 27) + 1;
+		for (Uint32 j = 0; j < length && x + j < map->width; ++j) {
+			ML2_Map_setTile(map, x + j, y, j ? TILE_LEDGE : TILE_SOLID, 0);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int width = argc > 1 ? atoi(argv[1]) : 16384;
+	int count = argc > 2 ? atoi(argv[2]) : 1000000;
+	if (width <= 0 || count <= 0) {
+		fprintf(stderr, "Map width and number of rays must be positive\n");
+		return 1;
+	}
+
+	float *fields = SDL_malloc(sizeof(float) * 4 * (size_t) count);
+	ML2_Map_RayHit *hits = SDL_malloc(sizeof(ML2_Map_RayHit) * (size_t) count);
+	if (!fields || !hits) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	ML2_Map *map = BenchMap_create(width, MAP_HEIGHT, TILE_SIZE, TILE_TYPES, is_solid);
+	if (!map) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		return 1;
+	}
+	make_terrain(map);
+
+	// Starting points are in the upper half of the map, among the ledges.
+	ML2_Map_RayArrays rays = {fields, fields + count, fields + 2 * (size_t) count, fields + 3 * (size_t) count};
+	float *x = fields, *y = fields + count, *dir_x = fields + 2 * (size_t) count, *dir_y = fields + 3 * (size_t) count;
+	Uint32 state = 67890;
+	for (int i = 0; i < count; ++i) {
+		x[i] = (float) (BenchMap_random(&state) % ((Uint32) width * TILE_SIZE));
+		y[i] = MAP_HEIGHT * TILE_SIZE / 2 + (float) (BenchMap_random(&state) % (MAP_HEIGHT * TILE_SIZE / 2));
+		float angle = (BenchMap_random(&state) >> 8) / (float) (1 << 24) * 2.0f * (float) M_PI;
+		dir_x[i] = SDL_cosf(angle);
+		dir_y[i] = SDL_sinf(angle);
+	}
+
+	printf("%d rays on a %dx%d map, up to %.0f pixels long\n", count, width, MAP_HEIGHT, MAX_DISTANCE);
+
+	long hit_count = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < count; ++i) {
+		hit_count += ML2_Map_raycast(map, x[i], y[i], dir_x[i], dir_y[i], MAX_DISTANCE, &hits[i]);
+	}
+	double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	printf("  one at a time  %14.0f rays/s (%ld hits)\n", count / seconds, hit_count);
+
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < count; i += BATCH_SIZE) {
+		ML2_Map_RayArrays batch = {rays.x + i, rays.y + i, rays.dir_x + i, rays.dir_y + i};
+		ML2_Map_raycastBatch(map, &batch, MAX_DISTANCE, hits + i, SDL_min(BATCH_SIZE, count - i));
+	}
+	seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	hit_count = 0;
+	for (int i = 0; i < count; ++i) hit_count += hits[i].hit;
+	printf("  batches of %-3d %14.0f rays/s (%ld hits)\n", BATCH_SIZE, count / seconds, hit_count);
+
+	ML2_Map_free(map);
+	SDL_free(fields);
+	SDL_free(hits);
+	return 0;
+}
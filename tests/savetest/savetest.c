@@ -0,0 +1,148 @@
+/* Checks that saving a map replaces the file all at once: the saved map loads back the same,
+ * saving from several threads at once leaves one whole map, an existing file keeps its permissions,
+ * no temporary files are left behind, and a save that fails leaves what was there alone.
+ * Exits with a nonzero status if anything doesn't match.
+ * Run this from the root of the project so the built-in tilesheets can be found:
+ * tests/savetest/savetest */
+
+// Required for chmod, mkdir and friends, since the project is built with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX_IO
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "tilesheet.h"
+#include "tiles.h"
+#include "map.h"
+
+#define MAP_PATH "savetest.ml2"
+#define DIR_PATH "savetest-dir.ml2"
+#define SAVER_COUNT 4
+#define SAVES_PER_THREAD 25
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAILED: "); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		++failures; \
+	} \
+} while (0)
+
+static ML2_Map *make_map(void) {
+	ML2_Map params = {.width = 120, .height = 80, .start_fuel = 1000, .tilesheet_enum = TILESHEET_MOON};
+	ML2_Map *map = ML2_Map_create(params, NULL);
+	if (!map) return NULL;
+
+	Uint32 state = 12345;
+	for (Uint32 y = 0; y < params.height; ++y) {
+		for (Uint32 x = 0; x < params.width; ++x) {
+			state = state * 1664525 + 1013904223;
+			ML2_Map_setTile(map, x, y, (state >> 8) % ML2_MAP_MAX_TILES, state >> 28 & 3);
+		}
+	}
+	return map;
+}
+
+// Whether the map saved at MAP_PATH is the same as map
+static SDL_bool saved_correctly(ML2_Map *map) {
+	ML2_Map *loaded = ML2_Map_loadFromFile(MAP_PATH, NULL);
+	if (!loaded) return SDL_FALSE;
+	SDL_bool same = loaded->width == map->width && loaded->height == map->height;
+	for (Uint32 y = 0; same && y < map->height; ++y) {
+		for (Uint32 x = 0; same && x < map->width; ++x) {
+			int flip, expected_flip;
+			same = ML2_Map_getTile(loaded, x, y, &flip) == ML2_Map_getTile(map, x, y, &expected_flip) && flip == expected_flip;
+		}
+	}
+	ML2_Map_free(loaded);
+	return same;
+}
+
+static int saver(void *map) {
+	for (int i = 0; i < SAVES_PER_THREAD; ++i) {
+		if (!ML2_Map_save(map, MAP_PATH)) return 1;
+	}
+	return 0;
+}
+
+#ifdef HAVE_POSIX_IO
+// Number of files next to the saved map that were left over from saving it
+static int leftover_files(void) {
+	DIR *dir = opendir(".");
+	if (!dir) return -1;
+	int count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		count += !SDL_strncmp(entry->d_name, MAP_PATH ".", sizeof(MAP_PATH)) || !SDL_strncmp(entry->d_name, DIR_PATH ".", sizeof(DIR_PATH));
+	}
+	closedir(dir);
+	return count;
+}
+#endif
+
+int main(void) {
+	ML2_Map *map = make_map();
+	if (!map) {
+		fprintf(stderr, "%s (run this from the root of the project, where %s is)\n", SDL_GetError(), TILESHEET_PATHS[TILESHEET_MOON]);
+		return 1;
+	}
+
+	printf("saving\n");
+	remove(MAP_PATH);
+	CHECK(ML2_Map_save(map, MAP_PATH), "couldn't save map: %s", SDL_GetError());
+	CHECK(saved_correctly(map), "the saved map is different");
+
+#ifdef HAVE_POSIX_IO
+	printf("keeping permissions\n");
+	chmod(MAP_PATH, 0640);
+	CHECK(ML2_Map_save(map, MAP_PATH), "couldn't save map: %s", SDL_GetError());
+	struct stat st;
+	CHECK(!stat(MAP_PATH, &st) && (st.st_mode & 0777) == 0640, "permissions changed to %o", (unsigned) (st.st_mode & 0777));
+#endif
+
+	printf("saving from %d threads at once\n", SAVER_COUNT);
+	SDL_Thread *threads[SAVER_COUNT];
+	for (int i = 0; i < SAVER_COUNT; ++i) threads[i] = SDL_CreateThread(saver, "saver", map);
+	for (int i = 0; i < SAVER_COUNT; ++i) {
+		int status = 1;
+		if (threads[i]) SDL_WaitThread(threads[i], &status);
+		CHECK(!status, "a save failed: %s", SDL_GetError());
+	}
+	CHECK(saved_correctly(map), "the saved map is different");
+
+#ifdef HAVE_POSIX_IO
+	// A directory can't be replaced by a file, so this save fails after writing the new file.
+	printf("failing to save\n");
+	mkdir(DIR_PATH, 0755);
+	FILE *kept = fopen(DIR_PATH "/kept", "w");
+	if (kept) fclose(kept);
+	CHECK(!ML2_Map_save(map, DIR_PATH), "replaced a directory");
+	CHECK(!access(DIR_PATH "/kept", F_OK), "the directory that was saved over was damaged");
+	remove(DIR_PATH "/kept");
+	rmdir(DIR_PATH);
+
+	CHECK(!leftover_files(), "%d temporary files were left behind", leftover_files());
+#endif
+
+	remove(MAP_PATH);
+	ML2_Map_free(map);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All saves worked\n");
+	return 0;
+}
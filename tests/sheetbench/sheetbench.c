@@ -0,0 +1,89 @@
+/* Compares how long maps take to load with a large custom tilesheet
+ * stored as a bitmap and as raw pixels.
+ * Usage: sheetbench [sheet size in pixels] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+
+#define ITERATIONS 20
+
+// Fill a sheet with noise, with some of it transparent so the color key has work to do.
+static SDL_Surface *make_sheet(int size) {
+	SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, size, size, 24, SDL_PIXELFORMAT_RGB24);
+	if (!surface) return NULL;
+	Uint32 state = 12345;
+	for (int y = 0; y < size; ++y) {
+		Uint8 *p = (Uint8 *) surface->pixels + y * surface->pitch;
+		for (int x = 0; x < size; ++x, p += 3) {
+			state = state * 1664525 + 1013904223;
+			if (state >> 30 == 0) {
+				p[0] = 0, p[1] = 255, p[2] = 0;
+			} else {
+				p[0] = state >> 8, p[1] = state >> 16, p[2] = state >> 24;
+			}
+		}
+	}
+	return surface;
+}
+
+static double bench_load(void *file, size_t size, SDL_Renderer *renderer) {
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < ITERATIONS; ++i) {
+		// Freeing the map drops the last reference to its sheet, so every load decodes it again.
+		ML2_Map *map = ML2_Map_loadFromMem(file, size, renderer);
+		if (!map) {
+			fprintf(stderr, "%s\n", SDL_GetError());
+			exit(1);
+		}
+		ML2_Map_free(map);
+	}
+	return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() / ITERATIONS * 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+	int sheet_size = argc > 1 ? atoi(argv[1]) : 2048;
+
+	SDL_Surface *target = SDL_CreateRGBSurfaceWithFormat(0, 1, 1, 32, SDL_PIXELFORMAT_RGBA32);
+	SDL_Renderer *renderer = target ? SDL_CreateSoftwareRenderer(target) : NULL;
+	SDL_Surface *sheet = make_sheet(sheet_size);
+	if (!renderer || !sheet) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		return 1;
+	}
+
+	ML2_Map params = {
+		.width = 64,
+		.height = 64,
+		.tiles = TileSheet_createFromSurface(sheet, NULL, 16, 16, TILESHEET_CREATESURFACE | TILESHEET_FREESURFACE),
+		.tilesheet_enum = 0
+	};
+	ML2_Map *map = ML2_Map_create(params, renderer);
+	if (!map) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		return 1;
+	}
+
+	printf("%dx%d sheet, average of %d loads\n", sheet_size, sheet_size, ITERATIONS);
+	const char *names[] = {"bitmap", "raw"};
+	for (int raw = 0; raw <= 1; ++raw) {
+		map->flags = raw ? ML2_MAP_RAW_SHEET : 0;
+		size_t size;
+		void *file = ML2_Map_serializeToMem(map, &size);
+		if (!file) {
+			fprintf(stderr, "%s\n", SDL_GetError());
+			return 1;
+		}
+		printf("  %-6s %10zu bytes %10.2f ms\n", names[raw], size, bench_load(file, size, renderer));
+		SDL_free(file);
+	}
+
+	ML2_Map_free(map);
+	SDL_DestroyRenderer(renderer);
+	SDL_FreeSurface(target);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/* Measures how long it takes to find every overlapping pair among thousands of objects
+ * moving around a map, by checking every pair, by rebuilding a spatial hash each frame,
+ * and by moving the objects in a spatial hash that is kept between frames.
+ * Usage: spatialbench [number of objects] [number of frames] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "map.h"
+#include "spatialhash.h"
+
+#define TILE_SIZE 16
+#define MAP_WIDTH 256
+#define MAP_HEIGHT 64
+#define MIN_SIZE 4
+#define MAX_SIZE 20
+#define MAX_SPEED 3
+// Checking every pair is slow, so it only runs for a few frames.
+#define BRUTE_FRAMES 5
+#define QUERY_COUNT 1000
+#define QUERY_W 320
+#define QUERY_H 240
+
+typedef struct {
+	SDL_Rect rect;
+	int dx, dy;
+} Object;
+
+static Uint32 next_random(Uint32 *state) {
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+// Objects start scattered over the map with random sizes and velocities.
+static void spawn(Object *objects, int count) {
+	Uint32 state = 12345;
+	for (int i = 0; i < count; ++i) {
+		int w = MIN_SIZE + next_random(&state) % (MAX_SIZE - MIN_SIZE + 1);
+		int h = MIN_SIZE + next_random(&state) % (MAX_SIZE - MIN_SIZE + 1);
+		objects[i].rect = (SDL_Rect) {
+			next_random(&state) % (MAP_WIDTH * TILE_SIZE - w),
+			next_random(&state) % (MAP_HEIGHT * TILE_SIZE - h),
+			w, h
+		};
+		objects[i].dx = (int) (next_random(&state) % (2 * MAX_SPEED + 1)) - MAX_SPEED;
+		objects[i].dy = (int) (next_random(&state) % (2 * MAX_SPEED + 1)) - MAX_SPEED;
+	}
+}
+
+// Every object moves in a straight line, bouncing off the edges of the map.
+static void step(Object *objects, int count) {
+	for (int i = 0; i < count; ++i) {
+		SDL_Rect *r = &objects[i].rect;
+		r->x += objects[i].dx;
+		r->y += objects[i].dy;
+		if (r->x < 0 || r->x + r->w > MAP_WIDTH * TILE_SIZE) {
+			objects[i].dx = -objects[i].dx;
+			r->x += 2 * objects[i].dx;
+		}
+		if (r->y < 0 || r->y + r->h > MAP_HEIGHT * TILE_SIZE) {
+			objects[i].dy = -objects[i].dy;
+			r->y += 2 * objects[i].dy;
+		}
+	}
+}
+
+static void count_pair(int a, int b, void *userdata) {
+	(void) a, (void) b;
+	++*(long *) userdata;
+}
+
+static long brute_pairs(const Object *objects, int count) {
+	long pairs = 0;
+	for (int a = 0; a < count; ++a) {
+		for (int b = a + 1; b < count; ++b) {
+			pairs += SDL_HasIntersection(&objects[a].rect, &objects[b].rect);
+		}
+	}
+	return pairs;
+}
+
+static void report(const char *name, int frames, long pairs, Uint64 start) {
+	double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	printf("  %-12s %10.3f ms/frame (%ld pairs)\n", name, seconds * 1000.0 / frames, pairs);
+}
+
+int main(int argc, char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 10000;
+	int frames = argc > 2 ? atoi(argv[2]) : 500;
+	if (count <= 0 || frames <= 0) {
+		fprintf(stderr, "Number of objects and frames must be positive\n");
+		return 1;
+	}
+
+	Object *objects = SDL_malloc(sizeof(Object) * (size_t) count);
+	if (!objects) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	// The hash only reads the tile size and width of the map, so neither needs anything loaded.
+	TileSheet tiles = {.tile_width = TILE_SIZE, .tile_height = TILE_SIZE};
+	ML2_Map map = {.width = MAP_WIDTH, .height = MAP_HEIGHT, .tiles = &tiles};
+	ML2_SpatialHash *hash = ML2_SpatialHash_create(&map, count);
+	if (!hash) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		return 1;
+	}
+
+	printf("%d objects on a %dx%d map\n", count, MAP_WIDTH, MAP_HEIGHT);
+
+	// Every run starts from the same objects, so they all find the same pairs.
+	int brute_frames = SDL_min(frames, BRUTE_FRAMES);
+	long pairs = 0;
+	spawn(objects, count);
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int frame = 0; frame < brute_frames; ++frame) {
+		step(objects, count);
+		pairs += brute_pairs(objects, count);
+	}
+	report("every pair", brute_frames, pairs, start);
+
+	long hashed_pairs = 0;
+	spawn(objects, count);
+	start = SDL_GetPerformanceCounter();
+	for (int frame = 0; frame < frames; ++frame) {
+		step(objects, count);
+		ML2_SpatialHash_clear(hash);
+		for (int i = 0; i < count; ++i) ML2_SpatialHash_set(hash, i, &objects[i].rect);
+		ML2_SpatialHash_forEachPair(hash, count_pair, &hashed_pairs);
+		if (frame == brute_frames - 1 && hashed_pairs != pairs) {
+			fprintf(stderr, "Spatial hash found %ld pairs instead of %ld\n", hashed_pairs, pairs);
+			return 1;
+		}
+	}
+	report("rebuilt", frames, hashed_pairs, start);
+
+	hashed_pairs = 0;
+	spawn(objects, count);
+	ML2_SpatialHash_clear(hash);
+	start = SDL_GetPerformanceCounter();
+	for (int frame = 0; frame < frames; ++frame) {
+		step(objects, count);
+		for (int i = 0; i < count; ++i) ML2_SpatialHash_set(hash, i, &objects[i].rect);
+		ML2_SpatialHash_forEachPair(hash, count_pair, &hashed_pairs);
+	}
+	report("incremental", frames, hashed_pairs, start);
+
+	// Screen-sized regions, as if looking for what is visible
+	int *ids = SDL_malloc(sizeof(int) * (size_t) count);
+	if (!ids) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	Uint32 state = 67890;
+	long found = 0;
+	start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < QUERY_COUNT; ++i) {
+		SDL_Rect region = {
+			next_random(&state) % (MAP_WIDTH * TILE_SIZE - QUERY_W),
+			next_random(&state) % (MAP_HEIGHT * TILE_SIZE - QUERY_H),
+			QUERY_W, QUERY_H
+		};
+		found += ML2_SpatialHash_query(hash, &region, ids, count);
+	}
+	double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	printf("  %dx%d regions %8.3f us/query (%.1f objects each)\n", QUERY_W, QUERY_H, seconds * 1e6 / QUERY_COUNT, (double) found / QUERY_COUNT);
+
+	SDL_free(ids);
+	ML2_SpatialHash_destroy(hash);
+	SDL_free(objects);
+	return 0;
+}
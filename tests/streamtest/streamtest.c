@@ -0,0 +1,196 @@
+/* Checks that maps load the same from a stream that can't seek or tell its size, like a pipe,
+ * as they do from memory. The stream also returns fewer bytes than asked for, like pipes often do.
+ * Exits with a nonzero status if anything doesn't match.
+ * Run this from the root of the project so the built-in tilesheets can be found:
+ * tests/streamtest/streamtest */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "tilesheet.h"
+#include "tiles.h"
+#include "map.h"
+
+// Most bytes a single read from the stream returns
+#define PIPE_READ 7
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("  FAILED: "); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		++failures; \
+	} \
+} while (0)
+
+typedef struct {
+	const Uint8 *data;
+	size_t size, pos;
+} Pipe;
+
+static Sint64 SDLCALL pipe_size(SDL_RWops *rw) {
+	(void) rw;
+	return -1;
+}
+
+static Sint64 SDLCALL pipe_seek(SDL_RWops *rw, Sint64 offset, int whence) {
+	(void) rw, (void) offset, (void) whence;
+	return SDL_SetError("Can't seek in a pipe");
+}
+
+static size_t SDLCALL pipe_read(SDL_RWops *rw, void *ptr, size_t size, size_t maxnum) {
+	Pipe *pipe = rw->hidden.unknown.data1;
+	size_t bytes = SDL_min(SDL_min(size * maxnum, PIPE_READ), pipe->size - pipe->pos);
+	bytes -= bytes % size;
+	SDL_memcpy(ptr, pipe->data + pipe->pos, bytes);
+	pipe->pos += bytes;
+	return bytes / size;
+}
+
+static size_t SDLCALL pipe_write(SDL_RWops *rw, const void *ptr, size_t size, size_t num) {
+	(void) rw, (void) ptr, (void) size, (void) num;
+	SDL_SetError("Can't write to this pipe");
+	return 0;
+}
+
+static int SDLCALL pipe_close(SDL_RWops *rw) {
+	SDL_FreeRW(rw);
+	return 0;
+}
+
+static SDL_RWops *open_pipe(Pipe *pipe) {
+	SDL_RWops *rw = SDL_AllocRW();
+	if (!rw) return NULL;
+	rw->size = pipe_size;
+	rw->seek = pipe_seek;
+	rw->read = pipe_read;
+	rw->write = pipe_write;
+	rw->close = pipe_close;
+	rw->type = SDL_RWOPS_UNKNOWN;
+	rw->hidden.unknown.data1 = pipe;
+	return rw;
+}
+
+static Uint32 next_random(Uint32 *state) {
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+static ML2_Map *make_map(Uint32 flags, int tilesheet_enum, TileSheet *tiles) {
+	ML2_Map params = {
+		.width = 200,
+		.height = 90,
+		.start_fuel = 1000,
+		.tilesheet_enum = tilesheet_enum,
+		.tiles = tiles,
+		.flags = flags
+	};
+	ML2_Map *map = ML2_Map_create(params, NULL);
+	if (!map) return NULL;
+
+	Uint32 state = 12345;
+	for (Uint32 y = 0; y < params.height; ++y) {
+		for (Uint32 x = 0; x < params.width; ++x) {
+			Uint32 random = next_random(&state);
+			ML2_Map_setTile(map, x, y, random % ML2_MAP_MAX_TILES, random >> 20 & 3);
+		}
+	}
+	return map;
+}
+
+static void compare_maps(ML2_Map *expected, ML2_Map *actual) {
+	CHECK(actual->width == expected->width && actual->height == expected->height, "size is %ux%u", actual->width, actual->height);
+	CHECK(actual->flags == expected->flags, "flags are %u instead of %u", actual->flags, expected->flags);
+	if (actual->width != expected->width || actual->height != expected->height) return;
+
+	long wrong = 0;
+	for (Uint32 y = 0; y < expected->height; ++y) {
+		for (Uint32 x = 0; x < expected->width; ++x) {
+			int flip, expected_flip;
+			wrong += ML2_Map_getTile(actual, x, y, &flip) != ML2_Map_getTile(expected, x, y, &expected_flip) || flip != expected_flip;
+		}
+	}
+	CHECK(!wrong, "%ld tiles differ", wrong);
+
+	TileSheet *a = actual->tiles, *b = expected->tiles;
+	CHECK(a->tile_width == b->tile_width && a->sheet_width == b->sheet_width && a->sheet_height == b->sheet_height, "tilesheet differs");
+}
+
+// Load a saved map through a pipe and from memory, and check both give the same map.
+static void stream(const char *name, const Uint8 *data, size_t size) {
+	printf("%s\n", name);
+	Pipe pipe = {data, size, 0};
+	SDL_RWops *rw = open_pipe(&pipe);
+	ML2_Map *streamed = rw ? ML2_Map_loadFromRWops(rw, SDL_TRUE, NULL) : NULL;
+	ML2_Map *loaded = ML2_Map_loadFromMem((void *) data, (int) size, NULL);
+	if (!streamed || !loaded) {
+		CHECK(0, "couldn't load map %s: %s", streamed ? "from memory" : "through a pipe", SDL_GetError());
+	} else {
+		compare_maps(loaded, streamed);
+	}
+	ML2_Map_free(streamed);
+	ML2_Map_free(loaded);
+}
+
+static void save_and_stream(const char *name, ML2_Map *map) {
+	size_t size;
+	Uint8 *data = map ? ML2_Map_serializeToMem(map, &size) : NULL;
+	if (!data) {
+		printf("%s\n", name);
+		CHECK(0, "couldn't save map: %s", SDL_GetError());
+	} else {
+		stream(name, data, size);
+	}
+	SDL_free(data);
+	ML2_Map_free(map);
+}
+
+// Offset of the embedded bitmap in a saved revision 3 map: the header, then the size of a tile.
+#define BMP_OFFSET (37 + 8)
+
+int main(void) {
+	TileSheet *sheet = TileSheet_create(TILESHEET_PATHS[TILESHEET_MOON], NULL, 16, 16, TILESHEET_CREATESURFACE);
+	if (!sheet) {
+		fprintf(stderr, "%s (run this from the root of the project)\n", SDL_GetError());
+		return 1;
+	}
+
+	save_and_stream("built-in tilesheet", make_map(0, TILESHEET_MOON, NULL));
+	save_and_stream("compressed", make_map(ML2_MAP_COMPRESSED, TILESHEET_MOON, NULL));
+	save_and_stream("chunked", make_map(ML2_MAP_CHUNKED, TILESHEET_MOON, NULL));
+	save_and_stream("embedded raw pixels", make_map(ML2_MAP_RAW_SHEET, TILESHEET_CUSTOM, TileSheet_retain(sheet)));
+
+	// The size of an embedded bitmap is known, except in maps saved by programs that leave it out.
+	size_t size;
+	ML2_Map *map = make_map(0, TILESHEET_CUSTOM, sheet);
+	Uint8 *data = map ? ML2_Map_serializeToMem(map, &size) : NULL;
+	ML2_Map_free(map);
+	if (!data || SDL_memcmp(data + BMP_OFFSET, "BM", 2) != 0) {
+		fprintf(stderr, "Couldn't save a map with an embedded bitmap\n");
+		return 1;
+	}
+	stream("embedded bitmap", data, size);
+	SDL_memset(data + BMP_OFFSET + 2, 0, 4);
+	stream("embedded bitmap without its size", data, size);
+
+	// A bitmap claiming to be bigger than its dimensions allow is an error.
+	SDL_memset(data + BMP_OFFSET + 2, 0xFF, 3);
+	Pipe pipe = {data, size, 0};
+	SDL_RWops *rw = open_pipe(&pipe);
+	printf("embedded bitmap with a bad size\n");
+	map = rw ? ML2_Map_loadFromRWops(rw, SDL_TRUE, NULL) : NULL;
+	CHECK(!map, "map loaded anyway");
+	ML2_Map_free(map);
+	SDL_free(data);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All maps matched\n");
+	return 0;
+}